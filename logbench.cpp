@@ -0,0 +1,324 @@
+//
+// Logger benchmarks, prints one CSV line (or JSON object) per measurement
+//   scenario,param,threads,ops,records_per_sec,ns_per_op,p50_ns,p90_ns,p99_ns,p999_ns,max_ns
+//
+// Scenarios
+//   disabled   - Debug with the global level at WARN, param is unused
+//   null       - Info into a sink which drops everything, measures the formatting and dispatch
+//   file       - Info into LogFileSink
+//   rolling    - Info into LogRollingFileSink rolling over every 4 MB
+//   msgsize    - Info into the null sink, param is the message size (crosses MsgBuffer::Extend boundaries)
+//   getlogger  - GetLogger lookups, param is the number of registered loggers
+//
+// usage: logbench [-json] [-ops <records per scenario>] [-dir <directory for log files>] [scenario ...]
+//
+// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+
+#include "logger.h"
+
+using namespace gnilk;
+
+#define DEFAULT_OPS 400000
+#define GETLOGGER_OPS 4000000
+#define LATENCY_STRIDE 16           // every n:th call is timed, timing all calls would dominate the cheap paths
+#define ROLLING_MAX_LOGSIZE "4194304"
+
+static bool bJson = false;
+static int nOpsPerScenario = DEFAULT_OPS;
+static std::string logDir = ".";
+static std::vector<std::string> scenarioFilter;
+static int nResults = 0;
+
+static const int threadCounts[] = { 1, 4, 16, 64 };
+
+//
+// Drops everything, isolates the cost of the library from the cost of the output
+//
+class LogNullSink : public LogBaseSink
+{
+public:
+    void Initialize(int /*argc*/, const char ** /*argv*/) override { SetName("LogNullSink"); }
+    int WriteLine(int /*dbgLevel*/, char * /*hdr*/, char * /*string*/) override { return 0; }
+    int WriteBatch(const LogRecord * /*records*/, int /*nRecords*/) override { return 0; }
+    void Close() override {}
+};
+
+typedef struct
+{
+    const char *scenario;
+    int param;
+    int threads;
+    double ops;
+    double elapsedNs;
+    std::vector<uint32_t> latencies;
+} BenchResult;
+
+static inline int64_t NowNs() {
+    return (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool ScenarioEnabled(const char *scenario) {
+    if (scenarioFilter.empty()) {
+        return true;
+    }
+    return (std::find(scenarioFilter.begin(), scenarioFilter.end(), scenario) != scenarioFilter.end());
+}
+
+static double Percentile(std::vector<uint32_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = (size_t) (p * (sorted.size() - 1) + 0.5);
+    return (double) sorted[idx];
+}
+
+static void Report(BenchResult &res) {
+    std::sort(res.latencies.begin(), res.latencies.end());
+    double nsPerOp = res.elapsedNs / res.ops;
+    double recPerSec = (res.elapsedNs > 0) ? (res.ops * 1000000000.0 / res.elapsedNs) : 0;
+    double p50 = Percentile(res.latencies, 0.50);
+    double p90 = Percentile(res.latencies, 0.90);
+    double p99 = Percentile(res.latencies, 0.99);
+    double p999 = Percentile(res.latencies, 0.999);
+    double pMax = res.latencies.empty() ? 0 : (double) res.latencies.back();
+
+    if (bJson) {
+        printf("%s  {\"scenario\":\"%s\",\"param\":%d,\"threads\":%d,\"ops\":%.0f,\"records_per_sec\":%.0f,\"ns_per_op\":%.1f,"
+               "\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"p999_ns\":%.0f,\"max_ns\":%.0f}",
+               nResults ? ",\n" : "", res.scenario, res.param, res.threads, res.ops, recPerSec, nsPerOp, p50, p90, p99, p999, pMax);
+    } else {
+        printf("%s,%d,%d,%.0f,%.0f,%.1f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+               res.scenario, res.param, res.threads, res.ops, recPerSec, nsPerOp, p50, p90, p99, p999, pMax);
+    }
+    fflush(stdout);
+    nResults++;
+}
+
+//
+// Runs 'fn(threadIndex, i)' nOps times spread over nThreads, every LATENCY_STRIDE call is timed
+//
+template<typename F>
+static void RunThreads(BenchResult &res, int nThreads, int nOps, F fn) {
+    int nPerThread = (nOps + nThreads - 1) / nThreads;
+    std::vector<std::vector<uint32_t> > latencies(nThreads);
+    std::vector<std::thread> threads;
+
+    int64_t tStart = NowNs();
+    for (int t = 0; t < nThreads; t++) {
+        threads.push_back(std::thread([&latencies, &fn, t, nPerThread]() {
+            std::vector<uint32_t> &lat = latencies[t];
+            lat.reserve(nPerThread / LATENCY_STRIDE + 1);
+            for (int i = 0; i < nPerThread; i++) {
+                if ((i % LATENCY_STRIDE) != 0) {
+                    fn(t, i);
+                    continue;
+                }
+                int64_t t0 = NowNs();
+                fn(t, i);
+                lat.push_back((uint32_t) std::min<int64_t>(NowNs() - t0, UINT32_MAX));
+            }
+        }));
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    // Async mode and buffered sinks, count the time it takes to get everything out
+    Logger::Flush();
+    res.elapsedNs = (double) (NowNs() - tStart);
+    res.threads = nThreads;
+    res.ops = (double) nPerThread * nThreads;
+    for (auto &lat: latencies) {
+        res.latencies.insert(res.latencies.end(), lat.begin(), lat.end());
+    }
+}
+
+static std::string LogPath(const char *name) {
+    return logDir + "/" + name;
+}
+
+static void RemoveLogFiles(const char *name) {
+    char tmp[1024];
+    remove(LogPath(name).c_str());
+    snprintf(tmp, sizeof(tmp), "%s.next.log", LogPath(name).c_str());
+    remove(tmp);
+    for (int i = 1; i < 10; i++) {
+        snprintf(tmp, sizeof(tmp), "%s.%d.log", LogPath(name).c_str(), i);
+        remove(tmp);
+    }
+}
+
+//
+// Logs 'Info' records through the given sink, the sink is removed afterwards
+//
+static void BenchSink(const char *scenario, ILogOutputSink *(*createSink)(), int msgSize, int nThreads, int nOps) {
+    ILogOutputSink *pSink = createSink();
+    Logger::AddSink(pSink, "bench");
+    ILogger *pLogger = Logger::GetLogger("bench");
+
+    std::string payload(msgSize, 'x');
+    const char *sPayload = payload.c_str();
+
+    BenchResult res;
+    res.scenario = scenario;
+    res.param = msgSize;
+    RunThreads(res, nThreads, nOps, [pLogger, sPayload](int t, int i) {
+        pLogger->Info("thread %d record %d %s", t, i, sPayload);
+    });
+    Logger::RemoveSink("bench");
+    Report(res);
+}
+
+static ILogOutputSink *CreateNullSink() {
+    return new LogNullSink();
+}
+
+static ILogOutputSink *CreateFileSink() {
+    RemoveLogFiles("logbench_file.log");
+    std::string path = LogPath("logbench_file.log");
+    const char *args[] = { "file", path.c_str() };
+    ILogOutputSink *pSink = new LogFileSink();
+    pSink->Initialize(2, args);
+    return pSink;
+}
+
+static ILogOutputSink *CreateRollingSink() {
+    RemoveLogFiles("logbench_rolling");
+    std::string path = LogPath("logbench_rolling");
+    const char *args[] = { "file", path.c_str() };
+    ILogOutputSink *pSink = new LogRollingFileSink();
+    pSink->GetProperties()->SetValue("maxlogsize", ROLLING_MAX_LOGSIZE);
+    pSink->GetProperties()->SetValue("maxbackupindex", "2");
+    pSink->Initialize(2, args);
+    return pSink;
+}
+
+//
+// Debug with the global level at WARN, should be a couple of loads and a compare
+//
+static void BenchDisabled(int nThreads) {
+    Logger::AddSink(new LogNullSink(), "bench");
+    Logger::GetProperties()->SetDebugLevel(Logger::kMCWarning);
+    ILogger *pLogger = Logger::GetLogger("bench");
+
+    BenchResult res;
+    res.scenario = "disabled";
+    res.param = 0;
+    RunThreads(res, nThreads, nOpsPerScenario * 10, [pLogger](int t, int i) {
+        pLogger->Debug("thread %d record %d", t, i);
+    });
+    Logger::GetProperties()->SetDebugLevel(Logger::kMCNone);
+    Logger::RemoveSink("bench");
+    Report(res);
+}
+
+// Names look like one logger per connection object, same name different prefix
+static std::string PrefixFor(int idx) {
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "conn%d", idx);
+    return std::string(tmp);
+}
+
+//
+// Time GetLogger for already registered loggers, cost should not depend on the number of loggers
+//
+static void BenchGetLogger(int nLoggers, int nThreads) {
+    std::vector<std::string> prefixes;
+    for (int i = 0; i < nLoggers; i++) {
+        prefixes.push_back(PrefixFor(i));
+        Logger::GetLogger("connection", prefixes.back().c_str());
+    }
+
+    BenchResult res;
+    res.scenario = "getlogger";
+    res.param = nLoggers;
+    RunThreads(res, nThreads, GETLOGGER_OPS, [&prefixes, nLoggers](int t, int i) {
+        // cheap hash, visit the loggers in a scattered order
+        uint32_t x = ((uint32_t) t * 2654435761u) ^ ((uint32_t) i * 1664525u + 1013904223u);
+        ILogger *pLogger = Logger::GetLogger("connection", prefixes[x % nLoggers].c_str());
+        if (pLogger == NULL) {
+            abort();
+        }
+    });
+    Report(res);
+}
+
+static void Usage() {
+    fprintf(stderr, "usage: logbench [-json] [-ops <n>] [-dir <path>] [disabled|null|file|rolling|msgsize|getlogger ...]\n");
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-json")) {
+            bJson = true;
+        } else if (!strcmp(argv[i], "-ops") && (i + 1 < argc)) {
+            nOpsPerScenario = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-dir") && (i + 1 < argc)) {
+            logDir = argv[++i];
+        } else if (argv[i][0] == '-') {
+            Usage();
+            return 1;
+        } else {
+            scenarioFilter.push_back(argv[i]);
+        }
+    }
+    if (nOpsPerScenario <= 0) {
+        Usage();
+        return 1;
+    }
+
+    // Benchmarks measure the library, not the terminal
+    Logger::Initialize();
+    Logger::RemoveSink("console");
+
+    if (bJson) {
+        printf("[\n");
+    } else {
+        printf("scenario,param,threads,ops,records_per_sec,ns_per_op,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+    }
+
+    for (int t: threadCounts) {
+        if (ScenarioEnabled("disabled")) BenchDisabled(t);
+    }
+    for (int t: threadCounts) {
+        if (ScenarioEnabled("null")) BenchSink("null", CreateNullSink, 64, t, nOpsPerScenario);
+    }
+    for (int t: threadCounts) {
+        if (ScenarioEnabled("file")) BenchSink("file", CreateFileSink, 64, t, nOpsPerScenario);
+    }
+    for (int t: threadCounts) {
+        if (ScenarioEnabled("rolling")) BenchSink("rolling", CreateRollingSink, 64, t, nOpsPerScenario);
+    }
+    if (ScenarioEnabled("msgsize")) {
+        // Messages are formatted to a 4 KB buffer which is extended in 4 KB steps, sizes on both sides of the steps
+        const int msgSizes[] = { 16, 256, 4000, 4200, 8100, 8300, 16300, 16500, 65000, 66000 };
+        for (int sz: msgSizes) {
+            // same amount of data for the large messages, at least as many records for the small ones
+            int nOps = (sz > 1024) ? (int) ((int64_t) nOpsPerScenario * 1024 / sz) : nOpsPerScenario;
+            BenchSink("msgsize", CreateNullSink, sz, 1, (nOps > 0) ? nOps : 1);
+        }
+    }
+    if (ScenarioEnabled("getlogger")) {
+        const int loggerCounts[] = { 10, 100, 1000, 10000 };
+        for (int t: threadCounts) {
+            for (int n: loggerCounts) {
+                BenchGetLogger(n, t);
+            }
+        }
+    }
+
+    if (bJson) {
+        printf("\n]\n");
+    }
+    RemoveLogFiles("logbench_file.log");
+    RemoveLogFiles("logbench_rolling");
+    return 0;
+}
@@ -0,0 +1,283 @@
+//
+// Decodes files written by LogBinaryFileSink
+//   logdecode [-json] <file>
+// Text output uses the same layout as the text sinks, JSON output is one object per line.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "logger.h"
+#include "logger_internal.h"
+
+using namespace gnilk;
+
+typedef struct
+{
+    std::string name;
+    bool hasPrefix;
+    std::string prefix;
+} LoggerEntry;
+
+// Reads a varint from the stream, false at end of file
+static bool ReadVarint(FILE *f, uint64_t *v) {
+    uint64_t res = 0;
+    for (int n = 0; n < LOG_BIN_MAX_VARINT; n++) {
+        int c = fgetc(f);
+        if (c == EOF) {
+            return false;
+        }
+        res |= (uint64_t)(c & 0x7f) << (7 * n);
+        if (!(c & 0x80)) {
+            *v = res;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 'dd.mm.yyyy hh:mm:ss.mmm' like Logger::TimeString, or ISO 8601 for JSON
+static void FormatTime(char *dst, size_t nMax, int64_t tNs, int precision, bool bIso) {
+    time_t tSec = (time_t)(tNs / 1000000000LL);
+    long tNsec = (long)(tNs % 1000000000LL);
+    struct tm gmt;
+#ifdef WIN32
+    gmtime_s(&gmt, &tSec);
+#else
+    gmtime_r(&tSec, &gmt);
+#endif
+    char frac[16];
+    switch (precision) {
+        case Logger::kTPNanos :
+            snprintf(frac, sizeof(frac), "%.9ld", tNsec);
+            break;
+        case Logger::kTPMicros :
+            snprintf(frac, sizeof(frac), "%.6ld", tNsec / 1000);
+            break;
+        default:
+            snprintf(frac, sizeof(frac), "%.3ld", tNsec / 1000000);
+            break;
+    }
+    if (bIso) {
+        snprintf(dst, nMax, "%.4d-%.2d-%.2dT%.2d:%.2d:%.2d.%sZ", gmt.tm_year + 1900, gmt.tm_mon + 1, gmt.tm_mday,
+            gmt.tm_hour, gmt.tm_min, gmt.tm_sec, frac);
+    } else {
+        snprintf(dst, nMax, "%.2d.%.2d.%.4d %.2d:%.2d:%.2d.%s", gmt.tm_mday, gmt.tm_mon + 1, gmt.tm_year + 1900,
+            gmt.tm_hour, gmt.tm_min, gmt.tm_sec, frac);
+    }
+}
+
+static void PutJsonString(const char *s, size_t len) {
+    putchar('"');
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        switch (c) {
+            case '"' : fputs("\\\"", stdout); break;
+            case '\\' : fputs("\\\\", stdout); break;
+            case '\n' : fputs("\\n", stdout); break;
+            case '\r' : fputs("\\r", stdout); break;
+            case '\t' : fputs("\\t", stdout); break;
+            default:
+                if (c < 0x20) {
+                    printf("\\u%.4x", c);
+                } else {
+                    putchar(c);
+                }
+                break;
+        }
+    }
+    putchar('"');
+}
+
+// ',"fields":{"key":value,...}' with the values as they were logged
+static void PutJsonFields(const uint8_t *fields, int len) {
+    LogFieldReader reader(fields, len);
+    LogField field;
+    bool bFirst = true;
+    fputs(",\"fields\":{", stdout);
+    while (reader.Next(field)) {
+        if (!bFirst) {
+            putchar(',');
+        }
+        bFirst = false;
+        PutJsonString(field.key, strlen(field.key));
+        putchar(':');
+        switch (field.type) {
+            case LogField::kInt : printf("%lld", field.value.i); break;
+            case LogField::kUInt : printf("%llu", field.value.u); break;
+            case LogField::kDouble :
+                if ((field.value.d == field.value.d) && (field.value.d - field.value.d == 0)) {
+                    printf("%.17g", field.value.d);
+                } else {
+                    fputs("null", stdout);		// NaN and infinity have no JSON form
+                }
+                break;
+            case LogField::kBool : fputs(field.value.b ? "true" : "false", stdout); break;
+            case LogField::kString : PutJsonString(field.str, field.strLen); break;
+        }
+    }
+    putchar('}');
+}
+
+// ' key=value ...' like the text sinks
+static void PutTextFields(const uint8_t *fields, int len) {
+    LogFieldReader reader(fields, len);
+    LogField field;
+    std::vector<char> text;
+    while (reader.Next(field)) {
+        text.resize(LogFieldReader::MaxTextSize(field));
+        fwrite(&text[0], 1, LogFieldReader::Render(&text[0], field), stdout);
+    }
+}
+
+static void Usage() {
+    fprintf(stderr, "usage: logdecode [-json] <file>\n");
+}
+
+int main(int argc, char **argv) {
+    bool bJson = false;
+    const char *filename = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-json")) {
+            bJson = true;
+        } else if (filename == NULL) {
+            filename = argv[i];
+        } else {
+            Usage();
+            return 1;
+        }
+    }
+    if (filename == NULL) {
+        Usage();
+        return 1;
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "logdecode: can't open '%s'\n", filename);
+        return 1;
+    }
+    uint8_t hdr[LOG_BIN_FILE_HEADER_LEN];
+    if ((fread(hdr, 1, LOG_BIN_FILE_HEADER_LEN, f) != LOG_BIN_FILE_HEADER_LEN) || memcmp(hdr, LOG_BIN_MAGIC, LOG_BIN_MAGIC_LEN)) {
+        fprintf(stderr, "logdecode: '%s' is not a binary log file\n", filename);
+        fclose(f);
+        return 1;
+    }
+    bool bAutoPrefix = (hdr[LOG_BIN_MAGIC_LEN] & LOG_BIN_FLAG_AUTOPREFIX) ? true : false;
+    int precision = hdr[LOG_BIN_MAGIC_LEN + 1];
+
+    std::map<uint64_t, LoggerEntry> loggers;
+    std::vector<uint8_t> body;
+    int64_t tPrevious = 0;
+    uint64_t len;
+    while (ReadVarint(f, &len)) {
+        body.resize(len);
+        if ((len == 0) || (fread(&body[0], 1, len, f) != len)) {
+            fprintf(stderr, "logdecode: truncated record\n");
+            break;
+        }
+        const uint8_t *ptr = &body[1];
+        size_t left = len - 1;
+        uint64_t v[6];
+        int nFields = (body[0] == LOG_BIN_TAG_LOGGER) ? 2 : (body[0] == LOG_BIN_TAG_FIELDS) ? 6 : 5;
+        if ((body[0] != LOG_BIN_TAG_LOGGER) && (body[0] != LOG_BIN_TAG_RECORD) && (body[0] != LOG_BIN_TAG_FIELDS)) {
+            // unknown, skip it
+            continue;
+        }
+        bool bOk = true;
+        for (int i = 0; (i < nFields) && bOk; i++) {
+            int n = LogGetVarint(ptr, left, &v[i]);
+            bOk = (n > 0);
+            ptr += n;
+            left -= n;
+        }
+        if (!bOk) {
+            fprintf(stderr, "logdecode: malformed record\n");
+            break;
+        }
+
+        if (body[0] == LOG_BIN_TAG_LOGGER) {
+            LoggerEntry entry;
+            uint64_t prefixField;
+            if (v[1] > left) break;
+            entry.name.assign((const char *)ptr, v[1]);
+            ptr += v[1];
+            left -= v[1];
+            int n = LogGetVarint(ptr, left, &prefixField);
+            if ((n == 0) || (prefixField > left - n + 1)) break;
+            entry.hasPrefix = (prefixField > 0);
+            if (entry.hasPrefix) {
+                entry.prefix.assign((const char *)ptr + n, prefixField - 1);
+            }
+            loggers[v[0]] = entry;
+            continue;
+        }
+
+        int64_t tNow = tPrevious + LogUnZigZag(v[0]);
+        tPrevious = tNow;
+        int level = (int)v[1];
+        uint32_t tid = (uint32_t)v[3];
+        int indent = (int)v[4];
+        const char *msg = (const char *)ptr;
+        size_t msgLen = left;
+        const uint8_t *fields = NULL;
+        int fieldsLen = 0;
+        if (body[0] == LOG_BIN_TAG_FIELDS) {
+            if (v[5] > left) {
+                fprintf(stderr, "logdecode: malformed record\n");
+                break;
+            }
+            msgLen = v[5];
+            fields = ptr + msgLen;
+            fieldsLen = (int)(left - msgLen);
+        }
+
+        static LoggerEntry noLogger = { "", false, "" };
+        auto it = loggers.find(v[2]);
+        const LoggerEntry &logger = (it != loggers.end()) ? it->second : noLogger;
+        const char *sLevel = Logger::MessageClassNameFromInt(level);
+
+        char sTime[48];
+        if (bJson) {
+            char sTid[16];
+            FormatTime(sTime, sizeof(sTime), tNow, Logger::kTPNanos, true);
+            snprintf(sTid, sizeof(sTid), "%.8x", tid);
+            printf("{\"time\":\"%s\",\"level\":%d,\"levelName\":\"%s\",\"thread\":\"%s\",\"logger\":", sTime, level, sLevel, sTid);
+            PutJsonString(logger.name.c_str(), logger.name.length());
+            fputs(",\"prefix\":", stdout);
+            if (logger.hasPrefix) {
+                PutJsonString(logger.prefix.c_str(), logger.prefix.length());
+            } else {
+                fputs("null", stdout);
+            }
+            printf(",\"indent\":%d,\"message\":", indent);
+            PutJsonString(msg, msgLen);
+            if (fields != NULL) {
+                PutJsonFields(fields, fieldsLen);
+            }
+            fputs("}\n", stdout);
+        } else {
+            FormatTime(sTime, sizeof(sTime), tNow, precision, false);
+            if (!logger.hasPrefix) {
+                if (bAutoPrefix) {
+                    printf("%s [%.8x::                ] %8s %32s - %*s", sTime, tid, sLevel, logger.name.c_str(), indent, "");
+                } else {
+                    printf("%s [%.8x] %8s %32s - %*s", sTime, tid, sLevel, logger.name.c_str(), indent, "");
+                }
+            } else {
+                printf("%s [%.8x::%16s] %8s %32s - %*s", sTime, tid, logger.prefix.c_str(), sLevel, logger.name.c_str(), indent, "");
+            }
+            fwrite(msg, 1, msgLen, stdout);
+            if (fields != NULL) {
+                PutTextFields(fields, fieldsLen);
+            }
+            putchar('\n');
+        }
+    }
+    fclose(f);
+    return 0;
+}
@@ -21,7 +21,7 @@ int tryCatchTest(int wef) {
 
 void testRollingAppender()
 {
-	char *argv[] = {"file","logfile",NULL};
+	const char *argv[] = {"file","logfile",NULL};
 	LogRollingFileSink *rollSink = new LogRollingFileSink();
 	Logger::AddSink(rollSink, "rollingAppender",2, argv);
 
@@ -62,6 +62,7 @@ int main(int argc, char **argv)
 	}
 	// Should be on the previous indentdation level
 	pLog->Debug("Done!");
+	LOG_INFO(pLog, "Type safe: {} {} {}", 1, "two", 3.0);
 
 
 	gnilk::ILogger *logger2 = gnilk::Logger::GetLogger("function","myclass");
@@ -19,6 +19,18 @@
 
    On Windows (WIN32) Critical Sections are created by default and there is not need to use 'HAVE_PTHREADS'
 
+ Async mode (requires LOGGER_HAVE_PTHREADS)
+   Logger::EnableAsync() starts a writer thread. Producers format the message, capture time, thread and
+   indent and push the record to a bounded lock-free ring; the writer builds the header and calls the sinks.
+   Ordering: records reach the sinks in the order producers claimed a slot in the ring. Records from one
+   thread are therefore always written in program order. Records from different threads are totally ordered
+   by slot claim, since the time is taken just before the claim their timestamps can be slightly out of order.
+   When the ring is full producers either wait for a free slot (default) or drop the record (counted).
+   Logger::CloseAll(), Logger::DisableAsync() and process exit (atexit) drain the ring before returning.
+   Logger::Flush() waits until everything queued so far has been written and flushes the sinks.
+   Logger::SetDeferredFormatting(true) moves the printf formatting to the writer thread as well, the
+   producer only packs the arguments. Format strings must outlive the record (literals are fine).
+
  
  Layout can be changed in: Logger::WriteReportString
  
@@ -77,6 +89,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <ctype.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -97,13 +111,24 @@
 #else
 
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #endif
 
 #include <list>
 #include <map>
 #include <algorithm>
+#include <new>
 
 #include "logger.h"
 #include "logger_internal.h"
@@ -112,7 +137,6 @@
 #define DEFAULT_DEBUG_LEVEL 0        // used by constructors, default is output everything
 #define DEFAULT_SINK_NAME ("")
 #define DEFAULT_LOGFILE_NAME ("logfile")
-#define DEFAULT_BUFFER_SIZE 4096
 
 //#define DEBUG 1
 
@@ -120,6 +144,8 @@ using namespace std;
 using namespace gnilk;
 
 static int StrExplode(std::vector<std::string> *strList, char *mString, int chrSplit);
+static void PostHousekeeping(const std::function<void()> &job);
+static void WaitHousekeeping();
 static char *StrTrim(char *s);
 extern "C" {
 ILogOutputSink *LOG_CALLCONV CreateSink(const char *className) {
@@ -133,6 +159,12 @@ static LOG_SINK_FACTORY sinkFactoryList[] =
                 "LogConsoleSink", LogConsoleSink::CreateInstance,
                 "LogRollingFileSink", LogRollingFileSink::CreateInstance,
                 "LogFileSink", LogFileSink::CreateInstance,
+                "LogBinaryFileSink", LogBinaryFileSink::CreateInstance,
+                "LogTimeRollingFileSink", LogTimeRollingFileSink::CreateInstance,
+#ifndef WIN32
+                "LogDirectFileSink", LogDirectFileSink::CreateInstance,
+                "LogMMapFileSink", LogMMapFileSink::CreateInstance,
+#endif
 #if defined(LOGGER_HAVE_SERIAL)
                 "LogSerialSink", LogSerialSink::CreateInstance,
 #endif
@@ -297,6 +329,116 @@ int LogFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
     }
     return res;
 }
+#ifndef WIN32
+// Segments per writev call, two per record (header and message)
+#if defined(IOV_MAX) && (IOV_MAX < 512)
+#define FILE_SINK_MAX_IOV IOV_MAX
+#else
+#define FILE_SINK_MAX_IOV 512
+#endif
+#define FILE_SINK_MIN_WRITEV_BATCH 8
+
+// writev until everything is written, a partial write can leave us in the middle of a segment
+static int WriteVector(int fd, struct iovec *iov, int nIov) {
+    while (nIov > 0) {
+        ssize_t res = writev(fd, iov, nIov);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while ((nIov > 0) && ((size_t) res >= iov->iov_len)) {
+            res -= iov->iov_len;
+            iov++;
+            nIov--;
+        }
+        if (nIov > 0) {
+            iov->iov_base = (char *) iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+static int WriteAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, data, len);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += res;
+        len -= (size_t) res;
+    }
+    return 0;
+}
+#endif
+
+// Through stdio, not virtual - derived sinks call WriteBatch with their lock held
+int LogFileSink::WriteBuffered(const LogRecord *records, int nRecords) {
+    int nTotal = 0;
+    for (int i = 0; i < nRecords; i++) {
+        int res = LogFileSink::WriteLine(records[i].level, records[i].hdr, records[i].string);
+        if (res > 0) {
+            nTotal += res;
+        }
+    }
+    return nTotal;
+}
+
+//
+// Writes the batch with writev, header and message go out as separate segments without being copied together
+//
+int LogFileSink::WriteBatch(const LogRecord *records, int nRecords) {
+    if (fOut == NULL) {
+        return SINK_WRITE_IO_ERROR;
+    }
+#ifdef WIN32
+    return WriteBuffered(records, nRecords);
+#else
+    // A few records are cheaper to buffer in stdio than to write with a syscall of their own
+    if (nRecords < FILE_SINK_MIN_WRITEV_BATCH) {
+        return WriteBuffered(records, nRecords);
+    }
+    struct iovec iov[FILE_SINK_MAX_IOV];
+    int nIov = 0;
+    int nTotal = 0;
+
+    // Anything written through 'WriteLine' must reach the file first
+    fflush(fOut);
+    int fd = fileno(fOut);
+    for (int i = 0; i < nRecords; i++) {
+        const LogRecord &rec = records[i];
+        if (!WithinRange(rec.level)) {
+            continue;
+        }
+        if (nIov + 2 > FILE_SINK_MAX_IOV) {
+            if (WriteVector(fd, iov, nIov) < 0) {
+                return SINK_WRITE_IO_ERROR;
+            }
+            nIov = 0;
+        }
+        if ((rec.hdr != NULL) && (rec.hdrLen > 0)) {
+            iov[nIov].iov_base = rec.hdr;
+            iov[nIov].iov_len = rec.hdrLen;
+            nIov++;
+            nTotal += rec.hdrLen;
+        }
+        iov[nIov].iov_base = rec.string;
+        iov[nIov].iov_len = rec.len;
+        nIov++;
+        nTotal += rec.len;
+    }
+    if ((nIov > 0) && (WriteVector(fd, iov, nIov) < 0)) {
+        return SINK_WRITE_IO_ERROR;
+    }
+    return nTotal;
+#endif
+}
+
 void LogFileSink::Close() {
     if (fOut != NULL) {
         fclose(fOut);
@@ -311,6 +453,303 @@ void LogFileSink::Flush() {
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Direct file sink
+//
+#ifndef WIN32
+#define DIRECT_SINK_ALIGNMENT 4096
+#define DIRECT_SINK_DEFAULT_BUFFER_SIZE (256 * 1024)
+#define DIRECT_SINK_DEFAULT_FLUSH_INTERVAL_MS 1000
+
+static uint64_t MonotonicMs() {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) (ts.tv_nsec / 1000000);
+}
+
+LogDirectFileSink::LogDirectFileSink() {
+    fd = -1;
+    buffer = NULL;
+    szBuffer = DIRECT_SINK_DEFAULT_BUFFER_SIZE;
+    nBuffered = 0;
+    nFlushBytes = 0;    // 0 - when the buffer is full
+    flushIntervalMs = DIRECT_SINK_DEFAULT_FLUSH_INTERVAL_MS;
+    flushLevel = Logger::kMCError;
+    bSync = false;
+    bAppend = false;
+    tLastWriteOut = 0;
+    pLock = new LogMutex();
+#ifdef LOGGER_HAVE_PTHREADS
+    bTimerStarted = false;
+    bStopTimer = false;
+    pthread_mutex_init(&timerLock, NULL);
+    pthread_cond_init(&timerCond, NULL);
+#endif
+}
+
+LogDirectFileSink::~LogDirectFileSink() {
+    Close();
+    free(buffer);
+    delete pLock;
+#ifdef LOGGER_HAVE_PTHREADS
+    pthread_cond_destroy(&timerCond);
+    pthread_mutex_destroy(&timerLock);
+#endif
+}
+
+ILogOutputSink *LogDirectFileSink::CreateInstance() {
+    return (ILogOutputSink *) (new LogDirectFileSink());
+}
+
+//
+// Arguments override the properties (e.g. from logger.res)
+//   file <name>, buffersize <bytes>, flushbytes <bytes>, flushinterval <ms>, flushlevel <level>, sync, append
+//
+void LogDirectFileSink::ParseArgs(int argc, const char **argv) {
+    char tmp[64];
+    szBuffer = (size_t) atol(properties.GetValue(LOG_CONF_BUFFERSIZE, tmp, 64, "262144"));
+    nFlushBytes = (size_t) atol(properties.GetValue(LOG_CONF_FLUSHBYTES, tmp, 64, "0"));
+    flushIntervalMs = atoi(properties.GetValue(LOG_CONF_FLUSHINTERVAL, tmp, 64, "1000"));
+    properties.GetValue(LOG_CONF_FLUSHLEVEL, tmp, 64, "400");
+    flushLevel = atoi(tmp) ? atoi(tmp) : Logger::MessageLevelFromName(tmp);
+    bSync = !strcmp(properties.GetValue(LOG_CONF_SYNC, tmp, 64, "false"), "true");
+    bAppend = !strcmp(properties.GetValue(LOG_CONF_APPEND, tmp, 64, "false"), "true");
+
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "file") && (i + 1 < argc)) {
+            properties.SetValue(LOG_CONF_LOGFILE, argv[++i]);
+        } else if (!strcmp(argv[i], LOG_CONF_BUFFERSIZE) && (i + 1 < argc)) {
+            szBuffer = (size_t) atol(argv[++i]);
+        } else if (!strcmp(argv[i], LOG_CONF_FLUSHBYTES) && (i + 1 < argc)) {
+            nFlushBytes = (size_t) atol(argv[++i]);
+        } else if (!strcmp(argv[i], LOG_CONF_FLUSHINTERVAL) && (i + 1 < argc)) {
+            flushIntervalMs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], LOG_CONF_FLUSHLEVEL) && (i + 1 < argc)) {
+            i++;
+            flushLevel = atoi(argv[i]) ? atoi(argv[i]) : Logger::MessageLevelFromName(argv[i]);
+        } else if (!strcmp(argv[i], LOG_CONF_SYNC)) {
+            bSync = true;
+        } else if (!strcmp(argv[i], LOG_CONF_APPEND)) {
+            bAppend = true;
+        }
+    }
+
+    // The buffer is a whole number of pages
+    if (szBuffer < DIRECT_SINK_ALIGNMENT) szBuffer = DIRECT_SINK_ALIGNMENT;
+    szBuffer = ((szBuffer + DIRECT_SINK_ALIGNMENT - 1) / DIRECT_SINK_ALIGNMENT) * DIRECT_SINK_ALIGNMENT;
+    if ((nFlushBytes == 0) || (nFlushBytes > szBuffer)) nFlushBytes = szBuffer;
+}
+
+void LogDirectFileSink::Initialize(int argc, const char **argv) {
+    ParseArgs(argc, argv);
+    SetName("LogDirectFileSink");
+
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, DIRECT_SINK_ALIGNMENT, szBuffer) != 0) {
+        return;
+    }
+    buffer = (char *) ptr;
+
+    int flags = O_WRONLY | O_CREAT | (bAppend ? O_APPEND : O_TRUNC);
+    fd = open(properties.GetLogfileName(), flags, 0644);
+#ifdef DEBUG
+    if (fd < 0) {
+        printf("LogDirectFileSink::Initialize, failed to open file - errno=%d, %s\n", errno, strerror(errno));
+    }
+#endif
+    tLastWriteOut = MonotonicMs();
+#ifdef LOGGER_HAVE_PTHREADS
+    if ((fd >= 0) && (flushIntervalMs > 0)) {
+        StartTimer();
+    }
+#endif
+}
+
+#ifdef LOGGER_HAVE_PTHREADS
+//
+// The flush interval holds for a quiet sink as well, the timer thread writes out what has been buffered
+// for 'flushinterval' ms. It wakes up when the next write-out is due.
+//
+void LogDirectFileSink::StartTimer() {
+    pthread_mutex_lock(&timerLock);
+    bStopTimer = false;
+    if (!bTimerStarted && (pthread_create(&timerThread, NULL, LogDirectFileSink::TimerFunc, this) == 0)) {
+        bTimerStarted = true;
+    }
+    pthread_mutex_unlock(&timerLock);
+}
+
+void LogDirectFileSink::StopTimer() {
+    pthread_mutex_lock(&timerLock);
+    if (!bTimerStarted) {
+        pthread_mutex_unlock(&timerLock);
+        return;
+    }
+    bStopTimer = true;
+    pthread_cond_signal(&timerCond);
+    pthread_mutex_unlock(&timerLock);
+    pthread_join(timerThread, NULL);
+    bTimerStarted = false;
+}
+
+void *LogDirectFileSink::TimerFunc(void *arg) {
+    LogDirectFileSink *pSink = (LogDirectFileSink *) arg;
+    pSink->RunTimer();
+    return NULL;
+}
+
+void LogDirectFileSink::RunTimer() {
+    int waitMs = flushIntervalMs;
+    pthread_mutex_lock(&timerLock);
+    while (!bStopTimer) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += waitMs / 1000;
+        deadline.tv_nsec += (long) (waitMs % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&timerCond, &timerLock, &deadline);
+        if (bStopTimer) {
+            break;
+        }
+        pthread_mutex_unlock(&timerLock);
+
+        pLock->Lock();
+        uint64_t tElapsed = MonotonicMs() - tLastWriteOut;
+        if (tElapsed >= (uint64_t) flushIntervalMs) {
+            WriteOut();
+            tElapsed = 0;
+        }
+        pLock->Unlock();
+        waitMs = flushIntervalMs - (int) tElapsed;
+
+        pthread_mutex_lock(&timerLock);
+    }
+    pthread_mutex_unlock(&timerLock);
+}
+#endif
+
+// Writes the buffer to the file, lock must be held
+bool LogDirectFileSink::WriteOut() {
+    tLastWriteOut = MonotonicMs();
+    if (nBuffered == 0) {
+        return true;
+    }
+    int res = WriteAll(fd, buffer, nBuffered);
+    nBuffered = 0;
+    if (res < 0) {
+        return false;
+    }
+    if (bSync) {
+#ifdef __APPLE__
+        fsync(fd);
+#else
+        fdatasync(fd);
+#endif
+    }
+    return true;
+}
+
+// Lock must be held
+bool LogDirectFileSink::Append(const char *data, size_t len) {
+    if (nBuffered + len > szBuffer) {
+        if (!WriteOut()) {
+            return false;
+        }
+        // Doesn't fit at all, skip the buffer
+        if (len > szBuffer) {
+            return (WriteAll(fd, data, len) == 0);
+        }
+    }
+    memcpy(&buffer[nBuffered], data, len);
+    nBuffered += len;
+    return true;
+}
+
+// Lock must be held
+bool LogDirectFileSink::ApplyFlushPolicy(int maxLevel) {
+    if ((maxLevel >= flushLevel) || (nBuffered >= nFlushBytes)) {
+        return WriteOut();
+    }
+    if ((flushIntervalMs > 0) && (MonotonicMs() - tLastWriteOut >= (uint64_t) flushIntervalMs)) {
+        return WriteOut();
+    }
+    return true;
+}
+
+int LogDirectFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
+    LogRecord rec = LogRecord();
+    rec.level = dbgLevel;
+    rec.hdr = hdr;
+    rec.hdrLen = (hdr != NULL) ? (int) strlen(hdr) : 0;
+    rec.string = string;
+    rec.len = (int) strlen(string);
+    return WriteBatch(&rec, 1);
+}
+
+int LogDirectFileSink::WriteBatch(const LogRecord *records, int nRecords) {
+    if ((fd < 0) || (buffer == NULL)) {
+        return SINK_WRITE_IO_ERROR;
+    }
+    int nTotal = 0;
+    int maxLevel = INT_MIN;
+    bool bOk = true;
+
+    pLock->Lock();
+    for (int i = 0; (i < nRecords) && bOk; i++) {
+        const LogRecord &rec = records[i];
+        if (!WithinRange(rec.level)) {
+            continue;
+        }
+        if ((rec.hdr != NULL) && (rec.hdrLen > 0)) {
+            bOk = Append(rec.hdr, rec.hdrLen);
+        }
+        bOk = bOk && Append(rec.string, rec.len);
+        nTotal += rec.hdrLen + rec.len;
+        if (rec.level > maxLevel) {
+            maxLevel = rec.level;
+        }
+    }
+    if (bOk && (maxLevel != INT_MIN)) {
+        bOk = ApplyFlushPolicy(maxLevel);
+    }
+    pLock->Unlock();
+
+    return bOk ? nTotal : SINK_WRITE_IO_ERROR;
+}
+
+void LogDirectFileSink::Flush() {
+    if (fd < 0) {
+        return;
+    }
+    pLock->Lock();
+    WriteOut();
+    pLock->Unlock();
+}
+
+void LogDirectFileSink::Close() {
+#ifdef LOGGER_HAVE_PTHREADS
+    // Before taking the lock, the timer thread might be waiting for it
+    StopTimer();
+#endif
+    if (fd < 0) {
+        return;
+    }
+    pLock->Lock();
+    WriteOut();
+    close(fd);
+    fd = -1;
+    pLock->Unlock();
+}
+#endif
+
 // --------------------------------------------------------------------------
 //
 // Rolling file sink
@@ -321,10 +760,34 @@ void LogFileSink::Flush() {
 
 #define LOG_MAX_FILENAME 255
 
+// Renames a file, an existing destination is replaced
+static bool RenameFile(const char *srcFileName, const char *dstFileName) {
+#ifdef WIN32
+#ifdef UNICODE
+    wchar_t w_dst[LOG_MAX_FILENAME];
+    wchar_t w_src[LOG_MAX_FILENAME];
+    mbstowcs(w_dst, dstFileName, LOG_MAX_FILENAME);
+    mbstowcs(w_src, srcFileName, LOG_MAX_FILENAME);
+    return MoveFileEx(w_src, w_dst, MOVEFILE_REPLACE_EXISTING) ? true : false;
+#else
+    return MoveFileEx(srcFileName, dstFileName, MOVEFILE_REPLACE_EXISTING) ? true : false;
+#endif
+#else
+    return (rename(srcFileName, dstFileName) == 0);
+#endif
+}
+
 LogRollingFileSink::LogRollingFileSink() : LogFileSink() {
+    nMaxBackupIndex = 0;
+    nBytesRollLimit = 0;
+    nBytes = 0;
+    fNext = NULL;
+    bPreparing = false;
+    pLock = new LogMutex();
 }
 LogRollingFileSink::~LogRollingFileSink() {
-
+    Close();
+    delete pLock;
 }
 ILogOutputSink *LogRollingFileSink::CreateInstance() {
     return (ILogOutputSink *) (new LogRollingFileSink());
@@ -336,43 +799,110 @@ char *LogRollingFileSink::GetFileName(char *dst, int idx) {
     return dst;
 }
 
-void LogRollingFileSink::RollOver() {
+char *LogRollingFileSink::GetNextFileName(char *dst) {
+    const char *sFileName = properties.GetLogfileName();
+    snprintf(dst, LOG_MAX_FILENAME, "%s.next.log", sFileName);
+    return dst;
+}
+
+//
+// Housekeeping, creates the file which takes over at the next roll over
+//
+void LogRollingFileSink::PrepareNext() {
+    char nextFileName[LOG_MAX_FILENAME];
+    FILE *f = fopen(GetNextFileName(nextFileName), "w");
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    if (f != NULL) {
+        // Reserve the blocks without changing the size, appending doesn't have to allocate
+        if (fallocate(fileno(f), FALLOC_FL_KEEP_SIZE, 0, (off_t) nBytesRollLimit)) {
+            // not supported by the file system, no problem
+        }
+    }
+#endif
+    pLock->Lock();
+    fNext = f;
+    bPreparing = false;
+    pLock->Unlock();
+}
+
+//
+// Housekeeping, closes the previous file and shifts the backups one step
+// '<file>.next.log' is already being written and becomes '<file>.1.log'
+//
+void LogRollingFileSink::ShiftBackups(FILE *fPrevious) {
+    fclose(fPrevious);
+    ShiftFiles();
+}
+
+void LogRollingFileSink::ShiftFiles() {
     char dstFileName[LOG_MAX_FILENAME];
     char srcFileName[LOG_MAX_FILENAME];
 
-    // 1) Close current file
-    LogFileSink::Close();
-    // 2) Initiate rename loop
-    for (int i = nMaxBackupIndex - 1; i > 0; i--) {
+    // 0 (zero) works like 'reset', only the current file is kept
+    int nBackups = (nMaxBackupIndex > 1) ? nMaxBackupIndex : 1;
+    remove(GetFileName(dstFileName, nBackups));
+    for (int i = nBackups - 1; i > 0; i--) {
         GetFileName(srcFileName, i);
         GetFileName(dstFileName, i + 1);
-
-#ifdef WIN32
-#ifdef UNICODE
-        {
-            wchar_t w_dst[LOG_MAX_FILENAME];
-            wchar_t w_src[LOG_MAX_FILENAME];
-            mbstowcs(w_dst, dstFileName, LOG_MAX_FILENAME);
-            mbstowcs(w_src, srcFileName, LOG_MAX_FILENAME);
-            MoveFile(w_src, w_dst);
-        }
-#else
-    MoveFile(srcFileName, dstFileName);
-#endif
-#else
-#endif
+        RenameFile(srcFileName, dstFileName);
     }
-    // 3) Open up new file
-    GetFileName(srcFileName, 1);
-    LogFileSink::Open(srcFileName, false);
+    RenameFile(GetNextFileName(srcFileName), GetFileName(dstFileName, 1));
+}
 
+// Lock must be held
+void LogRollingFileSink::RollOver() {
+    FILE *fPrevious = fOut;
+    fOut = fNext;
+    fNext = NULL;
+    nBytes = 0;
+    bPreparing = true;
+    PostHousekeeping([this, fPrevious]() {
+        ShiftBackups(fPrevious);
+        PrepareNext();
+    });
 }
 
+// Lock must be held
 void LogRollingFileSink::CheckApplyRules() {
-    if (nBytes > nBytesRollLimit) {
-        // Swap to new file..
-        RollOver();
-        nBytes = 0;
+    if ((fOut != NULL) && (nBytes > nBytesRollLimit)) {
+        if (fNext != NULL) {
+            // Swap to new file..
+            RollOver();
+        } else if (!bPreparing) {
+            // Creating the next file failed earlier, try again - keep writing to the current one meanwhile
+            bPreparing = true;
+            PostHousekeeping([this]() {
+                PrepareNext();
+            });
+        }
+    }
+}
+
+//
+// A crash in the middle of a roll over leaves '<file>.next.log' with the newest records - the roll over switched
+// to it but the backups were not shifted yet. Finish that roll over, PrepareNext would truncate the file otherwise.
+// An empty one was just prepared and is replaced as usual.
+//
+void LogRollingFileSink::RecoverNext() {
+    char nextFileName[LOG_MAX_FILENAME];
+    char firstFileName[LOG_MAX_FILENAME];
+    FILE *f = fopen(GetNextFileName(nextFileName), "rb");
+    if (f == NULL) {
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    long nLeftover = ftell(f);
+    fclose(f);
+    if (nLeftover <= 0) {
+        return;
+    }
+    f = fopen(GetFileName(firstFileName, 1), "rb");
+    if (f != NULL) {
+        // The backups were not shifted yet
+        fclose(f);
+        ShiftFiles();
+    } else {
+        RenameFile(nextFileName, firstFileName);
     }
 }
 
@@ -381,20 +911,51 @@ void LogRollingFileSink::Initialize(int argc, const char **argv) {
     //LogFileSink::Initialize(argc, argv);
     char tmp[LOG_MAX_FILENAME];
     ParseArgs(argc, argv);
-    GetFileName(tmp, 1);
-    Open(tmp, true);
-
-
-    nBytes = Size();
 
     // roll size limit of zero not allowed, using 10 MB instead
     nBytesRollLimit = properties.GetMaxLogfileSize(); //LOG_SZ_KB(10);	// 10 Mb
     if (!nBytesRollLimit) nBytesRollLimit = LOG_SZ_MB(10);
 
     nMaxBackupIndex = properties.GetMaxBackupIndex();    // 0 (zero) Work's like 'reset'
+
+    RecoverNext();
+    GetFileName(tmp, 1);
+    Open(tmp, true);
+
+    nBytes = Size();
+
+    pLock->Lock();
+    bPreparing = true;
+    pLock->Unlock();
+    PostHousekeeping([this]() {
+        PrepareNext();
+    });
+}
+
+void LogRollingFileSink::Flush() {
+    pLock->Lock();
+    LogFileSink::Flush();
+    pLock->Unlock();
+}
+
+void LogRollingFileSink::Close() {
+    char nextFileName[LOG_MAX_FILENAME];
+    pLock->Lock();
+    LogFileSink::Close();
+    pLock->Unlock();
+    // No new jobs once the file is closed, wait for the pending ones - they refer to this sink
+    WaitHousekeeping();
+    pLock->Lock();
+    if (fNext != NULL) {
+        fclose(fNext);
+        fNext = NULL;
+        remove(GetNextFileName(nextFileName));
+    }
+    pLock->Unlock();
 }
 
 int LogRollingFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
+    LogMutexLock guard(pLock);
     int res;
     CheckApplyRules();
     res = LogFileSink::WriteLine(dbgLevel, hdr, string);
@@ -404,347 +965,2677 @@ int LogRollingFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
     return res;
 }
 
+int LogRollingFileSink::WriteBatch(const LogRecord *records, int nRecords) {
+    LogMutexLock guard(pLock);
+    int nTotal = 0;
+    int first = 0;
+    while (first < nRecords) {
+        CheckApplyRules();
+        // Take records until the file would pass the limit, the rest goes to the next file
+        long nPending = 0;
+        int last = first;
+        while ((last < nRecords) && ((last == first) || (nBytes + nPending <= nBytesRollLimit))) {
+            nPending += records[last].hdrLen + records[last].len;
+            last++;
+        }
+        int res = LogFileSink::WriteBatch(&records[first], last - first);
+        if (res < 0) {
+            return res;
+        }
+        nBytes += res;
+        nTotal += res;
+        first = last;
+    }
+    return nTotal;
+}
+
 
-/////////
+// --------------------------------------------------------------------------
 //
-// -- static functions
+// Time rolling file sink
 //
-int Logger::iIndentStep = 2;
-bool Logger::bInitialized = false;
-std::queue<void *> Logger::buffers;
-std::map<std::string, bool> Logger::enabledLoggers;
+#define LOG_SECONDS_PER_DAY (24 * 60 * 60)
+
+// Points the link at 'target' by renaming a new link over it, readers never see it missing
+static void ReplaceSymlink(const std::string &target, const std::string &linkName) {
+#ifndef WIN32
+    std::string tmpName = linkName + ".tmp";
+    remove(tmpName.c_str());
+    if (symlink(target.c_str(), tmpName.c_str()) == 0) {
+        if (rename(tmpName.c_str(), linkName.c_str()) != 0) {
+            remove(tmpName.c_str());
+        }
+    }
+#endif
+}
 
-ILoggerList Logger::loggers;
-ILoggerSinkList Logger::sinks;
-Logger::TimeFormat Logger::kTimeFormat = kTFLog4Net;
-LogProperties Logger::properties;
+LogTimeRollingFileSink::LogTimeRollingFileSink() : LogFileSink() {
+    period = kPeriodHour;
+    nBytesRollLimit = 0;
+    nBytes = 0;
+    nMaxBackupIndex = 0;
+    tPeriodStart = 0;
+    tPeriodEnd = 0;
+    nPeriodIndex = 0;
+    bClosed = true;
+    pLock = new LogMutex();
+}
+LogTimeRollingFileSink::~LogTimeRollingFileSink() {
+    Close();
+    delete pLock;
+}
+ILogOutputSink *LogTimeRollingFileSink::CreateInstance() {
+    return (ILogOutputSink *) (new LogTimeRollingFileSink());
+}
 
-void Logger::SendToSinks(int dbgLevel, char *hdr, char *string) {
-    auto it = sinks.begin();
-    while (it != sinks.end()) {
-        auto &pSink = *it;
-        pSink->WriteLine(dbgLevel, hdr, string);
-        it++;
+time_t LogTimeRollingFileSink::PeriodStart(time_t t) {
+    switch (period) {
+        case kPeriodMinute :
+            return t - (t % 60);
+        case kPeriodDay :
+            return t - (t % LOG_SECONDS_PER_DAY);
+        case kPeriodHour :
+        default:
+            return t - (t % 3600);
     }
 }
 
+time_t LogTimeRollingFileSink::PeriodEnd(time_t tStart) {
+    switch (period) {
+        case kPeriodMinute :
+            return tStart + 60;
+        case kPeriodDay :
+            return tStart + LOG_SECONDS_PER_DAY;
+        case kPeriodHour :
+        default:
+            return tStart + 3600;
+    }
+}
 
+// '<file>.2026-10-18T13.log' for the first file in a period, '<file>.2026-10-18T13.<idx>.log' after that
+char *LogTimeRollingFileSink::GetFileName(char *dst, time_t tPeriod, int idx) {
+    char stamp[32];
+    struct tm gmt;
 #ifdef WIN32
-struct timezone 
-{
-    int  tz_minuteswest; /* minutes W of Greenwich */
-    int  tz_dsttime;     /* type of dst correction */
-};
+    gmtime_s(&gmt, &tPeriod);
+#else
+    gmtime_r(&tPeriod, &gmt);
+#endif
+    switch (period) {
+        case kPeriodMinute :
+            strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H-%M", &gmt);
+            break;
+        case kPeriodDay :
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d", &gmt);
+            break;
+        case kPeriodHour :
+        default:
+            strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H", &gmt);
+            break;
+    }
+    if (idx > 0) {
+        snprintf(dst, LOG_MAX_FILENAME, "%s.%s.%d.log", properties.GetLogfileName(), stamp, idx);
+    } else {
+        snprintf(dst, LOG_MAX_FILENAME, "%s.%s.log", properties.GetLogfileName(), stamp);
+    }
+    return dst;
+}
 
-static int gettimeofday(struct timeval *tv, struct timezone *tz)
-{
-    FILETIME ft;
-    unsigned __int64 tmpres = 0;
-    static int tzflag;
+//
+// Switches to file 'idx' of the period. The previous file is closed on the housekeeping thread,
+// together with the link update and the deletion of old files. Lock must be held.
+//
+void LogTimeRollingFileSink::OpenFile(time_t tPeriod, int idx) {
+    char fileName[LOG_MAX_FILENAME];
+    FILE *fPrevious = fOut;
 
-    if (NULL != tv)
-    {
-        GetSystemTimeAsFileTime(&ft);
+    fOut = NULL;
+    tPeriodStart = tPeriod;
+    tPeriodEnd = PeriodEnd(tPeriod);
+    nPeriodIndex = idx;
+
+    // Appends, a restart within the same period continues the file
+    LogFileSink::Open(GetFileName(fileName, tPeriod, idx), true);
+    nBytes = (fOut != NULL) ? Size() : 0;
+    if ((fOut != NULL) && (std::find(files.begin(), files.end(), fileName) == files.end())) {
+        files.push_back(fileName);
+    }
 
-        tmpres |= ft.dwHighDateTime;
-        tmpres <<= 32;
-        tmpres |= ft.dwLowDateTime;
+    std::vector<std::string> expired;
+    while ((nMaxBackupIndex > 0) && ((int) files.size() > nMaxBackupIndex)) {
+        expired.push_back(files.front());
+        files.pop_front();
+    }
 
-        /*converting file time to unix epoch*/
-        tmpres /= 10;  /*convert into microseconds*/
-        tmpres -= DELTA_EPOCH_IN_MICROSECS;
-        tv->tv_sec = (long)(tmpres / 1000000UL);
-        tv->tv_usec = (long)(tmpres % 1000000UL);
+    // The link lives next to the files and points to the file name only
+    std::string target(fileName);
+    size_t sep = target.find_last_of('/');
+    if (sep != std::string::npos) {
+        target = target.substr(sep + 1);
     }
+    std::string linkName = std::string(properties.GetLogfileName()) + ".current.log";
 
-    if (NULL != tz)
-    {
-        if (!tzflag)
-        {
-            _tzset();
-            tzflag++;
+    PostHousekeeping([fPrevious, target, linkName, expired]() {
+        if (fPrevious != NULL) {
+            fclose(fPrevious);
         }
-        tz->tz_minuteswest = _timezone / 60;
-        tz->tz_dsttime = _daylight;
+        ReplaceSymlink(target, linkName);
+        for (auto &name: expired) {
+            remove(name.c_str());
+        }
+    });
+}
+
+// Lock must be held
+void LogTimeRollingFileSink::CheckApplyRules() {
+    if (bClosed) {
+        return;
+    }
+    time_t now = time(NULL);
+    if (now >= tPeriodEnd) {
+        // Also retries a file which failed to open in the previous period
+        OpenFile(PeriodStart(now), 0);
+    } else if ((fOut != NULL) && (nBytes > nBytesRollLimit)) {
+        OpenFile(tPeriodStart, nPeriodIndex + 1);
     }
-    return 0;
 }
-#endif
+
 //
-// Returns a formatted time string for logging
-// string can be either in default kTFLog4Net format or Unix
+// Puts the files left by earlier runs ('<file>.<stamp>[.<idx>].log') in 'files', oldest first,
+// so 'maxbackupindex' also covers them. Names sort by stamp, and by index within a stamp.
 //
-char *Logger::TimeString(int maxchar, char *dst) {
-    struct timeval tmv;
-    gettimeofday(&tmv, NULL);
+void LogTimeRollingFileSink::ScanFiles() {
+    std::string logFile(properties.GetLogfileName());
+    std::string dir;
+    std::string prefix = logFile + ".";
+    size_t sep = logFile.find_last_of('/');
+#ifdef WIN32
+    size_t sepWin = logFile.find_last_of('\\');
+    if ((sepWin != std::string::npos) && ((sep == std::string::npos) || (sepWin > sep))) {
+        sep = sepWin;
+    }
+#endif
+    if (sep != std::string::npos) {
+        dir = logFile.substr(0, sep + 1);
+        prefix = logFile.substr(sep + 1) + ".";
+    }
 
-    switch (kTimeFormat) {
-        case kTFDefault :
-        case kTFUnix :
+    std::vector<std::string> names;
 #ifdef WIN32
-            //ctime_s(&tmv.tv_sec, 24,dst);
+    WIN32_FIND_DATAA findData;
+    HANDLE hFind = FindFirstFileA((logFile + ".*.log").c_str(), &findData);
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            names.push_back(findData.cFileName);
+        } while (FindNextFileA(hFind, &findData));
+        FindClose(hFind);
+    }
 #else
-            ctime_r(&tmv.tv_sec, dst);
+    DIR *pDir = opendir(dir.empty() ? "." : dir.c_str());
+    if (pDir != NULL) {
+        struct dirent *pEntry;
+        while ((pEntry = readdir(pDir)) != NULL) {
+            names.push_back(pEntry->d_name);
+        }
+        closedir(pDir);
+    }
 #endif
-            dst[24] = '\0';
-            break;
-        case kTFLog4Net : {
-            time_t bla = tmv.tv_sec;
-            struct tm *gmt = gmtime(&bla);
-            snprintf(dst, maxchar, "%.2d.%.2d.%.4d %.2d:%.2d:%.2d.%.3d",
-                     gmt->tm_mday, gmt->tm_mon + 1, gmt->tm_year + 1900,
-                     gmt->tm_hour, gmt->tm_min, gmt->tm_sec, (int)tmv.tv_usec / 1000);
+
+    std::vector<std::pair<std::string, int> > found;
+    for (auto &name: names) {
+        if ((name.size() <= prefix.size() + 4) || (name.compare(0, prefix.size(), prefix) != 0)
+            || (name.compare(name.size() - 4, 4, ".log") != 0)) {
+            continue;
         }
-            break;
+        // '<stamp>' or '<stamp>.<idx>', anything else (the '.current.log' link) is not ours
+        std::string middle = name.substr(prefix.size(), name.size() - prefix.size() - 4);
+        std::string stamp = middle;
+        int idx = 0;
+        size_t dot = middle.find('.');
+        if (dot != std::string::npos) {
+            stamp = middle.substr(0, dot);
+            std::string digits = middle.substr(dot + 1);
+            if (digits.empty() || (digits.find_first_not_of("0123456789") != std::string::npos)) {
+                continue;
+            }
+            idx = atoi(digits.c_str());
+        }
+        if (stamp.empty() || !isdigit((unsigned char) stamp[0])
+            || (stamp.find_first_not_of("0123456789-T") != std::string::npos)) {
+            continue;
+        }
+        found.push_back(std::make_pair(stamp, idx));
+    }
+    std::sort(found.begin(), found.end());
 
+    files.clear();
+    for (auto &file: found) {
+        char name[LOG_MAX_FILENAME];
+        if (file.second > 0) {
+            snprintf(name, LOG_MAX_FILENAME, "%s%s%s.%d.log", dir.c_str(), prefix.c_str(), file.first.c_str(), file.second);
+        } else {
+            snprintf(name, LOG_MAX_FILENAME, "%s%s%s.log", dir.c_str(), prefix.c_str(), file.first.c_str());
+        }
+        files.push_back(name);
     }
-    return dst;
 }
 
-#ifdef WIN32
-// static member...
-CRITICAL_SECTION Logger::bufferLock;
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-pthread_mutex_t Logger::bufferLock;
-#endif
-
-void *Logger::RequestBuffer() {
-#ifdef WIN32
-    EnterCriticalSection(&bufferLock);
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-    pthread_mutex_lock(&bufferLock);
-#endif
-    void *res = NULL;
-    if (buffers.empty()) {
-        res = (void *) new MsgBuffer();
+void LogTimeRollingFileSink::Initialize(int argc, const char **argv) {
+    char tmp[LOG_MAX_FILENAME];
+    ParseArgs(argc, argv);
+    properties.GetValue(LOG_CONF_PERIOD, tmp, LOG_MAX_FILENAME, "hour");
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], LOG_CONF_PERIOD) && (i + 1 < argc)) {
+            snprintf(tmp, LOG_MAX_FILENAME, "%s", argv[++i]);
+        }
+    }
+    if (!strcmp(tmp, "minute")) {
+        period = kPeriodMinute;
+    } else if (!strcmp(tmp, "day")) {
+        period = kPeriodDay;
     } else {
-        res = buffers.front();
-        buffers.pop();
+        period = kPeriodHour;
     }
-#ifdef WIN32
-    LeaveCriticalSection(&bufferLock);
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-    pthread_mutex_unlock(&bufferLock);
-#endif
 
+    nBytesRollLimit = properties.GetMaxLogfileSize();
+    if (!nBytesRollLimit) nBytesRollLimit = LOG_SZ_MB(10);
+    nMaxBackupIndex = properties.GetMaxBackupIndex();    // 0 (zero) keeps everything
+
+    // Skip the files of this period which are already full (restart)
+    time_t tPeriod = PeriodStart(time(NULL));
+    int idx = 0;
+    for (;;) {
+        FILE *f = fopen(GetFileName(tmp, tPeriod, idx), "r");
+        if (f == NULL) {
+            break;
+        }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fclose(f);
+        if (size <= nBytesRollLimit) {
+            break;
+        }
+        idx++;
+    }
 
-    return res;
+    pLock->Lock();
+    ScanFiles();
+    bClosed = false;
+    OpenFile(tPeriod, idx);
+    pLock->Unlock();
 }
-void Logger::ReleaseBuffer(void *pBuf) {
-#ifdef WIN32
-    EnterCriticalSection(&bufferLock);
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-    pthread_mutex_lock(&bufferLock);
-#endif
 
-    buffers.push(pBuf);
-#ifdef WIN32
-    LeaveCriticalSection(&bufferLock);
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-    pthread_mutex_unlock(&bufferLock);
-#endif
-}
-ILogger *Logger::GetLoggerFromName(const char *name) {
-    ILogger *pLogger = NULL;
-    auto it = loggers.begin();
-    while (it != loggers.end()) {
-        auto pInstance = (LoggerInstance *) *it;
-        pLogger = pInstance->pLogger;
-        if (!strcmp(pLogger->GetName(), name)) {
-            return pLogger;
-        }
-        it++;
+int LogTimeRollingFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
+    LogMutexLock guard(pLock);
+    int res;
+    CheckApplyRules();
+    res = LogFileSink::WriteLine(dbgLevel, hdr, string);
+    if (res > 0) {
+        nBytes += res;
     }
-    return NULL;
+    return res;
 }
-ILogger *Logger::GetLoggerFromNameWithPrefix(const char *name, const char *prefix) {
-    ILogger *pLogger = NULL;
-    auto it = loggers.begin();
-    while (it != loggers.end()) {
-        auto pInstance = (LoggerInstance *) *it;
-        pLogger = pInstance->pLogger;
-        if (pLogger->GetPrefix() != NULL) {
-            if (!strcmp(pLogger->GetName(), name) && !strcmp(pLogger->GetPrefix(), prefix)) {
-                return pLogger;
-            }
+
+int LogTimeRollingFileSink::WriteBatch(const LogRecord *records, int nRecords) {
+    LogMutexLock guard(pLock);
+    int nTotal = 0;
+    int first = 0;
+    while (first < nRecords) {
+        CheckApplyRules();
+        // Take records until the file would pass the limit, the rest goes to the next file
+        long nPending = 0;
+        int last = first;
+        while ((last < nRecords) && ((last == first) || (nBytes + nPending <= nBytesRollLimit))) {
+            nPending += records[last].hdrLen + records[last].len;
+            last++;
         }
-        it++;
+        int res = LogFileSink::WriteBatch(&records[first], last - first);
+        if (res < 0) {
+            return res;
+        }
+        nBytes += res;
+        nTotal += res;
+        first = last;
     }
-    return NULL;
+    return nTotal;
 }
 
-void Logger::DisableLogger(const char *name) {
-    // In case the Disable is called before the logger is created
-    // we need to store that so when the logger is created we can disable it...
-    enabledLoggers[std::string(name)] = false;
+void LogTimeRollingFileSink::Flush() {
+    pLock->Lock();
+    LogFileSink::Flush();
+    pLock->Unlock();
+}
 
-    // Now disable any created
-    auto logger = GetLoggerFromName(name);
-    if (logger == nullptr) {
-        return;
-    }
-    logger->SetEnabled(false);
+void LogTimeRollingFileSink::Close() {
+    pLock->Lock();
+    bClosed = true;
+    LogFileSink::Close();
+    pLock->Unlock();
+    // A pending job might still be closing the previous file
+    WaitHousekeeping();
 }
 
-void Logger::EnableLogger(const char *name) {
-    enabledLoggers[std::string(name)] = true;
+// --------------------------------------------------------------------------
+//
+// Binary file sink, see logger_internal.h for the format
+//
+LogBinaryFileSink::LogBinaryFileSink() : LogFileSink() {
+    tPrevious = 0;
+    pLock = new LogMutex();
+}
+LogBinaryFileSink::~LogBinaryFileSink() {
+    Close();
+    delete pLock;
+}
+ILogOutputSink *LogBinaryFileSink::CreateInstance() {
+    return (ILogOutputSink *) (new LogBinaryFileSink());
+}
 
-    // Enable that specific logger...
-    auto logger = GetLoggerFromName(name);
-    if (logger == nullptr) {
+void LogBinaryFileSink::Initialize(int argc, const char **argv) {
+    ParseArgs(argc, argv);
+    SetName("LogBinaryFileSink");
+
+    fOut = fopen(properties.GetLogfileName(), "wb");
+    if (fOut == NULL) {
+#ifdef DEBUG
+        printf("LogBinaryFileSink::Initialize, failed to open file - errno=%d, %s\n", errno, strerror(errno));
+#endif
         return;
     }
-    logger->SetEnabled(true);
+    uint8_t hdr[LOG_BIN_FILE_HEADER_LEN];
+    memcpy(hdr, LOG_BIN_MAGIC, LOG_BIN_MAGIC_LEN);
+    hdr[LOG_BIN_MAGIC_LEN] = Logger::GetProperties()->IsAutoPrefixEnabled() ? LOG_BIN_FLAG_AUTOPREFIX : 0;
+    hdr[LOG_BIN_MAGIC_LEN + 1] = (uint8_t) Logger::GetTimePrecision();
+    fwrite(hdr, 1, LOG_BIN_FILE_HEADER_LEN, fOut);
+    tPrevious = 0;
+    loggerIds.clear();
 }
 
-void Logger::DisableAllLoggers() {
-    // All active loggers
-    for (auto &logger: loggers) {
-        logger->pLogger->SetEnabled(false);
+//
+// Returns the id of a logger, the name and prefix are written the first time the logger is seen
+// Lock must be held
+//
+uint32_t LogBinaryFileSink::LoggerId(ILogger *pLogger) {
+    if (pLogger == NULL) {
+        return 0;
     }
-    // Some might have been tagged for enabled when created - we need to disable them as well
-    for (auto it = enabledLoggers.begin(); it != enabledLoggers.end(); ++it) {
-        it->second = false;
+    auto it = loggerIds.find(pLogger);
+    if (it != loggerIds.end()) {
+        return it->second;
     }
-
-    properties.EnableOnCreate(false);
+    uint32_t id = (uint32_t) loggerIds.size() + 1;
+    loggerIds[pLogger] = id;
+
+    const char *name = pLogger->GetName();
+    const char *prefix = pLogger->GetPrefix();
+    size_t nameLen = strlen(name);
+    size_t prefixLen = (prefix != NULL) ? strlen(prefix) : 0;
+
+    uint8_t fields[3 * LOG_BIN_MAX_VARINT + 1];
+    uint8_t *ptr = fields;
+    *ptr++ = LOG_BIN_TAG_LOGGER;
+    ptr += LogPutVarint(ptr, id);
+    ptr += LogPutVarint(ptr, nameLen);
+    uint8_t prefixField[LOG_BIN_MAX_VARINT];
+    int nPrefixField = LogPutVarint(prefixField, (prefix != NULL) ? prefixLen + 1 : 0);
+
+    uint8_t len[LOG_BIN_MAX_VARINT];
+    int nLen = LogPutVarint(len, (ptr - fields) + nameLen + nPrefixField + prefixLen);
+    fwrite(len, 1, nLen, fOut);
+    fwrite(fields, 1, ptr - fields, fOut);
+    fwrite(name, 1, nameLen, fOut);
+    fwrite(prefixField, 1, nPrefixField, fOut);
+    fwrite(prefix, 1, prefixLen, fOut);
+    return id;
 }
-void Logger::EnableAllLoggers() {
-    for (auto &logger: loggers) {
-        logger->pLogger->SetEnabled(true);
+
+// Lock must be held, returns number of bytes written
+int LogBinaryFileSink::EncodeRecord(const LogRecord &rec) {
+    uint32_t id = LoggerId(rec.pLogger);
+
+    int64_t tNow = (int64_t) rec.ts.tv_sec * 1000000000LL + rec.ts.tv_nsec;
+    // Fields are stored as they are, the message goes without the rendered fields
+    bool bFields = (rec.fields != NULL);
+    size_t msgLen = (size_t) (bFields ? rec.msgLen : rec.len);
+    size_t fieldsLen = bFields ? (size_t) rec.fieldsLen : 0;
+    if (!bFields && (msgLen > 0) && (rec.string[msgLen - 1] == '\n')) {
+        msgLen--;
     }
-    // Some might have been tagged for disable when created - we need to enable them as well
-    for (auto it = enabledLoggers.begin(); it != enabledLoggers.end(); ++it) {
-        it->second = true;
+
+    uint8_t fields[6 * LOG_BIN_MAX_VARINT + 1];
+    uint8_t *ptr = fields;
+    *ptr++ = bFields ? LOG_BIN_TAG_FIELDS : LOG_BIN_TAG_RECORD;
+    ptr += LogPutVarint(ptr, LogZigZag(tNow - tPrevious));
+    ptr += LogPutVarint(ptr, (uint64_t) rec.level);
+    ptr += LogPutVarint(ptr, id);
+    ptr += LogPutVarint(ptr, rec.tid);
+    ptr += LogPutVarint(ptr, (uint64_t) rec.indent);
+    if (bFields) {
+        ptr += LogPutVarint(ptr, msgLen);
     }
-    properties.EnableOnCreate(true);
+    tPrevious = tNow;
+
+    uint8_t len[LOG_BIN_MAX_VARINT];
+    int nLen = LogPutVarint(len, (ptr - fields) + msgLen + fieldsLen);
+    fwrite(len, 1, nLen, fOut);
+    fwrite(fields, 1, ptr - fields, fOut);
+    if ((fwrite(rec.string, 1, msgLen, fOut) != msgLen) || (bFields && (fwrite(rec.fields, 1, fieldsLen, fOut) != fieldsLen))) {
+        return SINK_WRITE_IO_ERROR;
+    }
+    return (int) (nLen + (ptr - fields) + msgLen + fieldsLen);
+}
+
+// Records coming this way have no capture data, they are stamped here
+int LogBinaryFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
+    // The header is rebuilt by the decoder from the record fields
+    (void) hdr;
+    LogRecord rec = LogRecord();
+    rec.level = dbgLevel;
+    rec.string = string;
+    rec.len = (int) strlen(string);
+    Logger::GetTimestamp(&rec.ts);
+    return WriteBatch(&rec, 1);
+}
 
+int LogBinaryFileSink::WriteRecord(const LogRecord &record) {
+    return WriteBatch(&record, 1);
 }
 
+int LogBinaryFileSink::WriteBatch(const LogRecord *records, int nRecords) {
+    LogMutexLock guard(pLock);
+    if (fOut == NULL) {
+        return SINK_WRITE_IO_ERROR;
+    }
+    int nTotal = 0;
+    for (int i = 0; i < nRecords; i++) {
+        if (!WithinRange(records[i].level)) {
+            continue;
+        }
+        int res = EncodeRecord(records[i]);
+        if (res < 0) {
+            return res;
+        }
+        nTotal += res;
+    }
+    return nTotal;
+}
+
+void LogBinaryFileSink::Flush() {
+    pLock->Lock();
+    LogFileSink::Flush();
+    pLock->Unlock();
+}
 
+void LogBinaryFileSink::Close() {
+    pLock->Lock();
+    LogFileSink::Close();
+    pLock->Unlock();
+}
 
+// --------------------------------------------------------------------------
 //
-// This returns a Logger with a name and optionally a prefix
-// You can supply just a name and enable the AutoSplitPrefix feature which will
-// automatically generate a prefix from the name.
-// Names must be on the form: '<prefix>::<item>' like: "MyClass::Function"
-// If AutoSplitPrefix is FALSE the name will be used as is and the prefix added if specified.
-// Reason why prefix is added 'behind' is because of API compatibility.
+// Memory mapped file sink
 //
-ILogger *Logger::GetLogger(const char *name, const char *prefix /* = NULL */) {
-    ILogger *pLogger = NULL;
-    LoggerInstance *pInstance;
-    ILoggerList::iterator it;
+#ifndef WIN32
+#define MMAP_SINK_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+
+LogMMapFileSink::LogMMapFileSink() {
+    szSegment = MMAP_SINK_DEFAULT_SEGMENT_SIZE;
+    nextIndex = 1;
+    nMaxSegments = 0;
+    bClosed = true;
+    current.store(NULL);
+    pLock = new LogMutex();
+}
 
-    // Prefix handling could do with refactoring....
-    char *logprefix = (char *) prefix;
-    char namebuffer[128];
-    strncpy(namebuffer, name, 128);
+LogMMapFileSink::~LogMMapFileSink() {
+    Close();
+    for (auto pSeg: retired) {
+        delete pSeg;
+    }
+    delete pLock;
+}
 
-    char *logname = namebuffer;
+ILogOutputSink *LogMMapFileSink::CreateInstance() {
+    return (ILogOutputSink *) (new LogMMapFileSink());
+}
 
-    Initialize();
-    if (prefix == NULL && properties.IsAutoPrefixEnabled()) {
-        // a name with 'prefixing' looks like:  "prefix::item"
-        // generally the prefix would be the class name and the item equals the function
-        char *split = (char *) strchr(namebuffer, ':');
-        if ((split != NULL) && (split[1] == ':')) {
-            logname = (char *) &split[2];    // this is the name
-            logprefix = namebuffer;
-            split[0] = '\0';
+void LogMMapFileSink::ParseArgs(int argc, const char **argv) {
+    char tmp[64];
+    szSegment = (size_t) atol(properties.GetValue(LOG_CONF_SEGMENTSIZE, tmp, 64, "67108864"));
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "file") && (i + 1 < argc)) {
+            properties.SetValue(LOG_CONF_LOGFILE, argv[++i]);
+        } else if (!strcmp(argv[i], LOG_CONF_SEGMENTSIZE) && (i + 1 < argc)) {
+            szSegment = (size_t) atol(argv[++i]);
         }
     }
+    // Segments are whole pages
+    size_t szPage = (size_t) sysconf(_SC_PAGESIZE);
+    if (szSegment < szPage) szSegment = szPage;
+    szSegment = ((szSegment + szPage - 1) / szPage) * szPage;
+}
 
+void LogMMapFileSink::Initialize(int argc, const char **argv) {
+    ParseArgs(argc, argv);
+    SetName("LogMMapFileSink");
+    nMaxSegments = properties.GetMaxBackupIndex();    // 0 (zero) keeps everything
+    pLock->Lock();
+    ScanSegments();
+    bClosed = false;
+    pLock->Unlock();
+    Rotate(NULL);
+}
 
-    // If prefix is NULL, just use the same old method as before
-    if (logprefix == NULL) {
-        pLogger = GetLoggerFromName(logname);
-    } else {
-        pLogger = GetLoggerFromNameWithPrefix(logname, logprefix);
+//
+// Picks up the segments of an earlier run, they are what survived a crash. New segments are numbered after
+// the highest one and the old ones count against 'maxbackupindex'. Lock must be held.
+//
+void LogMMapFileSink::ScanSegments() {
+    std::string logFile(properties.GetLogfileName());
+    std::string dir(".");
+    std::string prefix = logFile + ".";
+    size_t sep = logFile.find_last_of('/');
+    if (sep != std::string::npos) {
+        dir = logFile.substr(0, sep + 1);
+        prefix = logFile.substr(sep + 1) + ".";
     }
 
-    if (pLogger != NULL) {
-        return pLogger;
+    std::vector<int> found;
+    DIR *pDir = opendir(dir.c_str());
+    if (pDir != NULL) {
+        struct dirent *pEntry;
+        while ((pEntry = readdir(pDir)) != NULL) {
+            const char *name = pEntry->d_name;
+            if (strncmp(name, prefix.c_str(), prefix.size()) || !isdigit((unsigned char) name[prefix.size()])) {
+                continue;
+            }
+            char *end;
+            long idx = strtol(&name[prefix.size()], &end, 10);
+            if ((idx > 0) && (idx < INT_MAX) && !strcmp(end, ".log")) {
+                found.push_back((int) idx);
+            }
+        }
+        closedir(pDir);
     }
-
-    // Have to create a new logger
-    pLogger = (ILogger *) new Logger(logname, logprefix);
-    pInstance = new LoggerInstance(pLogger);
-    // TODO: Support for exclude list
-
-    loggers.push_back(pInstance);
-    return pLogger;
+    std::sort(found.begin(), found.end());
+    segments.assign(found.begin(), found.end());
+    nextIndex = found.empty() ? 1 : found.back() + 1;
 }
 
-void Logger::CloseAll() {
-    Initialize();
+//
+// Creates, preallocates and maps segment file 'idx', returns NULL on failure
+//
+LogMMapSegment *LogMMapFileSink::OpenSegment(int idx) {
+    char filename[LOG_MAX_FILENAME];
+    snprintf(filename, LOG_MAX_FILENAME, "%s.%d.log", properties.GetLogfileName(), idx);
 
-    auto it = sinks.begin();
-    while (it != sinks.end()) {
-        auto &pSink = *it;
-        pSink->Close();
-        it++;
+    // Numbered after everything found at start, an existing file is left over from a failed attempt of ours
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+#ifdef DEBUG
+        printf("LogMMapFileSink::OpenSegment, failed to open file - errno=%d, %s\n", errno, strerror(errno));
+#endif
+        return NULL;
+    }
+    // Allocate the blocks up front, a store to a hole in the mapping raises SIGBUS when the disk is full
+#if defined(__linux__)
+    int res = fallocate(fd, 0, 0, (off_t) szSegment);
+    if (res != 0) {
+        res = posix_fallocate(fd, 0, (off_t) szSegment);
+    }
+#elif defined(__APPLE__)
+    int res = ftruncate(fd, (off_t) szSegment);
+#else
+    int res = posix_fallocate(fd, 0, (off_t) szSegment);
+#endif
+    if (res != 0) {
+        close(fd);
+        return NULL;
+    }
+    void *ptr = mmap(NULL, szSegment, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        close(fd);
+        return NULL;
     }
 
-    sinks.clear();
-    loggers.clear();
+    LogMMapSegment *pSeg = new LogMMapSegment();
+    pSeg->fd = fd;
+    pSeg->base = (char *) ptr;
+    pSeg->size = szSegment;
+    pSeg->offset.store(0);
+    pSeg->nCommitted.store(0);
+    pSeg->nWriters.store(0);
+    return pSeg;
 }
 
-void Logger::SetAllSinkDebugLevel(int iNewDebugLevel) {
-    // This might very well be the first call, make sure we are initalized
-    Initialize();
+//
+// Opens the segment after the last one, the names of the segments beyond 'maxbackupindex' go to 'expired'
+// Lock must be held
+//
+LogMMapSegment *LogMMapFileSink::OpenNext(std::vector<std::string> &expired) {
+    LogMMapSegment *pSeg = OpenSegment(nextIndex);
+    if (pSeg == NULL) {
+        return NULL;
+    }
+    segments.push_back(nextIndex++);
+    while ((nMaxSegments > 0) && ((int) segments.size() > nMaxSegments)) {
+        char filename[LOG_MAX_FILENAME];
+        snprintf(filename, LOG_MAX_FILENAME, "%s.%d.log", properties.GetLogfileName(), segments.front());
+        expired.push_back(filename);
+        segments.pop_front();
+    }
+    return pSeg;
+}
 
-    ILoggerSinkList::iterator it;
-    it = sinks.begin();
-    while (it != sinks.end()) {
-        auto &pSink = *it;
-        pSink->GetProperties()->SetDebugLevel(iNewDebugLevel);
-        it++;
+//
+// Unmaps a segment nobody can reach anymore and cuts the file at the end of the written data
+// The segment itself is kept, a writer might still touch the counters before it notices the rotation
+// Called without the lock, the wait is for writers still copying in to the segment
+//
+void LogMMapFileSink::Retire(LogMMapSegment *pSeg) {
+    while (pSeg->nWriters.load() != 0) {
+        sched_yield();
+    }
+    munmap(pSeg->base, pSeg->size);
+    if (ftruncate(pSeg->fd, (off_t) pSeg->nCommitted.load())) {
+        // keeps the zero filled tail
     }
+    close(pSeg->fd);
+    pSeg->base = NULL;
+    pLock->Lock();
+    retired.push_back(pSeg);
+    pLock->Unlock();
 }
 
-// Without initialization
-void Logger::AddSink(ILogOutputSink *pSink, const char *sName) {
-    // Don't add an empty sink...
-    if ((pSink == nullptr) || (sName == nullptr)) {
-        return;
+//
+// Replaces 'pFull' (NULL - no segment) with the next segment, the old one is retired on the housekeeping thread.
+// Returns false if the sink is closed or the segment could not be created, 'pFull' stays current then and the
+// next write tries again.
+//
+bool LogMMapFileSink::Rotate(LogMMapSegment *pFull) {
+    std::vector<std::string> expired;
+    pLock->Lock();
+    if (bClosed) {
+        pLock->Unlock();
+        return false;
     }
+    // Someone else might already have rotated
+    if (current.load() != pFull) {
+        pLock->Unlock();
+        return true;
+    }
+    LogMMapSegment *pNew = OpenNext(expired);
+    if (pNew == NULL) {
+        pLock->Unlock();
+        return false;
+    }
+    current.store(pNew);
+    pLock->Unlock();
 
-    LogBaseSink *pBase = (LogBaseSink *) pSink;
-    pBase->SetName(sName);
-    sinks.push_back(std::unique_ptr<ILogOutputSink>(pSink));
-}
-// With initialization
-void Logger::AddSink(ILogOutputSink *pSink, const char *sName, int argc, const char **argv) {
-    pSink->Initialize(argc, argv);
-    AddSink(pSink, sName);
+    if ((pFull != NULL) || !expired.empty()) {
+        PostHousekeeping([this, pFull, expired]() {
+            if (pFull != NULL) {
+                Retire(pFull);
+            }
+            for (auto &name: expired) {
+                remove(name.c_str());
+            }
+        });
+    }
+    return true;
 }
 
-bool Logger::RemoveSink(const char *sName) {
-    auto cbCheckSink = [sName](std::unique_ptr<ILogOutputSink> &sink) -> bool {
-        if (!strcmp(sName, sink->GetName())) {
-            return true;
+// Pins the current segment, it is not retired until the pin is released (nWriters) - NULL if there is none
+LogMMapSegment *LogMMapFileSink::Pin() {
+    for (;;) {
+        LogMMapSegment *pSeg = current.load();
+        if (pSeg == NULL) {
+            return NULL;
         }
-        return false;
-    };
-    auto szBefore = sinks.size();
-    auto it = std::remove_if(sinks.begin(), sinks.end(), cbCheckSink);
-    if (it != sinks.end()) {
-       sinks.erase(it);
+        pSeg->nWriters.fetch_add(1);
+        // Rotated between the load and the pin, the segment might be gone already
+        if (current.load() == pSeg) {
+            return pSeg;
+        }
+        pSeg->nWriters.fetch_sub(1);
     }
-    return (szBefore != sinks.size());
 }
 
 //
-// Create sink's based on class name and factory instances in the global list
+// Claims 'len' bytes in the current segment, rotating when it is full. On success the segment is pinned
+// and must be released by the caller when the data has been copied.
 //
-ILogOutputSink *Logger::CreateSink(const char *className) {
-    for (int i = 0; sinkFactoryList[i].factory != NULL; i++) {
+char *LogMMapFileSink::Reserve(size_t len, LogMMapSegment **ppSeg) {
+    if (len > szSegment) {
+        return NULL;
+    }
+    for (;;) {
+        LogMMapSegment *pSeg = Pin();
+        if (pSeg != NULL) {
+            size_t offset = pSeg->offset.fetch_add(len);
+            if (offset + len <= pSeg->size) {
+                *ppSeg = pSeg;
+                return &pSeg->base[offset];
+            }
+            pSeg->nWriters.fetch_sub(1);
+        }
+        // Full, or an earlier segment could not be created
+        if (!Rotate(pSeg)) {
+            return NULL;
+        }
+    }
+}
+
+int LogMMapFileSink::WriteLine(int dbgLevel, char *hdr, char *string) {
+    LogRecord rec = LogRecord();
+    rec.level = dbgLevel;
+    rec.hdr = hdr;
+    rec.hdrLen = (hdr != NULL) ? (int) strlen(hdr) : 0;
+    rec.string = string;
+    rec.len = (int) strlen(string);
+    return WriteBatch(&rec, 1);
+}
+
+int LogMMapFileSink::WriteBatch(const LogRecord *records, int nRecords) {
+    size_t nTotal = 0;
+    for (int i = 0; i < nRecords; i++) {
+        if (WithinRange(records[i].level)) {
+            nTotal += ((records[i].hdr != NULL) ? records[i].hdrLen : 0) + records[i].len;
+        }
+    }
+    if (nTotal == 0) {
+        return SINK_WRITE_FILTERED;
+    }
+
+    // One claim for the whole batch, unless it is larger than a segment
+    LogMMapSegment *pSeg = NULL;
+    char *dst = Reserve(nTotal, &pSeg);
+    bool bPerRecord = (dst == NULL);
+    for (int i = 0; i < nRecords; i++) {
+        const LogRecord &rec = records[i];
+        if (!WithinRange(rec.level)) {
+            continue;
+        }
+        size_t hdrLen = (rec.hdr != NULL) ? rec.hdrLen : 0;
+        if (bPerRecord) {
+            dst = Reserve(hdrLen + rec.len, &pSeg);
+            if (dst == NULL) {
+                return SINK_WRITE_IO_ERROR;
+            }
+        }
+        if (hdrLen > 0) {
+            memcpy(dst, rec.hdr, hdrLen);
+        }
+        memcpy(dst + hdrLen, rec.string, rec.len);
+        if (bPerRecord) {
+            pSeg->nCommitted.fetch_add(hdrLen + rec.len);
+            pSeg->nWriters.fetch_sub(1);
+        } else {
+            dst += hdrLen + rec.len;
+        }
+    }
+    if (!bPerRecord) {
+        pSeg->nCommitted.fetch_add(nTotal);
+        pSeg->nWriters.fetch_sub(1);
+    }
+    return (int) nTotal;
+}
+
+// Starts write back of the current segment, the pin keeps it from being retired meanwhile
+void LogMMapFileSink::Flush() {
+    LogMMapSegment *pSeg = Pin();
+    if (pSeg != NULL) {
+        size_t szPage = (size_t) sysconf(_SC_PAGESIZE);
+        size_t len = ((pSeg->nCommitted.load() + szPage - 1) / szPage) * szPage;
+        if (len > pSeg->size) len = pSeg->size;
+        if (len > 0) {
+            msync(pSeg->base, len, MS_ASYNC);
+        }
+        pSeg->nWriters.fetch_sub(1);
+    }
+}
+
+void LogMMapFileSink::Close() {
+    pLock->Lock();
+    bClosed = true;
+    LogMMapSegment *pSeg = current.exchange(NULL);
+    pLock->Unlock();
+    if (pSeg != NULL) {
+        Retire(pSeg);
+    }
+    // Pending jobs retire segments of this sink
+    WaitHousekeeping();
+}
+#endif
+
+
+// Writes 'n' hex digits of 'v' (zero padded), returns number of chars written
+static __inline int RenderHex(char *dst, uint32_t v, int n) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = n - 1; i >= 0; i--) {
+        dst[i] = digits[v & 15];
+        v >>= 4;
+    }
+    return n;
+}
+
+// --------------------------------------------------------------------------
+//
+// Pattern layout
+// Compiled once per distinct pattern, rendering walks the ops without looking at the pattern again
+//
+static const struct
+{
+    const char *name;
+    LogLayout::OpType type;
+} layoutConversions[] = {
+    { "date", LogLayout::kOpDate },
+    { "thread", LogLayout::kOpThread },
+    { "level", LogLayout::kOpLevel },
+    { "logger", LogLayout::kOpLogger },
+    { "prefix", LogLayout::kOpPrefix },
+    { "indent", LogLayout::kOpIndent },
+    { "d", LogLayout::kOpDate },
+    { "t", LogLayout::kOpThread },
+    { "p", LogLayout::kOpLevel },
+    { "c", LogLayout::kOpLogger },
+    { "x", LogLayout::kOpPrefix },
+    { "i", LogLayout::kOpIndent },
+};
+
+LogLayout *LogLayout::Get(const char *pattern) {
+    static LogMutex *pLock = new LogMutex();
+    static std::map<std::string, LogLayout *> *pLayouts = new std::map<std::string, LogLayout *>();
+    LogMutexLock guard(pLock);
+    auto it = pLayouts->find(pattern);
+    if (it != pLayouts->end()) {
+        return it->second;
+    }
+    LogLayout *pLayout = new LogLayout(pattern);
+    (*pLayouts)[pattern] = pLayout;
+    return pLayout;
+}
+
+LogLayout::LogLayout(const char *pattern) {
+    this->pattern = pattern;
+    Compile();
+}
+
+void LogLayout::AddLiteral(const char *str, int len) {
+    if (len <= 0) {
+        return;
+    }
+    // Adjacent literals are merged
+    if (!ops.empty() && (ops.back().type == kOpLiteral) && (ops.back().textOfs + ops.back().textLen == (int) literals.length())) {
+        ops.back().textLen += len;
+    } else {
+        Op op = { kOpLiteral, 0, 0, false, (int) literals.length(), len };
+        ops.push_back(op);
+    }
+    literals.append(str, len);
+}
+
+void LogLayout::Compile() {
+    const char *ptr = pattern.c_str();
+    const char *lit = ptr;
+    while (*ptr != '\0') {
+        if (*ptr != '%') {
+            ptr++;
+            continue;
+        }
+        AddLiteral(lit, (int) (ptr - lit));
+        const char *spec = ptr++;
+        if (*ptr == '%') {
+            AddLiteral("%", 1);
+            lit = ++ptr;
+            continue;
+        }
+
+        Op op = { kOpLiteral, 0, 0, false, 0, 0 };
+        if (*ptr == '-') {
+            op.bLeftAlign = true;
+            ptr++;
+        }
+        while ((*ptr >= '0') && (*ptr <= '9')) {
+            op.minWidth = op.minWidth * 10 + (*ptr++ - '0');
+        }
+        if (*ptr == '.') {
+            ptr++;
+            while ((*ptr >= '0') && (*ptr <= '9')) {
+                op.maxWidth = op.maxWidth * 10 + (*ptr++ - '0');
+            }
+        }
+        if (op.minWidth > LOG_LAYOUT_HEADER_SIZE) {
+            op.minWidth = LOG_LAYOUT_HEADER_SIZE;
+        }
+
+        // Long name or a single letter
+        size_t nAlpha = 0;
+        while (((ptr[nAlpha] >= 'a') && (ptr[nAlpha] <= 'z')) || ((ptr[nAlpha] >= 'A') && (ptr[nAlpha] <= 'Z'))) {
+            nAlpha++;
+        }
+        if (nAlpha == 0) {
+            // not a conversion, keep it as text
+            lit = spec;
+            continue;
+        }
+        if ((ptr[0] == 'm') && ((nAlpha == 1) || ((nAlpha == 7) && !strncmp(ptr, "message", 7)))) {
+            // The message goes after the header, what follows it is not part of the header
+            return;
+        }
+        // The whole word if it is a long name, otherwise the first letter - '%dx' is %d followed by 'x'
+        size_t nUsed = 0;
+        for (auto &conv : layoutConversions) {
+            size_t nName = strlen(conv.name);
+            if (((nName == nAlpha) || ((nName == 1) && (nUsed == 0))) && !strncmp(ptr, conv.name, nName)) {
+                op.type = conv.type;
+                nUsed = nName;
+                if (nName == nAlpha) {
+                    break;
+                }
+            }
+        }
+        bool bFound = (nUsed > 0);
+        ptr += nUsed;
+        if (!bFound) {
+            // unknown conversion, written as is
+            ptr += nAlpha;
+            AddLiteral(spec, (int) (ptr - spec));
+            lit = ptr;
+            continue;
+        }
+        ops.push_back(op);
+        lit = ptr;
+    }
+    AddLiteral(lit, (int) (ptr - lit));
+}
+
+// Copies 'str' padded and truncated as the op says, returns number of chars written
+static int PutLayoutText(char *dst, int room, const char *str, int len, const LogLayout::Op &op) {
+    if ((op.maxWidth > 0) && (len > op.maxWidth)) {
+        // like log4net, the end is kept
+        str += len - op.maxWidth;
+        len = op.maxWidth;
+    }
+    int pad = (op.minWidth > len) ? op.minWidth - len : 0;
+    if (len + pad > room) {
+        if (len > room) {
+            len = room;
+        }
+        pad = room - len;
+    }
+    int n = 0;
+    if (!op.bLeftAlign) {
+        memset(dst, ' ', pad);
+        n += pad;
+    }
+    memcpy(&dst[n], str, len);
+    n += len;
+    if (op.bLeftAlign) {
+        memset(&dst[n], ' ', pad);
+        n += pad;
+    }
+    return n;
+}
+
+int LogLayout::Render(const LogRecord &rec, char *dst, int maxLen) const {
+    static const std::string spaces(MAX_INDENT, ' ');
+    char tmp[48];
+    int n = 0;
+    for (const Op &op : ops) {
+        const char *str = "";
+        int len = 0;
+        switch (op.type) {
+            case kOpLiteral :
+                str = literals.data() + op.textOfs;
+                len = op.textLen;
+                break;
+            case kOpDate :
+                Logger::TimeString(sizeof(tmp), tmp, rec.ts.tv_sec, rec.ts.tv_nsec);
+                str = tmp;
+                len = (int) strlen(tmp);
+                break;
+            case kOpThread :
+                // like log4net, the name if the thread has one
+                if (rec.threadName != NULL) {
+                    str = rec.threadName;
+                    len = (int) strlen(str);
+                } else {
+                    len = RenderHex(tmp, rec.tid, 8);
+                    str = tmp;
+                }
+                break;
+            case kOpLevel :
+                str = Logger::MessageClassNameFromInt(rec.level);
+                len = (int) strlen(str);
+                break;
+            case kOpLogger :
+                if (rec.pLogger != NULL) {
+                    str = rec.pLogger->GetName();
+                    len = (int) strlen(str);
+                }
+                break;
+            case kOpPrefix :
+                if ((rec.pLogger != NULL) && (rec.pLogger->GetPrefix() != NULL)) {
+                    str = rec.pLogger->GetPrefix();
+                    len = (int) strlen(str);
+                }
+                break;
+            case kOpIndent :
+                str = spaces.data();
+                len = (rec.indent < MAX_INDENT) ? rec.indent : MAX_INDENT;
+                break;
+        }
+        n += PutLayoutText(&dst[n], maxLen - 1 - n, str, len, op);
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+// --------------------------------------------------------------------------
+//
+// Statistics
+//
+void LogThreadSinkCounters::Reset() {
+    records.store(0, std::memory_order_relaxed);
+    filtered.store(0, std::memory_order_relaxed);
+    bytes.store(0, std::memory_order_relaxed);
+    ioErrors.store(0, std::memory_order_relaxed);
+    calls.store(0, std::memory_order_relaxed);
+    timeNs.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < LOG_STATS_LATENCY_BUCKETS; i++) {
+        latency[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void LogThreadSinkCounters::AddTo(LogSinkStats &stats) {
+    stats.records += records.load(std::memory_order_relaxed);
+    stats.filtered += filtered.load(std::memory_order_relaxed);
+    stats.bytes += bytes.load(std::memory_order_relaxed);
+    stats.ioErrors += ioErrors.load(std::memory_order_relaxed);
+    stats.calls += calls.load(std::memory_order_relaxed);
+    stats.timeNs += timeNs.load(std::memory_order_relaxed);
+    for (int i = 0; i < LOG_STATS_LATENCY_BUCKETS; i++) {
+        stats.latency[i] += latency[i].load(std::memory_order_relaxed);
+    }
+}
+
+// Folds in the counts of an exiting thread, several threads might exit at the same time
+void LogThreadSinkCounters::Add(const LogSinkStats &stats) {
+    records.fetch_add(stats.records, std::memory_order_relaxed);
+    filtered.fetch_add(stats.filtered, std::memory_order_relaxed);
+    bytes.fetch_add(stats.bytes, std::memory_order_relaxed);
+    ioErrors.fetch_add(stats.ioErrors, std::memory_order_relaxed);
+    calls.fetch_add(stats.calls, std::memory_order_relaxed);
+    timeNs.fetch_add(stats.timeNs, std::memory_order_relaxed);
+    for (int i = 0; i < LOG_STATS_LATENCY_BUCKETS; i++) {
+        latency[i].fetch_add(stats.latency[i], std::memory_order_relaxed);
+    }
+}
+
+LogThreadCounters::LogThreadCounters() {
+    for (int i = 0; i < LOG_STATS_LEVELS; i++) {
+        produced[i].store(0, std::memory_order_relaxed);
+    }
+    filteredEarly.store(0, std::memory_order_relaxed);
+    filteredLate.store(0, std::memory_order_relaxed);
+    bufferAllocs.store(0, std::memory_order_relaxed);
+    bufferFrees.store(0, std::memory_order_relaxed);
+    bufferGrows.store(0, std::memory_order_relaxed);
+    rateLimited.store(0, std::memory_order_relaxed);
+    sampledOut.store(0, std::memory_order_relaxed);
+    duplicates.store(0, std::memory_order_relaxed);
+}
+
+void LogThreadCounters::AddTo(LogStats &stats) {
+    for (int i = 0; i < LOG_STATS_LEVELS; i++) {
+        stats.produced[i] += produced[i].load(std::memory_order_relaxed);
+    }
+    stats.filteredEarly += filteredEarly.load(std::memory_order_relaxed);
+    stats.filteredLate += filteredLate.load(std::memory_order_relaxed);
+    stats.bufferAllocs += bufferAllocs.load(std::memory_order_relaxed);
+    stats.bufferFrees += bufferFrees.load(std::memory_order_relaxed);
+    stats.bufferGrows += bufferGrows.load(std::memory_order_relaxed);
+    stats.rateLimited += rateLimited.load(std::memory_order_relaxed);
+    stats.sampledOut += sampledOut.load(std::memory_order_relaxed);
+    stats.duplicates += duplicates.load(std::memory_order_relaxed);
+}
+
+LogStatsRegistry::LogStatsRegistry() {
+    for (int i = 0; i < LOG_STATS_MAX_SINKS; i++) {
+        sinkSlotInUse[i] = false;
+    }
+}
+
+// Never destroyed, threads unregister while the process is shutting down
+LogStatsRegistry &LogStatsRegistry::Instance() {
+    static LogStatsRegistry *pRegistry = new LogStatsRegistry();
+    return *pRegistry;
+}
+
+LogThreadCounters *LogStatsRegistry::Register() {
+    LogThreadCounters *pCounters = new LogThreadCounters();
+    LogMutexLock guard(&lock);
+    threads.push_back(pCounters);
+    return pCounters;
+}
+
+void LogStatsRegistry::Unregister(LogThreadCounters *pCounters) {
+    LogMutexLock guard(&lock);
+    threads.erase(std::remove(threads.begin(), threads.end(), pCounters), threads.end());
+    LogStats counts = LogStats();
+    pCounters->AddTo(counts);
+    for (int i = 0; i < LOG_STATS_LEVELS; i++) {
+        exited.produced[i].fetch_add(counts.produced[i], std::memory_order_relaxed);
+    }
+    exited.filteredEarly.fetch_add(counts.filteredEarly, std::memory_order_relaxed);
+    exited.filteredLate.fetch_add(counts.filteredLate, std::memory_order_relaxed);
+    exited.bufferAllocs.fetch_add(counts.bufferAllocs, std::memory_order_relaxed);
+    exited.bufferFrees.fetch_add(counts.bufferFrees, std::memory_order_relaxed);
+    exited.bufferGrows.fetch_add(counts.bufferGrows, std::memory_order_relaxed);
+    exited.rateLimited.fetch_add(counts.rateLimited, std::memory_order_relaxed);
+    exited.sampledOut.fetch_add(counts.sampledOut, std::memory_order_relaxed);
+    exited.duplicates.fetch_add(counts.duplicates, std::memory_order_relaxed);
+    for (int i = 0; i < LOG_STATS_MAX_SINKS; i++) {
+        LogSinkStats sinkCounts = LogSinkStats();
+        pCounters->sinks[i].AddTo(sinkCounts);
+        exited.sinks[i].Add(sinkCounts);
+    }
+    delete pCounters;
+}
+
+void LogStatsRegistry::Collect(LogStats &stats) {
+    LogMutexLock guard(&lock);
+    for (auto pCounters: threads) {
+        pCounters->AddTo(stats);
+    }
+    exited.AddTo(stats);
+}
+
+//
+// A free slot still holds the counts of the sink which had it, nobody writes them any more - clear them
+// for the new sink. Threads registering later start at zero.
+//
+int LogStatsRegistry::AcquireSinkSlot() {
+    LogMutexLock guard(&lock);
+    for (int slot = 0; slot < LOG_STATS_MAX_SINKS; slot++) {
+        if (!sinkSlotInUse[slot]) {
+            sinkSlotInUse[slot] = true;
+            for (auto pCounters: threads) {
+                pCounters->sinks[slot].Reset();
+            }
+            exited.sinks[slot].Reset();
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void LogStatsRegistry::ReleaseSinkSlot(int slot) {
+    if (slot < 0) {
+        return;
+    }
+    LogMutexLock guard(&lock);
+    sinkSlotInUse[slot] = false;
+}
+
+void LogStatsRegistry::CollectSink(int slot, LogSinkStats &stats) {
+    if (slot < 0) {
+        return;
+    }
+    LogMutexLock guard(&lock);
+    for (auto pCounters: threads) {
+        pCounters->sinks[slot].AddTo(stats);
+    }
+    exited.sinks[slot].AddTo(stats);
+}
+
+// Counters of the calling thread, NULL until the thread records something
+static thread_local LogThreadCounters *pThreadCounters = NULL;
+
+// Hands the counters back to the registry when the thread exits
+struct ThreadCountersOwner
+{
+    LogThreadCounters *pCounters;
+    ThreadCountersOwner() : pCounters(LogStatsRegistry::Instance().Register()) {}
+    ~ThreadCountersOwner() {
+        LogStatsRegistry::Instance().Unregister(pCounters);
+        // Thread local destructors running after this one (e.g. the buffer cache) must not register again
+        pThreadCounters = &exitingThreadCounters;
+    }
+    static LogThreadCounters exitingThreadCounters;	// shared by exiting threads, counts may get lost
+};
+LogThreadCounters ThreadCountersOwner::exitingThreadCounters;
+
+static __inline LogThreadCounters &ThreadCounters() {
+    if (pThreadCounters == NULL) {
+        static thread_local ThreadCountersOwner owner;
+        pThreadCounters = owner.pCounters;
+    }
+    return *pThreadCounters;
+}
+
+static int64_t MonotonicNs() {
+#ifdef WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t) ((double) now.QuadPart * 1000000000.0 / (double) freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + (int64_t) ts.tv_nsec;
+#endif
+}
+
+// Index of the highest bit, latency bucket for a duration
+static __inline int StatsBucket(uint64_t ns) {
+    int bucket = 0;
+    while ((ns > 1) && (bucket < LOG_STATS_LATENCY_BUCKETS - 1)) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+//
+// Hands records to one sink and counts what happened
+// Records below the sink level have been formatted for nothing, they are counted as filtered late
+//
+// Records with fields go through WriteFields, the runs of records between them through WriteBatch
+static int WriteWithFields(ILogOutputSink *pSink, const LogRecord *records, int nRecords) {
+    int nTotal = 0;
+    bool bError = false;
+    int iStart = 0;
+    for (int i = 0; i <= nRecords; i++) {
+        if ((i < nRecords) && (records[i].fields == NULL)) {
+            continue;
+        }
+        int res = (i > iStart) ? pSink->WriteBatch(&records[iStart], i - iStart) : 0;
+        if (res > 0) {
+            nTotal += res;
+        } else if (res == SINK_WRITE_IO_ERROR) {
+            bError = true;
+        }
+        res = (i < nRecords) ? pSink->WriteFields(records[i]) : 0;
+        if (res > 0) {
+            nTotal += res;
+        } else if (res == SINK_WRITE_IO_ERROR) {
+            bError = true;
+        }
+        iStart = i + 1;
+    }
+    return bError ? SINK_WRITE_IO_ERROR : nTotal;
+}
+
+static void WriteToSink(ILogOutputSink *pSink, int statsSlot, const LogRecord *records, int nRecords, bool bTiming) {
+    LogProperties *pProps = pSink->GetProperties();
+    int level = (pProps != NULL) ? pProps->GetDebugLevel() : 0;
+    int nAccepted = 0;
+    bool bFields = false;
+    for (int i = 0; i < nRecords; i++) {
+        if (records[i].level >= level) {
+            nAccepted++;
+        }
+        if (records[i].fields != NULL) {
+            bFields = true;
+        }
+    }
+
+    int64_t tStart = bTiming ? MonotonicNs() : 0;
+    int res = bFields ? WriteWithFields(pSink, records, nRecords) : pSink->WriteBatch(records, nRecords);
+    int64_t tEnd = bTiming ? MonotonicNs() : 0;
+
+    // The sink might have logged itself, fetch the counters after the call
+    LogThreadCounters &counters = ThreadCounters();
+    if (nAccepted < nRecords) {
+        LogThreadCounters::Inc(counters.filteredLate, nRecords - nAccepted);
+    }
+    if (statsSlot < 0) {
+        return;
+    }
+    LogThreadSinkCounters &sinkCounters = counters.sinks[statsSlot];
+    if (bTiming) {
+        uint64_t tElapsed = (uint64_t) (tEnd - tStart);
+        LogThreadCounters::Inc(sinkCounters.timeNs, tElapsed);
+        LogThreadCounters::Inc(sinkCounters.latency[StatsBucket(tElapsed)]);
+    }
+    LogThreadCounters::Inc(sinkCounters.calls);
+    LogThreadCounters::Inc(sinkCounters.records, nAccepted);
+    if (nAccepted < nRecords) {
+        LogThreadCounters::Inc(sinkCounters.filtered, nRecords - nAccepted);
+    }
+    if (res > 0) {
+        LogThreadCounters::Inc(sinkCounters.bytes, res);
+    } else if (res == SINK_WRITE_IO_ERROR) {
+        LogThreadCounters::Inc(sinkCounters.ioErrors);
+    }
+}
+
+LogStats Logger::GetStats() {
+    LogStats stats = LogStats();
+    LogStatsRegistry::Instance().Collect(stats);
+    stats.asyncDropped = GetAsyncDropCount();
+    stats.bufferPoolSize = MsgBufferCache::GlobalPoolSize();
+
+    LogSinkReader reader;
+    for (auto it = reader.begin(); it != reader.end(); it++) {
+        LogSinkStats sinkStats = LogSinkStats();
+        sinkStats.name = (*it)->GetName();
+        LogStatsRegistry::Instance().CollectSink(reader.StatsSlot(it), sinkStats);
+        stats.sinks.push_back(sinkStats);
+    }
+    return stats;
+}
+
+void Logger::SetSinkTiming(bool bEnable) {
+    bSinkTiming.store(bEnable, std::memory_order_relaxed);
+}
+
+// Level groups, also used to look up the level names
+int Logger::StatsLevelIndex(int iDbgLevel) {
+    if (iDbgLevel < (int) kMCNone) {
+        return LOG_STATS_LEVELS - 1;
+    }
+    int idx = iDbgLevel / 100;
+    return (idx < 5) ? idx : 5;
+}
+
+void Logger::CountFilteredEarly() {
+    LogThreadCounters::Inc(ThreadCounters().filteredEarly);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Rate limiting and sampling
+//
+LogRateLimiter::LogRateLimiter() {
+    interval.store(0, std::memory_order_relaxed);
+    tolerance.store(0, std::memory_order_relaxed);
+    tat.store(0, std::memory_order_relaxed);
+    nSuppressed.store(0, std::memory_order_relaxed);
+}
+
+void LogRateLimiter::Configure(double perSecond, int burst) {
+    if (perSecond <= 0) {
+        interval.store(0, std::memory_order_relaxed);
+        return;
+    }
+    int64_t tInterval = (int64_t) (1000000000.0 / perSecond);
+    if (tInterval < 1) {
+        tInterval = 1;
+    }
+    if (burst <= 0) {
+        burst = (perSecond > 1) ? (int) perSecond : 1;
+    }
+    tolerance.store(tInterval * (burst - 1), std::memory_order_relaxed);
+    interval.store(tInterval, std::memory_order_relaxed);
+}
+
+bool LogRateLimiter::Accept(int64_t tNow) {
+    int64_t tInterval = interval.load(std::memory_order_relaxed);
+    if (tInterval <= 0) {
+        return true;
+    }
+    int64_t tTolerance = tolerance.load(std::memory_order_relaxed);
+    int64_t tExpected = tat.load(std::memory_order_relaxed);
+    for (;;) {
+        int64_t tSlot = (tExpected > tNow) ? tExpected : tNow;
+        if (tSlot - tNow > tTolerance) {
+            nSuppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (tat.compare_exchange_weak(tExpected, tSlot + tInterval, std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+LogLimits::LogLimits() {
+    sampleEvery.store(0, std::memory_order_relaxed);
+    sampleTick.store(0, std::memory_order_relaxed);
+    nSampledOut.store(0, std::memory_order_relaxed);
+    tNextSummary.store(0, std::memory_order_relaxed);
+}
+
+LogCallSiteTable::LogCallSiteTable() {
+    for (int i = 0; i < LOG_CALLSITE_SLOTS; i++) {
+        slots[i].sFormat.store(NULL, std::memory_order_relaxed);
+        slots[i].tNextSummary.store(0, std::memory_order_relaxed);
+        slots[i].pLogger.store(NULL, std::memory_order_relaxed);
+        slots[i].level.store(0, std::memory_order_relaxed);
+    }
+    perSecond.store(0, std::memory_order_relaxed);
+    burst.store(0, std::memory_order_relaxed);
+}
+
+LogCallSiteTable::CallSite *LogCallSiteTable::Find(const char *sFormat, int64_t tNow) {
+    // Format strings are literals, the low bits carry little information
+    uintptr_t hash = (uintptr_t) sFormat;
+    hash ^= (hash >> 4) ^ (hash >> 12);
+    for (int i = 0; i < LOG_CALLSITE_MAX_PROBE; i++) {
+        CallSite &site = slots[(hash + i) & (LOG_CALLSITE_SLOTS - 1)];
+        const char *sCurrent = site.sFormat.load(std::memory_order_acquire);
+        if (sCurrent == sFormat) {
+            return &site;
+        }
+        if ((sCurrent == NULL) && site.sFormat.compare_exchange_strong(sCurrent, sFormat, std::memory_order_acq_rel)) {
+            site.tNextSummary.store(tNow, std::memory_order_relaxed);
+            site.rate.Configure(perSecond.load(std::memory_order_relaxed), burst.load(std::memory_order_relaxed));
+            return &site;
+        }
+        if (sCurrent == sFormat) {
+            return &site;
+        }
+    }
+    return NULL;
+}
+
+void LogCallSiteTable::Configure(double newPerSecond, int newBurst) {
+    perSecond.store(newPerSecond, std::memory_order_relaxed);
+    burst.store(newBurst, std::memory_order_relaxed);
+    for (int i = 0; i < LOG_CALLSITE_SLOTS; i++) {
+        if (slots[i].sFormat.load(std::memory_order_acquire) != NULL) {
+            slots[i].rate.Configure(newPerSecond, newBurst);
+        }
+    }
+}
+
+// True for the one caller which gets to write the summary for this period
+static bool ClaimSummary(std::atomic<int64_t> &tNextSummary, int64_t tNow, int64_t tInterval) {
+    int64_t tNext = tNextSummary.load(std::memory_order_relaxed);
+    if (tNow < tNext) {
+        return false;
+    }
+    return tNextSummary.compare_exchange_strong(tNext, tNow + tInterval, std::memory_order_relaxed);
+}
+
+static const char sCallSiteSummary[] = "%llu records suppressed by the call site rate limit since the last summary, at '%s'";
+
+//
+// Slow path of IsWithinLimits, some limit is active for this logger or the call sites
+// Sampling applies to DEBUG and INFO, the rate limits to all levels
+//
+bool Logger::CheckLimits(int iDbgLevel, const char *sFormat) {
+    int64_t tNow = MonotonicNs();
+    int64_t tInterval = tSummaryInterval.load(std::memory_order_relaxed);
+    bool bAccept = true;
+
+    LogLimits *pLim = pLimits.load(std::memory_order_acquire);
+    if (pLim != NULL) {
+        int nSampleEvery = pLim->sampleEvery.load(std::memory_order_relaxed);
+        if ((nSampleEvery > 1) && (iDbgLevel < (int) kMCWarning) &&
+            ((pLim->sampleTick.fetch_add(1, std::memory_order_relaxed) % (uint32_t) nSampleEvery) != 0)) {
+            pLim->nSampledOut.fetch_add(1, std::memory_order_relaxed);
+            LogThreadCounters::Inc(ThreadCounters().sampledOut);
+            bAccept = false;
+        } else if (!pLim->rate.Accept(tNow)) {
+            LogThreadCounters::Inc(ThreadCounters().rateLimited);
+            bAccept = false;
+        }
+        if (ClaimSummary(pLim->tNextSummary, tNow, tInterval)) {
+            WriteSuppressedSummary(iDbgLevel, false);
+        }
+    }
+
+    LogCallSiteTable *pSites = callSites.load(std::memory_order_acquire);
+    if (bAccept && (pSites != NULL) && (sFormat != NULL)) {
+        LogCallSiteTable::CallSite *pSite = pSites->Find(sFormat, tNow);
+        if (pSite != NULL) {
+            if (!pSite->rate.Accept(tNow)) {
+                LogThreadCounters::Inc(ThreadCounters().rateLimited);
+                // For a summary written by the timer
+                pSite->level.store(iDbgLevel, std::memory_order_relaxed);
+                pSite->pLogger.store(this, std::memory_order_relaxed);
+                bAccept = false;
+            }
+            if (ClaimSummary(pSite->tNextSummary, tNow, tInterval)) {
+                uint64_t nSuppressed = pSite->rate.TakeSuppressed();
+                if (nSuppressed > 0) {
+                    WriteUnlimited(iDbgLevel, sCallSiteSummary, (unsigned long long) nSuppressed, sFormat);
+                }
+            }
+        }
+    }
+    return bAccept;
+}
+
+// Writes what the rate limit and sampling of this logger have suppressed since the last summary, if anything
+void Logger::WriteSuppressedSummary(int iDbgLevel, bool bForce) {
+    LogLimits *pLim = pLimits.load(std::memory_order_acquire);
+    if (pLim == NULL) {
+        return;
+    }
+    uint64_t nSuppressed = pLim->rate.TakeSuppressed();
+    uint64_t nSampledOut = pLim->nSampledOut.exchange(0, std::memory_order_relaxed);
+    if ((nSuppressed == 0) && (nSampledOut == 0)) {
+        return;
+    }
+    if (bForce && !IsLevelAccepted(iDbgLevel)) {
+        return;
+    }
+    WriteUnlimited(iDbgLevel, "%llu records suppressed by the rate limit and %llu sampled out since the last summary",
+                   (unsigned long long) nSuppressed, (unsigned long long) nSampledOut);
+}
+
+// Call sites with something suppressed, those due for a summary or all of them with 'bForce'
+void Logger::WriteCallSiteSummaries(LogCallSiteTable *pSites, bool bForce) {
+    if (pSites == NULL) {
+        return;
+    }
+    int64_t tNow = MonotonicNs();
+    int64_t tInterval = tSummaryInterval.load(std::memory_order_relaxed);
+    for (int i = 0; i < LOG_CALLSITE_SLOTS; i++) {
+        LogCallSiteTable::CallSite &site = pSites->At(i);
+        const char *sFormat = site.sFormat.load(std::memory_order_acquire);
+        Logger *pLogger = site.pLogger.load(std::memory_order_relaxed);
+        if ((sFormat == NULL) || (pLogger == NULL)) {
+            continue;
+        }
+        if (!bForce && !ClaimSummary(site.tNextSummary, tNow, tInterval)) {
+            continue;
+        }
+        uint64_t nSuppressed = site.rate.TakeSuppressed();
+        if (nSuppressed > 0) {
+            pLogger->WriteUnlimited(site.level.load(std::memory_order_relaxed), sCallSiteSummary, (unsigned long long) nSuppressed, sFormat);
+        }
+    }
+}
+
+//
+// Runs on the housekeeping thread, summaries and 'repeated' lines are written when they are due
+// rather than with the next record of the logger, which might never come
+//
+void Logger::WriteDueSummaries() {
+    std::vector<Logger *> all;
+    CopyLoggers(all);
+    int64_t tNow = MonotonicNs();
+    int64_t tInterval = tSummaryInterval.load(std::memory_order_relaxed);
+    for (auto pLogger: all) {
+        LogLimits *pLim = pLogger->pLimits.load(std::memory_order_acquire);
+        if ((pLim != NULL) && ClaimSummary(pLim->tNextSummary, tNow, tInterval)) {
+            pLogger->WriteSuppressedSummary(kMCWarning, true);
+        }
+        pLogger->FlushRepeated(true);
+    }
+    WriteCallSiteSummaries(callSites.load(std::memory_order_acquire), false);
+}
+
+// Registry lock must be held, without thread support the summaries go out with the next record
+void Logger::StartSummaryTimer() {
+#ifdef LOGGER_HAVE_PTHREADS
+    if (bSummaryTimer) {
+        return;
+    }
+    bSummaryTimer = true;
+    LogHousekeeper::Instance().SetTimer([]() {
+        Logger::WriteDueSummaries();
+    }, LOG_SUMMARY_TICK_MS);
+    // The list of loggers is destroyed at exit, registered after it was created so this runs first
+    atexit(Logger::StopSummaryTimer);
+#endif
+}
+
+void Logger::StopSummaryTimer() {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogHousekeeper::Instance().SetTimer(std::function<void()>(), 0);
+#endif
+}
+
+LogDedupState::LogDedupState() {
+    window.store(0, std::memory_order_relaxed);
+    hash = 0;
+    len = -1;
+    level = 0;
+    tWindowStart = 0;
+    last = LogCapture();
+    nRepeated = 0;
+}
+
+// FNV-1a
+static uint64_t HashMessage(const char *str, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t) str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//
+// Called when a formatted record is dispatched, returns false if it repeats the previous record of this
+// logger within the window. When a run of repeats ends (another message or the window expired) the number
+// of repeats and the last one are returned, the 'repeated' line goes out before this record.
+//
+bool Logger::Deduplicate(const LogCapture &rec, LogCapture *pRepeated, uint64_t *pnRepeated) {
+    *pnRepeated = 0;
+    LogDedupState *pState = pDedup.load(std::memory_order_acquire);
+    if (pState == NULL) {
+        return true;
+    }
+    int64_t tWindow = pState->window.load(std::memory_order_relaxed);
+    if ((tWindow <= 0) && (pState->nRepeated == 0)) {
+        return true;
+    }
+    const char *body = rec.GetText();
+    int len = (int) strlen(body);
+    uint64_t hash = HashMessage(body, len);
+    int64_t tNow = (int64_t) rec.ts.tv_sec * 1000000000LL + rec.ts.tv_nsec;
+
+    LogMutexLock guard(&pState->lock);
+    if ((hash == pState->hash) && (len == pState->len) && (rec.level == pState->level) &&
+        (tNow - pState->tWindowStart < tWindow)) {
+        pState->nRepeated++;
+        pState->last = rec;
+        LogThreadCounters::Inc(ThreadCounters().duplicates);
+        return false;
+    }
+    if (pState->nRepeated > 0) {
+        *pnRepeated = pState->nRepeated;
+        *pRepeated = pState->last;
+    }
+    pState->hash = hash;
+    pState->len = len;
+    pState->level = rec.level;
+    pState->tWindowStart = tNow;
+    pState->nRepeated = 0;
+    return true;
+}
+
+// Sends the 'repeated' line with the header of the last repeat
+void Logger::WriteRepeated(const LogCapture &repeated, uint64_t nRepeated) {
+    char sHdr[MAX_INDENT + 128];
+    char sMsg[64];
+#ifdef LOGGER_HAVE_NEWLINE
+    snprintf(sMsg, sizeof(sMsg), "last message repeated %llu times\n", (unsigned long long) nRepeated);
+#else
+    snprintf(sMsg, sizeof(sMsg), "last message repeated %llu times", (unsigned long long) nRepeated);
+#endif
+    LogRecord record;
+    record.level = repeated.level;
+    record.hdr = sHdr;
+    record.hdrLen = FormatHeader(repeated, sHdr, MAX_INDENT + 128);
+    record.string = sMsg;
+    record.len = (int) strlen(sMsg);
+    record.fields = NULL;
+    record.fieldsLen = 0;
+    record.msgLen = record.len;
+    record.ts = repeated.ts;
+    record.tid = repeated.tid;
+    record.threadName = repeated.threadName;
+    record.indent = repeated.indent;
+    record.pLogger = this;
+    record.pBuf = NULL;
+    SendToSinks(record);
+}
+
+// A run of repeats still open is written, used when flushing and closing - with 'bExpiredOnly' only once its window is over
+void Logger::FlushRepeated(bool bExpiredOnly /* = false */) {
+    LogDedupState *pState = pDedup.load(std::memory_order_acquire);
+    if (pState == NULL) {
+        return;
+    }
+    LogCapture repeated;
+    uint64_t nRepeated;
+    int64_t tNow = 0;
+    if (bExpiredOnly) {
+        // Same clock as the record timestamps
+        struct timespec ts;
+        GetTimestamp(&ts);
+        tNow = (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+    pState->lock.Lock();
+    if (bExpiredOnly && ((pState->nRepeated == 0) || (tNow - pState->tWindowStart < pState->window.load(std::memory_order_relaxed)))) {
+        pState->lock.Unlock();
+        return;
+    }
+    nRepeated = pState->nRepeated;
+    repeated = pState->last;
+    pState->nRepeated = 0;
+    pState->len = -1;
+    pState->lock.Unlock();
+    if (nRepeated > 0) {
+        WriteRepeated(repeated, nRepeated);
+    }
+}
+
+// Value of '<key>.<logger name>' or '<key>'
+static const char *GetLimitValue(const char *key, const char *name, char *dst, int nMax, const char *defValue) {
+    std::string loggerKey = std::string(key) + "." + name;
+    char tmp[64];
+    Logger::GetProperties()->GetValue(key, tmp, sizeof(tmp), defValue);
+    return Logger::GetProperties()->GetValue(loggerKey.c_str(), dst, nMax, tmp);
+}
+
+//
+// Picks up the rate limit, sampling and duplicate suppression for this logger from the properties
+// Called on creation and with the registry lock held when the limits change
+//
+void Logger::ApplyLimits() {
+    char tmp[64];
+    double perSecond = atof(GetLimitValue(LOG_CONF_RATELIMIT, sName, tmp, sizeof(tmp), "0"));
+    int burst = atoi(GetLimitValue(LOG_CONF_RATELIMITBURST, sName, tmp, sizeof(tmp), "0"));
+    int nSampleEvery = atoi(GetLimitValue(LOG_CONF_SAMPLING, sName, tmp, sizeof(tmp), "1"));
+
+    int64_t tDedupWindow = (int64_t) atoi(GetLimitValue(LOG_CONF_DEDUP, sName, tmp, sizeof(tmp), "0")) * 1000000LL;
+
+    LogDedupState *pState = pDedup.load(std::memory_order_acquire);
+    if ((pState == NULL) && (tDedupWindow > 0)) {
+        pState = new LogDedupState();
+    }
+    if (pState != NULL) {
+        pState->window.store(tDedupWindow, std::memory_order_relaxed);
+        pDedup.store(pState, std::memory_order_release);
+        StartSummaryTimer();
+    }
+
+    LogLimits *pLim = pLimits.load(std::memory_order_acquire);
+    if (pLim == NULL) {
+        if ((perSecond <= 0) && (nSampleEvery <= 1)) {
+            return;
+        }
+        pLim = new LogLimits();
+        pLim->tNextSummary.store(MonotonicNs() + tSummaryInterval.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        StartSummaryTimer();
+    }
+    pLim->rate.Configure(perSecond, burst);
+    pLim->sampleEvery.store(nSampleEvery, std::memory_order_relaxed);
+    pLimits.store(pLim, std::memory_order_release);
+}
+
+// Stores the value for the loggers with 'name' (or all loggers) and applies it to the existing ones
+static void SetLimitValue(const char *key, const char *name, const char *value) {
+    if (name == NULL) {
+        Logger::GetProperties()->SetValue(key, value);
+    } else {
+        std::string loggerKey = std::string(key) + "." + name;
+        Logger::GetProperties()->SetValue(loggerKey.c_str(), value);
+    }
+}
+
+void Logger::SetRateLimit(const char *name, double perSecond, int burst /* = 0 */) {
+    char tmp[64];
+    Initialize();
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    snprintf(tmp, sizeof(tmp), "%g", perSecond);
+    SetLimitValue(LOG_CONF_RATELIMIT, name, tmp);
+    snprintf(tmp, sizeof(tmp), "%d", burst);
+    SetLimitValue(LOG_CONF_RATELIMITBURST, name, tmp);
+    for (auto &logger: loggers) {
+        ((Logger *) logger->pLogger)->ApplyLimits();
+    }
+    registry.Unlock();
+}
+
+void Logger::SetSampling(const char *name, int n) {
+    char tmp[64];
+    Initialize();
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    snprintf(tmp, sizeof(tmp), "%d", n);
+    SetLimitValue(LOG_CONF_SAMPLING, name, tmp);
+    for (auto &logger: loggers) {
+        ((Logger *) logger->pLogger)->ApplyLimits();
+    }
+    registry.Unlock();
+}
+
+void Logger::SetCallSiteRateLimit(double perSecond, int burst /* = 0 */) {
+    // A later first Initialize would replace the limit with the configured one
+    Initialize();
+    ApplyCallSiteRateLimit(perSecond, burst);
+}
+
+//
+// The call site table is created the first time a limit is set and kept, it is only published while a limit
+// is active - without one the log path is back to a single load. Readers might still use it after that.
+// Initialize uses this directly, it holds the init lock.
+//
+void Logger::ApplyCallSiteRateLimit(double perSecond, int burst) {
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    LogCallSiteTable *pSites = pCallSiteTable;
+    if ((pSites == NULL) && (perSecond > 0)) {
+        pSites = pCallSiteTable = new LogCallSiteTable();
+    }
+    if (pSites != NULL) {
+        pSites->Configure(perSecond, burst);
+        callSites.store((perSecond > 0) ? pSites : NULL, std::memory_order_release);
+    }
+    if (perSecond > 0) {
+        StartSummaryTimer();
+    }
+    registry.Unlock();
+
+    // What was suppressed before the limit was lifted
+    if (perSecond <= 0) {
+        WriteCallSiteSummaries(pSites, true);
+    }
+}
+
+void Logger::SetDeduplication(const char *name, int windowMs) {
+    char tmp[64];
+    Initialize();
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    snprintf(tmp, sizeof(tmp), "%d", windowMs);
+    SetLimitValue(LOG_CONF_DEDUP, name, tmp);
+    for (auto &logger: loggers) {
+        ((Logger *) logger->pLogger)->ApplyLimits();
+    }
+    registry.Unlock();
+}
+
+void Logger::SetSuppressionSummaryInterval(int seconds) {
+    if (seconds < 1) {
+        seconds = 1;
+    }
+    tSummaryInterval.store((int64_t) seconds * 1000000000LL, std::memory_order_relaxed);
+}
+
+
+/////////
+//
+// -- static functions
+//
+int Logger::iIndentStep = 2;
+std::atomic<uint32_t> Logger::iNextIndex(0);
+std::atomic<bool> Logger::bInitialized(false);
+std::map<std::string, bool> Logger::enabledLoggers;
+
+ILoggerList Logger::loggers;
+Logger::TimeFormat Logger::kTimeFormat = kTFLog4Net;
+Logger::TimeClock Logger::kTimeClock = kTCRealtime;
+Logger::TimePrecision Logger::kTimePrecision = kTPMillis;
+bool Logger::bDeferredFormatting = false;
+LogProperties Logger::properties;
+std::atomic<LogAsyncWriter *> Logger::asyncWriter(NULL);
+std::atomic<int> Logger::iSinkMinLevel(INT_MAX);
+std::atomic<bool> Logger::bDefaultHeader(true);
+std::atomic<bool> Logger::bSinkTiming(false);
+std::atomic<LogCallSiteTable *> Logger::callSites(NULL);
+LogCallSiteTable *Logger::pCallSiteTable = NULL;
+bool Logger::bSummaryTimer = false;
+std::atomic<int64_t> Logger::tSummaryInterval(LOG_DEFAULT_SUPPRESSION_SUMMARY * 1000000000LL);
+
+void Logger::SendToSinks(const LogRecord &record) {
+    SendBatchToSinks(&record, 1);
+}
+
+static __inline LogLayout *SinkLayout(ILogOutputSink *pSink) {
+    LogProperties *pProps = pSink->GetProperties();
+    return (pProps != NULL) ? pProps->GetLayout() : NULL;
+}
+
+void Logger::SendBatchToSinks(const LogRecord *records, int nRecords) {
+    bool bTiming = bSinkTiming.load(std::memory_order_relaxed);
+    bool bLayouts = false;
+    LogSinkReader reader;
+    for (auto it = reader.begin(); it != reader.end(); it++) {
+        if (SinkLayout(*it) == NULL) {
+            WriteToSink(*it, reader.StatsSlot(it), records, nRecords, bTiming);
+        } else {
+            bLayouts = true;
+        }
+    }
+    if (bLayouts) {
+        SendBatchWithLayouts(records, nRecords, bTiming);
+    }
+}
+
+//
+// Sinks with a layout of their own, the headers are rendered once per layout and shared by all sinks using it
+//
+void Logger::SendBatchWithLayouts(const LogRecord *records, int nRecords, bool bTiming) {
+    LogRecord out[LOG_LAYOUT_BATCH_SIZE];
+    char headers[LOG_LAYOUT_BATCH_SIZE][LOG_LAYOUT_HEADER_SIZE];
+    // Same snapshot as the caller, pins nest
+    LogSinkReader reader;
+    for (auto it = reader.begin(); it != reader.end(); it++) {
+        LogLayout *pLayout = SinkLayout(*it);
+        if (pLayout == NULL) {
+            continue;
+        }
+        bool bDone = false;
+        for (auto prev = reader.begin(); (prev != it) && !bDone; prev++) {
+            bDone = (SinkLayout(*prev) == pLayout);
+        }
+        if (bDone) {
+            continue;
+        }
+        for (int ofs = 0; ofs < nRecords; ofs += LOG_LAYOUT_BATCH_SIZE) {
+            int n = ((nRecords - ofs) < LOG_LAYOUT_BATCH_SIZE) ? (nRecords - ofs) : LOG_LAYOUT_BATCH_SIZE;
+            for (int i = 0; i < n; i++) {
+                out[i] = records[ofs + i];
+                out[i].hdr = headers[i];
+                out[i].hdrLen = pLayout->Render(records[ofs + i], headers[i], LOG_LAYOUT_HEADER_SIZE);
+            }
+            for (auto dst = it; dst != reader.end(); dst++) {
+                if (SinkLayout(*dst) == pLayout) {
+                    WriteToSink(*dst, reader.StatsSlot(dst), out, n, bTiming);
+                }
+            }
+        }
+    }
+}
+
+
+#ifdef WIN32
+struct timezone 
+{
+    int  tz_minuteswest; /* minutes W of Greenwich */
+    int  tz_dsttime;     /* type of dst correction */
+};
+
+static int gettimeofday(struct timeval *tv, struct timezone *tz)
+{
+    FILETIME ft;
+    unsigned __int64 tmpres = 0;
+    static int tzflag;
+
+    if (NULL != tv)
+    {
+        GetSystemTimeAsFileTime(&ft);
+
+        tmpres |= ft.dwHighDateTime;
+        tmpres <<= 32;
+        tmpres |= ft.dwLowDateTime;
+
+        /*converting file time to unix epoch*/
+        tmpres /= 10;  /*convert into microseconds*/
+        tmpres -= DELTA_EPOCH_IN_MICROSECS;
+        tv->tv_sec = (long)(tmpres / 1000000UL);
+        tv->tv_usec = (long)(tmpres % 1000000UL);
+    }
+
+    if (NULL != tz)
+    {
+        if (!tzflag)
+        {
+            _tzset();
+            tzflag++;
+        }
+        tz->tz_minuteswest = _timezone / 60;
+        tz->tz_dsttime = _daylight;
+    }
+    return 0;
+}
+#endif
+//
+// Captures the time for a record from the selected clock
+//
+void Logger::GetTimestamp(struct timespec *ts) {
+#ifdef WIN32
+    struct timeval tmv;
+    gettimeofday(&tmv, NULL);
+    ts->tv_sec = tmv.tv_sec;
+    ts->tv_nsec = tmv.tv_usec * 1000;
+#else
+    clockid_t clock = CLOCK_REALTIME;
+#ifdef CLOCK_REALTIME_COARSE
+    if (kTimeClock == kTCRealtimeCoarse) {
+        clock = CLOCK_REALTIME_COARSE;
+    }
+#endif
+    clock_gettime(clock, ts);
+#endif
+}
+
+// Writes 'n' digits of 'v' (zero padded), returns number of chars written
+static __inline int RenderDigits(char *dst, unsigned int v, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        dst[i] = (char) ('0' + (v % 10));
+        v /= 10;
+    }
+    return n;
+}
+
+// The 'dd.mm.yyyy hh:mm:ss' part only changes once per second, each thread keeps the last one it rendered
+#define TIME_CACHE_LEN 19
+typedef struct
+{
+    time_t sec;
+    char text[TIME_CACHE_LEN + 1];
+} TimeStringCache;
+static thread_local TimeStringCache threadTimeCache = { (time_t) -1, {0} };
+
+//
+// Returns a formatted time string for logging
+// string can be either in default kTFLog4Net format or Unix
+// The time is captured by the caller, which allows the string to be rendered on the async writer
+//
+char *Logger::TimeString(int maxchar, char *dst, time_t tSec, long tNsec) {
+    switch (kTimeFormat) {
+        case kTFDefault :
+        case kTFUnix :
+#ifdef WIN32
+            //ctime_s(&tmv.tv_sec, 24,dst);
+#else
+            ctime_r(&tSec, dst);
+#endif
+            dst[24] = '\0';
+            break;
+        case kTFLog4Net : {
+            // 'dd.mm.yyyy hh:mm:ss' + '.' + 9 digits + terminator
+            if (maxchar < TIME_CACHE_LEN + 11) {
+                dst[0] = '\0';
+                break;
+            }
+            TimeStringCache *pCache = &threadTimeCache;
+            if (pCache->sec != tSec) {
+                struct tm gmt;
+#ifdef WIN32
+                gmtime_s(&gmt, &tSec);
+#else
+                gmtime_r(&tSec, &gmt);
+#endif
+                char *ptr = pCache->text;
+                ptr += RenderDigits(ptr, gmt.tm_mday, 2);
+                *ptr++ = '.';
+                ptr += RenderDigits(ptr, gmt.tm_mon + 1, 2);
+                *ptr++ = '.';
+                ptr += RenderDigits(ptr, gmt.tm_year + 1900, 4);
+                *ptr++ = ' ';
+                ptr += RenderDigits(ptr, gmt.tm_hour, 2);
+                *ptr++ = ':';
+                ptr += RenderDigits(ptr, gmt.tm_min, 2);
+                *ptr++ = ':';
+                ptr += RenderDigits(ptr, gmt.tm_sec, 2);
+                *ptr = '\0';
+                pCache->sec = tSec;
+            }
+            memcpy(dst, pCache->text, TIME_CACHE_LEN);
+            char *ptr = &dst[TIME_CACHE_LEN];
+            *ptr++ = '.';
+            switch (kTimePrecision) {
+                case kTPNanos :
+                    ptr += RenderDigits(ptr, (unsigned int) tNsec, 9);
+                    break;
+                case kTPMicros :
+                    ptr += RenderDigits(ptr, (unsigned int) (tNsec / 1000), 6);
+                    break;
+                case kTPMillis :
+                default:
+                    ptr += RenderDigits(ptr, (unsigned int) (tNsec / 1000000), 3);
+                    break;
+            }
+            *ptr = '\0';
+        }
+            break;
+
+    }
+    return dst;
+}
+
+//
+// Message buffers come from a per thread cache, see MsgBufferCache
+//
+static thread_local MsgBufferCache threadBufferCache;
+
+void *Logger::RequestBuffer() {
+    return (void *) threadBufferCache.Request();
+}
+// Retained records hold a reference as well, the buffer goes back when the last one is released
+void Logger::ReleaseBuffer(void *pBuf) {
+    MsgBuffer *pMsgBuf = (MsgBuffer *) pBuf;
+    if (pMsgBuf->Unref()) {
+        threadBufferCache.Release(pMsgBuf);
+    }
+}
+//
+// Logger registry
+//
+LogMutex::LogMutex() {
+#ifdef WIN32
+    InitializeCriticalSection(&cs);
+#elif defined(LOGGER_HAVE_PTHREADS)
+    pthread_mutex_init(&mutex, NULL);
+#endif
+}
+LogMutex::~LogMutex() {
+#ifdef WIN32
+    DeleteCriticalSection(&cs);
+#elif defined(LOGGER_HAVE_PTHREADS)
+    pthread_mutex_destroy(&mutex);
+#endif
+}
+void LogMutex::Lock() {
+#ifdef WIN32
+    EnterCriticalSection(&cs);
+#elif defined(LOGGER_HAVE_PTHREADS)
+    pthread_mutex_lock(&mutex);
+#endif
+}
+void LogMutex::Unlock() {
+#ifdef WIN32
+    LeaveCriticalSection(&cs);
+#elif defined(LOGGER_HAVE_PTHREADS)
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+#define REGISTRY_INITIAL_SLOTS 64
+
+LogRegistry::LogRegistry() {
+    table.store(AllocTable(REGISTRY_INITIAL_SLOTS), std::memory_order_relaxed);
+    nEntries = 0;
+}
+LogRegistry::~LogRegistry() {
+    Table *pTable = table.load(std::memory_order_relaxed);
+    retired.push_back(pTable);
+    for (auto &t: retired) {
+        delete[] t->slots;
+        delete t;
+    }
+}
+
+// FNV-1a over name and prefix, the separator differs for a NULL prefix so ("a", NULL) and ("a", "") don't collide
+uint32_t LogRegistry::Hash(const char *name, const char *prefix) {
+    uint32_t h = 2166136261u;
+    while (*name != '\0') {
+        h = (h ^ (uint8_t) *name++) * 16777619u;
+    }
+    h = (h ^ ((prefix == NULL) ? 0xfeu : 0xffu)) * 16777619u;
+    if (prefix != NULL) {
+        while (*prefix != '\0') {
+            h = (h ^ (uint8_t) *prefix++) * 16777619u;
+        }
+    }
+    return h;
+}
+
+LogRegistry::Table *LogRegistry::AllocTable(size_t nSlots) {
+    Table *pTable = new Table();
+    pTable->mask = nSlots - 1;
+    pTable->slots = new Slot[nSlots];
+    for (size_t i = 0; i < nSlots; i++) {
+        pTable->slots[i].hash = 0;
+        pTable->slots[i].pLogger.store(NULL, std::memory_order_relaxed);
+    }
+    return pTable;
+}
+
+void LogRegistry::Place(Table *pTable, uint32_t hash, ILogger *pLogger) {
+    size_t idx = hash & pTable->mask;
+    while (pTable->slots[idx].pLogger.load(std::memory_order_relaxed) != NULL) {
+        idx = (idx + 1) & pTable->mask;
+    }
+    pTable->slots[idx].hash = hash;
+    pTable->slots[idx].pLogger.store(pLogger, std::memory_order_release);
+}
+
+ILogger *LogRegistry::Find(const char *name, const char *prefix) {
+    uint32_t hash = Hash(name, prefix);
+    Table *pTable = table.load(std::memory_order_acquire);
+    size_t idx = hash & pTable->mask;
+    ILogger *pLogger;
+    while ((pLogger = pTable->slots[idx].pLogger.load(std::memory_order_acquire)) != NULL) {
+        if ((pTable->slots[idx].hash == hash) && !strcmp(pLogger->GetName(), name)) {
+            const char *other = pLogger->GetPrefix();
+            if ((prefix == NULL) ? (other == NULL) : ((other != NULL) && !strcmp(other, prefix))) {
+                return pLogger;
+            }
+        }
+        idx = (idx + 1) & pTable->mask;
+    }
+    return NULL;
+}
+
+void LogRegistry::Insert(ILogger *pLogger) {
+    Table *pTable = table.load(std::memory_order_relaxed);
+    // Keep the load below 1/2, the new table is fully populated before it is published
+    if ((nEntries + 1) * 2 > pTable->mask + 1) {
+        Table *pGrown = AllocTable((pTable->mask + 1) * 2);
+        for (size_t i = 0; i <= pTable->mask; i++) {
+            ILogger *pExisting = pTable->slots[i].pLogger.load(std::memory_order_relaxed);
+            if (pExisting != NULL) {
+                Place(pGrown, pTable->slots[i].hash, pExisting);
+            }
+        }
+        table.store(pGrown, std::memory_order_release);
+        retired.push_back(pTable);
+        pTable = pGrown;
+    }
+    Place(pTable, Hash(pLogger->GetName(), pLogger->GetPrefix()), pLogger);
+    nEntries++;
+}
+
+void LogRegistry::Clear() {
+    Table *pTable = table.load(std::memory_order_relaxed);
+    table.store(AllocTable(REGISTRY_INITIAL_SLOTS), std::memory_order_release);
+    retired.push_back(pTable);
+    nEntries = 0;
+}
+
+// Never destroyed, loggers can be fetched while the process is shutting down
+LogRegistry &Logger::Registry() {
+    static LogRegistry *pRegistry = new LogRegistry();
+    return *pRegistry;
+}
+
+// Loggers are never deleted, the copy can be used once the lock is released
+void Logger::CopyLoggers(std::vector<Logger *> &dst) {
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    for (auto &logger: loggers) {
+        dst.push_back((Logger *) logger->pLogger);
+    }
+    registry.Unlock();
+}
+
+//
+// Sink snapshots
+//
+static __inline void YieldThread() {
+#ifdef WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+// The hazard slot of a thread, given back when the thread exits
+struct LogSinkPin
+{
+    LogSinkSet::Slot *pSlot;
+    LogSinkSnapshot *pSnapshot;
+    int depth;
+    LogSinkPin() : pSlot(NULL), pSnapshot(NULL), depth(0) {}
+    ~LogSinkPin() {
+        if (pSlot != NULL) {
+            pSlot->pSnapshot.store(NULL);
+            pSlot->bInUse.store(false, std::memory_order_release);
+            // Thread local destructors running after this one take a new slot if they log
+            pSlot = NULL;
+        }
+    }
+};
+static thread_local LogSinkPin threadSinkPin;
+
+LogSinkSet::LogSinkSet() : current(new LogSinkSnapshot()), slots(NULL) {
+}
+
+// Never destroyed, sinks are used while the process is shutting down
+LogSinkSet &LogSinkSet::Instance() {
+    static LogSinkSet *pInstance = new LogSinkSet();
+    return *pInstance;
+}
+
+LogSinkSet::Slot *LogSinkSet::AcquireSlot() {
+    for (Slot *pSlot = slots.load(std::memory_order_acquire); pSlot != NULL; pSlot = pSlot->pNext) {
+        bool bFree = false;
+        if (!pSlot->bInUse.load(std::memory_order_relaxed) && pSlot->bInUse.compare_exchange_strong(bFree, true, std::memory_order_acquire)) {
+            return pSlot;
+        }
+    }
+    Slot *pSlot = new Slot();
+    pSlot->pSnapshot.store(NULL, std::memory_order_relaxed);
+    pSlot->bInUse.store(true, std::memory_order_relaxed);
+    pSlot->pNext = slots.load(std::memory_order_relaxed);
+    while (!slots.compare_exchange_weak(pSlot->pNext, pSlot, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return pSlot;
+}
+
+//
+// The snapshot is announced in the slot before it is used, if it is still the current one after that a writer
+// retiring it later sees the slot. Otherwise try again with the newer one.
+//
+LogSinkSnapshot *LogSinkSet::Pin() {
+    LogSinkPin &pin = threadSinkPin;
+    if (pin.depth++ > 0) {
+        return pin.pSnapshot;
+    }
+    if (pin.pSlot == NULL) {
+        pin.pSlot = AcquireSlot();
+    }
+    LogSinkSnapshot *pSnapshot = current.load();
+    for (;;) {
+        pin.pSlot->pSnapshot.store(pSnapshot);
+        LogSinkSnapshot *pNow = current.load();
+        if (pNow == pSnapshot) {
+            break;
+        }
+        pSnapshot = pNow;
+    }
+    pin.pSnapshot = pSnapshot;
+    return pSnapshot;
+}
+
+void LogSinkSet::Unpin() {
+    LogSinkPin &pin = threadSinkPin;
+    if (--pin.depth == 0) {
+        pin.pSlot->pSnapshot.store(NULL, std::memory_order_release);
+        pin.pSnapshot = NULL;
+    }
+}
+
+bool LogSinkSet::IsPinned(LogSinkSnapshot *pSnapshot) {
+    for (Slot *pSlot = slots.load(std::memory_order_acquire); pSlot != NULL; pSlot = pSlot->pNext) {
+        if (pSlot->pSnapshot.load() == pSnapshot) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void LogSinkSet::Destroy(LogSinkSnapshot *pSnapshot) {
+    for (auto pSink: pSnapshot->dropped) {
+        pSink->Close();
+        delete pSink;
+    }
+    for (auto slot: pSnapshot->droppedSlots) {
+        LogStatsRegistry::Instance().ReleaseSinkSlot(slot);
+    }
+    delete pSnapshot;
+}
+
+void LogSinkSet::Update(const std::function<void(std::vector<ILogOutputSink *> &, std::vector<ILogOutputSink *> &)> &edit) {
+    lock.Lock();
+    LogSinkSnapshot *pOld = current.load(std::memory_order_relaxed);
+    LogSinkSnapshot *pNew = new LogSinkSnapshot();
+    pNew->sinks = pOld->sinks;
+    edit(pNew->sinks, pOld->dropped);
+    // Sinks keep their stats slot from snapshot to snapshot, new sinks get one and dropped sinks give theirs back
+    for (auto pSink: pNew->sinks) {
+        auto it = std::find(pOld->sinks.begin(), pOld->sinks.end(), pSink);
+        int slot = (it != pOld->sinks.end()) ? pOld->statsSlots[it - pOld->sinks.begin()] : LogStatsRegistry::Instance().AcquireSinkSlot();
+        pNew->statsSlots.push_back(slot);
+    }
+    for (auto pSink: pOld->dropped) {
+        auto it = std::find(pOld->sinks.begin(), pOld->sinks.end(), pSink);
+        if (it != pOld->sinks.end()) {
+            pOld->droppedSlots.push_back(pOld->statsSlots[it - pOld->sinks.begin()]);
+        }
+    }
+    current.store(pNew);
+    retired.push_back(pOld);
+    lock.Unlock();
+
+    Reclaim(true);
+}
+
+//
+// Oldest first, a sink dropped by a snapshot might still be in use through an older one
+// With 'bWait' other threads are waited for, unless this thread is inside a sink itself - two sinks
+// removing sinks on different threads would otherwise wait for each other
+//
+void LogSinkSet::Reclaim(bool bWait) {
+    for (;;) {
+        lock.Lock();
+        if (retired.empty()) {
+            lock.Unlock();
+            return;
+        }
+        LogSinkSnapshot *pSnapshot = retired.front();
+        bool bPinned = IsPinned(pSnapshot);
+        if (!bPinned) {
+            retired.pop_front();
+        }
+        lock.Unlock();
+
+        if (!bPinned) {
+            Destroy(pSnapshot);
+            continue;
+        }
+        if (!bWait || (threadSinkPin.depth > 0)) {
+            return;
+        }
+        YieldThread();
+    }
+}
+
+//
+// Applies the enabled state to every logger with this name, regardless of prefix
+//
+void Logger::SetEnabledByName(const char *name, bool bEnabled) {
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    // In case this is called before the logger is created
+    // we need to store that so when the logger is created we can apply it...
+    enabledLoggers[std::string(name)] = bEnabled;
+    for (auto &logger: loggers) {
+        if (!strcmp(logger->pLogger->GetName(), name)) {
+            logger->pLogger->SetEnabled(bEnabled);
+        }
+    }
+    registry.Unlock();
+}
+
+void Logger::DisableLogger(const char *name) {
+    SetEnabledByName(name, false);
+}
+
+void Logger::EnableLogger(const char *name) {
+    SetEnabledByName(name, true);
+}
+
+void Logger::DisableAllLoggers() {
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    // All active loggers
+    for (auto &logger: loggers) {
+        logger->pLogger->SetEnabled(false);
+    }
+    // Some might have been tagged for enabled when created - we need to disable them as well
+    for (auto it = enabledLoggers.begin(); it != enabledLoggers.end(); ++it) {
+        it->second = false;
+    }
+
+    properties.EnableOnCreate(false);
+    registry.Unlock();
+}
+void Logger::EnableAllLoggers() {
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    for (auto &logger: loggers) {
+        logger->pLogger->SetEnabled(true);
+    }
+    // Some might have been tagged for disable when created - we need to enable them as well
+    for (auto it = enabledLoggers.begin(); it != enabledLoggers.end(); ++it) {
+        it->second = true;
+    }
+    properties.EnableOnCreate(true);
+    registry.Unlock();
+}
+
+
+
+//
+// This returns a Logger with a name and optionally a prefix
+// You can supply just a name and enable the AutoSplitPrefix feature which will
+// automatically generate a prefix from the name.
+// Names must be on the form: '<prefix>::<item>' like: "MyClass::Function"
+// If AutoSplitPrefix is FALSE the name will be used as is and the prefix added if specified.
+// Reason why prefix is added 'behind' is because of API compatibility.
+// Loggers are looked up on (name, prefix), lookups of existing loggers don't take any lock.
+//
+ILogger *Logger::GetLogger(const char *name, const char *prefix /* = NULL */) {
+    ILogger *pLogger = NULL;
+    LoggerInstance *pInstance;
+
+    // Prefix handling could do with refactoring....
+    char *logprefix = (char *) prefix;
+    char namebuffer[128];
+    strncpy(namebuffer, name, 127);
+    namebuffer[127] = '\0';
+
+    char *logname = namebuffer;
+
+    Initialize();
+    if (prefix == NULL && properties.IsAutoPrefixEnabled()) {
+        // a name with 'prefixing' looks like:  "prefix::item"
+        // generally the prefix would be the class name and the item equals the function
+        char *split = (char *) strchr(namebuffer, ':');
+        if ((split != NULL) && (split[1] == ':')) {
+            logname = (char *) &split[2];    // this is the name
+            logprefix = namebuffer;
+            split[0] = '\0';
+        }
+    }
+
+    LogRegistry &registry = Registry();
+    pLogger = registry.Find(logname, logprefix);
+    if (pLogger != NULL) {
+        return pLogger;
+    }
+
+    // Have to create a new logger, check again - someone might have beaten us to it
+    registry.Lock();
+    pLogger = registry.Find(logname, logprefix);
+    if (pLogger == NULL) {
+        pLogger = (ILogger *) new Logger(logname, logprefix);
+        pInstance = new LoggerInstance(pLogger);
+        // TODO: Support for exclude list
+
+        loggers.push_back(pInstance);
+        registry.Insert(pLogger);
+    }
+    registry.Unlock();
+    return pLogger;
+}
+
+void Logger::CloseAll() {
+    Initialize();
+
+    // What the rate limits suppressed in the last period would otherwise never be reported
+    // Written without the registry lock, a sink might fetch a logger
+    std::vector<Logger *> all;
+    CopyLoggers(all);
+    for (auto pLogger: all) {
+        pLogger->WriteSuppressedSummary(kMCWarning, true);
+    }
+    LogRegistry &registry = Registry();
+    registry.Lock();
+    LogCallSiteTable *pSites = pCallSiteTable;
+    registry.Unlock();
+    WriteCallSiteSummaries(pSites, true);
+
+    // Make sure everything queued has reached the sinks before closing them
+    DisableAsync();
+
+    for (auto pLogger: all) {
+        pLogger->FlushRepeated();
+    }
+
+    // Closed and deleted once no other thread is writing to them
+    LogSinkSet::Instance().Update([](std::vector<ILogOutputSink *> &sinks, std::vector<ILogOutputSink *> &dropped) {
+        dropped.insert(dropped.end(), sinks.begin(), sinks.end());
+        sinks.clear();
+    });
+    SinkLevelsChanged();
+
+    registry.Lock();
+    loggers.clear();
+    registry.Clear();
+    registry.Unlock();
+}
+
+void Logger::SetAllSinkDebugLevel(int iNewDebugLevel) {
+    // This might very well be the first call, make sure we are initalized
+    Initialize();
+
+    LogSinkReader reader;
+    for (auto pSink: reader) {
+        pSink->GetProperties()->SetDebugLevel(iNewDebugLevel);
+    }
+}
+
+// Without initialization
+void Logger::AddSink(ILogOutputSink *pSink, const char *sName) {
+    // Don't add an empty sink...
+    if ((pSink == nullptr) || (sName == nullptr)) {
+        return;
+    }
+
+    LogBaseSink *pBase = (LogBaseSink *) pSink;
+    pBase->SetName(sName);
+    LogSinkSet::Instance().Update([pSink](std::vector<ILogOutputSink *> &sinks, std::vector<ILogOutputSink *> &) {
+        sinks.push_back(pSink);
+    });
+    SinkLevelsChanged();
+}
+// With initialization
+void Logger::AddSink(ILogOutputSink *pSink, const char *sName, int argc, const char **argv) {
+    pSink->Initialize(argc, argv);
+    AddSink(pSink, sName);
+}
+
+//
+// Safe while other threads are logging, the sink is closed and deleted once the last of them is done with it
+//
+bool Logger::RemoveSink(const char *sName) {
+    bool bRemoved = false;
+    LogSinkSet::Instance().Update([sName, &bRemoved](std::vector<ILogOutputSink *> &sinks, std::vector<ILogOutputSink *> &dropped) {
+        auto cbCheckSink = [sName](ILogOutputSink *pSink) -> bool {
+            return !strcmp(sName, pSink->GetName());
+        };
+        auto it = std::stable_partition(sinks.begin(), sinks.end(), [&cbCheckSink](ILogOutputSink *pSink) { return !cbCheckSink(pSink); });
+        bRemoved = (it != sinks.end());
+        dropped.insert(dropped.end(), it, sinks.end());
+        sinks.erase(it, sinks.end());
+    });
+    SinkLevelsChanged();
+    return bRemoved;
+}
+
+//
+// Records below the lowest sink level are rejected before any formatting is done
+// No sinks means nothing is accepted
+//
+void Logger::SinkLevelsChanged() {
+    int minLevel = INT_MAX;
+    bool bDefault = false;
+    LogSinkReader reader;
+    for (auto pSink: reader) {
+        LogProperties *pProps = pSink->GetProperties();
+        int level = (pProps != NULL) ? pProps->GetDebugLevel() : 0;
+        if (level < minLevel) {
+            minLevel = level;
+        }
+        if ((pProps == NULL) || (pProps->GetLayout() == NULL)) {
+            bDefault = true;
+        }
+    }
+    iSinkMinLevel.store(minLevel, std::memory_order_relaxed);
+    bDefaultHeader.store(bDefault, std::memory_order_relaxed);
+}
+
+//
+// Wait for the async writer (if any) to write everything queued so far and flush all sinks
+//
+void Logger::Flush() {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    if ((pWriter != NULL) && !pWriter->IsWriterThread()) {
+        pWriter->WaitDrained();
+    }
+#endif
+    // A run of repeated messages still within its window, written without the registry lock
+    std::vector<Logger *> all;
+    CopyLoggers(all);
+    for (auto pLogger: all) {
+        pLogger->FlushRepeated();
+    }
+
+    {
+        LogSinkReader reader;
+        for (auto pSink: reader) {
+            pSink->Flush();
+        }
+    }
+    // Sinks removed from inside a sink are closed once nobody uses them
+    LogSinkSet::Instance().Reclaim(false);
+}
+
+//
+// Create sink's based on class name and factory instances in the global list
+//
+ILogOutputSink *Logger::CreateSink(const char *className) {
+    for (int i = 0; sinkFactoryList[i].factory != NULL; i++) {
         if (sinkFactoryList[i].name == className) {
             return sinkFactoryList[i].factory();
         }
@@ -763,9 +3654,7 @@ void Logger::RebuildSinksFromConfiguration() {
     if (!properties.GetValue("sinks", appenders, 256, NULL)) return;
 
     std::vector<std::string> arAppenders;
-
-    // TODO: need to call destructors here I guess
-    sinks.clear();
+    std::vector<ILogOutputSink *> newSinks;
 
     int nAppenders = StrExplode(&arAppenders, appenders, ',');
     for (int i = 0; i < nAppenders; i++) {
@@ -775,45 +3664,60 @@ void Logger::RebuildSinksFromConfiguration() {
             LogBaseSink *pSink = (LogBaseSink *) CreateSink(className);
             if (pSink != NULL) {
                 // 1) Extract all known properties and put to sink
+                // 'appender.key=value' is set as 'key=value' on the sink
                 std::vector<std::pair<std::string, std::string> > sinkProperties;
-                properties.GetAllStartingWith(&sinkProperties, arAppenders[i].c_str());
+                std::string sinkPrefix = arAppenders[i] + ".";
+                properties.GetAllStartingWith(&sinkProperties, sinkPrefix.c_str());
                 for (int p = 0; p < (int) sinkProperties.size(); p++) {
-                    pSink->GetProperties()->SetValue(sinkProperties[i].first.c_str(), sinkProperties[i].second.c_str());
+                    std::string key = sinkProperties[p].first.substr(sinkPrefix.length());
+                    pSink->GetProperties()->SetValue(key.c_str(), sinkProperties[p].second.c_str());
                 }
                 // 2) Call initialize and attach
                 pSink->Initialize(0, NULL);
-                sinks.push_back(std::unique_ptr<ILogOutputSink>(pSink));
+                pSink->SetName(arAppenders[i].c_str());
+                newSinks.push_back(pSink);
             }
         }
     }
+    // The old sinks are closed and deleted once no other thread is writing to them
+    LogSinkSet::Instance().Update([&newSinks](std::vector<ILogOutputSink *> &sinks, std::vector<ILogOutputSink *> &dropped) {
+        dropped.insert(dropped.end(), sinks.begin(), sinks.end());
+        sinks = newSinks;
+    });
+    SinkLevelsChanged();
 }
 
 void Logger::Initialize() {
-    if (Logger::bInitialized) {
+    if (Logger::bInitialized.load(std::memory_order_acquire)) {
+        return;
+    }
+    // Several threads might fetch their first logger at the same time
+    static LogMutex *pInitLock = new LogMutex();
+    pInitLock->Lock();
+    if (Logger::bInitialized.load(std::memory_order_relaxed)) {
+        pInitLock->Unlock();
         return;
     }
 #if defined(DEBUG) || defined(_DEBUG)
     ILogOutputSink *pSink = (ILogOutputSink *) new LogConsoleSink();
     AddSink(pSink, "console", 0, NULL);
 #endif
-    Logger::bInitialized = true;
     properties.SetDebugLevel(DEFAULT_DEBUG_LEVEL);
     properties.SetName("Logger");
 
     // HACK
     properties.ReadFromFile("logger.res");
+    char limit[64];
+    SetSuppressionSummaryInterval(atoi(properties.GetValue(LOG_CONF_SUPPRESSIONSUMMARY, limit, 64, "10")));
+    double callSitePerSecond = atof(properties.GetValue(LOG_CONF_CALLSITERATELIMIT, limit, 64, "0"));
+    ApplyCallSiteRateLimit(callSitePerSecond, atoi(properties.GetValue(LOG_CONF_CALLSITERATELIMITBURST, limit, 64, "0")));
     char appenders[256];
     properties.GetValue("sinks", appenders, 256, "");
-    if (strcmp(appenders, "")) {
-        RebuildSinksFromConfiguration();
-    }
-#ifdef WIN32
-    InitializeCriticalSection(&bufferLock);
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-    pthread_mutex_init(&bufferLock, NULL);
-#endif
-
+    if (strcmp(appenders, "")) {
+        RebuildSinksFromConfiguration();
+    }
+    Logger::bInitialized.store(true, std::memory_order_release);
+    pInitLock->Unlock();
 }
 
 // Regular functions
@@ -831,42 +3735,39 @@ Logger::Logger(const char *sName, const char *sPrefix) {
     } else {
         this->sPrefix = NULL;
     }
-    this->iIndentLevel = 0;
-    this->sIndent = (char *) malloc(MAX_INDENT + 1);
-    memset(this->sIndent, 0, MAX_INDENT + 1);
+    this->iIndex = iNextIndex.fetch_add(1, std::memory_order_relaxed);
+    BuildHeaderFragments();
+    this->pLimits.store(NULL, std::memory_order_relaxed);
+    this->pDedup.store(NULL, std::memory_order_relaxed);
     Logger::Initialize();
+    ApplyLimits();
 }
 Logger::~Logger() {
     free(this->sName);
+    free(this->sFragments);
     // remove this from list of loggers
     // TODO: better clean up, properties...
 }
-static std::string lMessageClassNames[] =
+//
+// Level names right aligned in 8 chars ('%8s'), indexed by StatsLevelIndex
+// The plain name is the tail of the padded one
+//
+#define LOG_LEVEL_NAME_WIDTH 8
+static const char lPaddedLevelNames[LOG_STATS_LEVELS][LOG_LEVEL_NAME_WIDTH + 1] =
         {
-                "NONE",            // 0
-                "DEBUG",        // 1
-                "INFO",            // 2
-                "WARN",            // 3
-                "ERROR",        // 4
-                "CRITICAL"        // 5
-                "CUSTOM"        // 6
+                "    NONE",     // 0
+                "   DEBUG",     // 1
+                "    INFO",     // 2
+                "    WARN",     // 3
+                "   ERROR",     // 4
+                "CRITICAL",     // 5
+                "  CUSTOM",     // 6
         };
-const char *Logger::MessageClassNameFromInt(int mc) {
-    if ((mc >= Logger::kMCNone) && (mc < (int) Logger::kMCDebug)) {
-        return lMessageClassNames[0].c_str();
-    } else if ((mc >= (int) Logger::kMCDebug) && (mc < (int) Logger::kMCInfo)) {
-        return lMessageClassNames[1].c_str();
-    } else if ((mc >= (int) Logger::kMCInfo) && (mc < (int) Logger::kMCWarning)) {
-        return lMessageClassNames[2].c_str();
-    } else if ((mc >= (int) Logger::kMCWarning) && (mc < (int) Logger::kMCError)) {
-        return lMessageClassNames[3].c_str();
-    } else if ((mc >= (int) Logger::kMCError) && (mc < (int) Logger::kMCCritical)) {
-        return lMessageClassNames[4].c_str();
-    } else if ((mc >= (int) Logger::kMCCritical)) {
-        return lMessageClassNames[5].c_str();
-    }
-    return lMessageClassNames[6].c_str();
+static const int lLevelNameLengths[LOG_STATS_LEVELS] = { 4, 5, 4, 4, 5, 8, 6 };
 
+const char *Logger::MessageClassNameFromInt(int mc) {
+    int idx = StatsLevelIndex(mc);
+    return &lPaddedLevelNames[idx][LOG_LEVEL_NAME_WIDTH - lLevelNameLengths[idx]];
 }
 
 int Logger::MessageLevelFromName(const char *level) {
@@ -881,26 +3782,26 @@ int Logger::MessageLevelFromName(const char *level) {
 }
 
 //
-void Logger::WriteReportString(int mc, MsgBuffer *pBuf) {
-    char sHdr[MAX_INDENT + 64];
-    char sTime[32];    // saftey, 26 is enough
-
+// Thread identity, looked up once per thread
+// The kernel thread id where there is one, it is unique and matches what debuggers and 'top -H' show.
+// pthread_self() is an address on most systems, truncated to 32 bits it can collide.
 //
-    char *string = pBuf->GetBuffer();
-#ifdef LOGGER_HAVE_NEWLINE
-    strncat(string, "\n", pBuf->GetSize());
-#endif
-
-
-    const char *sLevel = MessageClassNameFromInt(mc);
-
-    TimeString(32, sTime);
-    // Create the special header string
-    // Format: "time [thread] msglevel module - "
+typedef struct
+{
+    uint32_t tid;		// 0 - not looked up yet
+    const char *name;	// see Logger::SetThreadName
+} LogThreadIdentity;
+static thread_local LogThreadIdentity threadIdentity = { 0, NULL };
 
+static uint32_t LookupThreadId() {
 #ifdef WIN32
-    DWORD tid = 0;
-    tid = GetCurrentThreadId();
+    return (uint32_t) GetCurrentThreadId();
+#elif defined(__linux__) && defined(SYS_gettid)
+    return (uint32_t) syscall(SYS_gettid);
+#elif defined(__APPLE__)
+    uint64_t tid = 0;
+    pthread_threadid_np(NULL, &tid);
+    return (uint32_t) tid;
 #else
     uint32_t tid = 0;
     pthread_t p_thread = {};
@@ -908,27 +3809,925 @@ void Logger::WriteReportString(int mc, MsgBuffer *pBuf) {
     p_thread = pthread_self();
 #endif
     tid = (uint64_t) (p_thread) & 0xffffffff;
+    return tid;
+#endif
+}
+
+// Returns an id for the calling thread, used in the header
+static __inline uint32_t CurrentThreadId() {
+    if (threadIdentity.tid == 0) {
+        threadIdentity.tid = LookupThreadId();
+    }
+    return threadIdentity.tid;
+}
+
+//
+// Names are kept for the lifetime of the process, queued records and sinks refer to them after the thread is gone.
+// The same name is stored once, a pool of workers naming themselves over and over doesn't grow the table.
+//
+void Logger::SetThreadName(const char *name) {
+    if ((name == NULL) || (name[0] == '\0')) {
+        threadIdentity.name = NULL;
+        return;
+    }
+    static LogMutex *pLock = new LogMutex();
+    static std::map<std::string, char *> *pNames = new std::map<std::string, char *>();
+    LogMutexLock guard(pLock);
+    auto it = pNames->find(name);
+    if (it == pNames->end()) {
+        it = pNames->insert(std::make_pair(std::string(name), strdup(name))).first;
+    }
+    threadIdentity.name = it->second;
+}
+
+const char *Logger::GetThreadName() {
+    return threadIdentity.name;
+}
+
+// ---------------------------------------------------------------------------
+//
+// Deferred formatting
+// In async mode the calling thread can skip vsnprintf and just pack the format pointer and the
+// argument values in to the message buffer, the writer thread formats the message later on.
+// The format string is NOT copied, it must outlive the record (string literals are fine).
+// '%s' arguments are copied, everything else is stored raw. Formats which can't be packed
+// ('%n', wide chars/strings, positional arguments) are formatted directly as before.
+//
+typedef enum
+{
+    kArgInt,
+    kArgLong,
+    kArgLongLong,
+    kArgIntMax,
+    kArgSize,
+    kArgPtrDiff,
+    kArgUInt,
+    kArgULong,
+    kArgULongLong,
+    kArgUIntMax,
+    kArgDouble,
+    kArgLongDouble,
+    kArgString,
+    kArgPointer,
+} LogArgKind;
+
+typedef struct
+{
+    int len;        // length of the spec, including '%' and the conversion character
+    int nStars;     // '*' width/precision, each consumes an 'int' argument before the value
+    int precision;  // FORMAT_NO_PRECISION, FORMAT_STAR_PRECISION (the last '*' value) or the digits
+    LogArgKind kind;
+} LogFormatSpec;
+
+#define FORMAT_SPEC_MAX 32
+#define FORMAT_NO_PRECISION -1
+#define FORMAT_STAR_PRECISION -2
+
+//
+// Parses the conversion spec at 'p' (pointing at '%')
+// Returns 1 for a conversion, 0 for a literal '%%' and -1 if it can't be packed
+//
+static int ParseFormatSpec(const char *p, LogFormatSpec *spec) {
+    const char *start = p;
+    p++;
+    if (*p == '%') {
+        spec->len = 2;
+        return 0;
+    }
+    spec->nStars = 0;
+    spec->precision = FORMAT_NO_PRECISION;
+    // flags
+    while ((*p == '-') || (*p == '+') || (*p == ' ') || (*p == '#') || (*p == '0') || (*p == '\'')) p++;
+    // width
+    if (*p == '*') {
+        spec->nStars++;
+        p++;
+    } else {
+        while ((*p >= '0') && (*p <= '9')) p++;
+    }
+    if (*p == '$') return -1;   // positional arguments
+    // precision
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->nStars++;
+            spec->precision = FORMAT_STAR_PRECISION;
+            p++;
+        } else {
+            int precision = 0;
+            while ((*p >= '0') && (*p <= '9')) {
+                if (precision < INT_MAX / 10) precision = precision * 10 + (*p - '0');
+                p++;
+            }
+            spec->precision = precision;
+        }
+    }
+    // length
+    int nLong = 0;
+    bool bShort = false, bIntMax = false, bSize = false, bPtrDiff = false, bLongDouble = false;
+    for (bool bMore = true; bMore;) {
+        switch (*p) {
+            case 'h' : bShort = true; p++; break;
+            case 'l' : nLong++; p++; break;
+            case 'q' : nLong = 2; p++; break;
+            case 'j' : bIntMax = true; p++; break;
+            case 'z' : bSize = true; p++; break;
+            case 't' : bPtrDiff = true; p++; break;
+            case 'L' : bLongDouble = true; p++; break;
+            default: bMore = false; break;
+        }
+    }
+    bool bSigned = false;
+    switch (*p) {
+        case 'd' :
+        case 'i' :
+            bSigned = true;
+            // fall through
+        case 'u' :
+        case 'o' :
+        case 'x' :
+        case 'X' :
+            if (bIntMax) spec->kind = bSigned ? kArgIntMax : kArgUIntMax;
+            else if (bSize) spec->kind = kArgSize;
+            else if (bPtrDiff) spec->kind = kArgPtrDiff;
+            else if (nLong >= 2) spec->kind = bSigned ? kArgLongLong : kArgULongLong;
+            else if (nLong == 1) spec->kind = bSigned ? kArgLong : kArgULong;
+            else spec->kind = bSigned ? kArgInt : kArgUInt;
+            break;
+        case 'c' :
+            if (nLong) return -1;
+            spec->kind = kArgInt;
+            break;
+        case 'f' :
+        case 'F' :
+        case 'e' :
+        case 'E' :
+        case 'g' :
+        case 'G' :
+        case 'a' :
+        case 'A' :
+            spec->kind = bLongDouble ? kArgLongDouble : kArgDouble;
+            break;
+        case 's' :
+            if (nLong) return -1;
+            spec->kind = kArgString;
+            break;
+        case 'p' :
+            spec->kind = kArgPointer;
+            break;
+        default:
+            // '%n', wide types and anything we don't know about
+            return -1;
+    }
+    (void) bShort;
+    spec->len = (int) (p - start) + 1;
+    if (spec->len >= FORMAT_SPEC_MAX) return -1;
+    return 1;
+}
+
+// Appends raw bytes to the packed buffer, extends the buffer when needed
+static bool PackBytes(MsgBuffer *pBuf, int &ofs, const void *data, int len) {
+    while (ofs + len > pBuf->GetSize()) {
+        int szBefore = pBuf->GetSize();
+        pBuf->Extend(ofs + len);
+        if (pBuf->GetSize() == szBefore) return false;
+    }
+    memcpy(pBuf->GetBuffer() + ofs, data, len);
+    ofs += len;
+    return true;
+}
+
+#define PACK_VALUE(__type, __vatype) {                      \
+        __type v = (__type) va_arg(values, __vatype);       \
+        if (!PackBytes(pBuf, ofs, &v, sizeof(v))) return false; \
+    }
+
+//
+// Packs the format pointer and all arguments in to the buffer, returns false if the format can't be deferred
+// Layout: [const char *format][arguments in format order, strings as int length + chars]
+//
+static bool PackArguments(MsgBuffer *pBuf, const char *sFormat, va_list values) {
+    int ofs = 0;
+    if (!PackBytes(pBuf, ofs, &sFormat, sizeof(sFormat))) return false;
+
+    LogFormatSpec spec;
+    for (const char *p = sFormat; *p != '\0'; p++) {
+        if (*p != '%') continue;
+        int res = ParseFormatSpec(p, &spec);
+        if (res < 0) return false;
+        p += spec.len - 1;
+        if (res == 0) continue;
+
+        int star = 0;
+        for (int i = 0; i < spec.nStars; i++) {
+            star = va_arg(values, int);
+            if (!PackBytes(pBuf, ofs, &star, sizeof(star))) return false;
+        }
+        switch (spec.kind) {
+            case kArgInt : PACK_VALUE(int, int); break;
+            case kArgLong : PACK_VALUE(long, long); break;
+            case kArgLongLong : PACK_VALUE(long long, long long); break;
+            case kArgIntMax : PACK_VALUE(intmax_t, intmax_t); break;
+            case kArgSize : PACK_VALUE(size_t, size_t); break;
+            case kArgPtrDiff : PACK_VALUE(ptrdiff_t, ptrdiff_t); break;
+            case kArgUInt : PACK_VALUE(unsigned int, unsigned int); break;
+            case kArgULong : PACK_VALUE(unsigned long, unsigned long); break;
+            case kArgULongLong : PACK_VALUE(unsigned long long, unsigned long long); break;
+            case kArgUIntMax : PACK_VALUE(uintmax_t, uintmax_t); break;
+            case kArgDouble : PACK_VALUE(double, double); break;
+            case kArgLongDouble : PACK_VALUE(long double, long double); break;
+            case kArgPointer : PACK_VALUE(void *, void *); break;
+            case kArgString : {
+                const char *str = va_arg(values, const char *);
+                if (str == NULL) str = "(null)";
+                // With a precision the string doesn't have to be terminated, don't read past it
+                // A negative '*' precision counts as none
+                int precision = (spec.precision == FORMAT_STAR_PRECISION) ? star : spec.precision;
+                int len = (precision >= 0) ? (int) strnlen(str, (size_t) precision) : (int) strlen(str);
+                int lenPacked = len + 1;
+                if (!PackBytes(pBuf, ofs, &lenPacked, sizeof(lenPacked))) return false;
+                if (!PackBytes(pBuf, ofs, str, len)) return false;
+                if (!PackBytes(pBuf, ofs, "", 1)) return false;
+            }
+                break;
+        }
+    }
+    return true;
+}
+
+#define UNPACK_VALUE(__type, __var) \
+    __type __var;                   \
+    memcpy(&__var, src, sizeof(__var));  \
+    src += sizeof(__var);
+
+//
+// Formats a packed buffer (see PackArguments) in to 'pDst'
+//
+static void FormatPackedArguments(MsgBuffer *pDst, MsgBuffer *pPacked) {
+    const char *src = pPacked->GetBuffer();
+    UNPACK_VALUE(const char *, sFormat);
+
+    int ofs = 0;
+    const char *p = sFormat;
+    LogFormatSpec spec;
+    char sSpec[FORMAT_SPEC_MAX];
+    while (*p != '\0') {
+        // literal run
+        const char *lit = p;
+        while ((*p != '\0') && (*p != '%')) p++;
+        int nLit = (int) (p - lit);
+        if (nLit > 0) {
+            if (!PackBytes(pDst, ofs, lit, nLit)) break;
+        }
+        if (*p == '\0') break;
+
+        if (ParseFormatSpec(p, &spec) == 0) {
+            if (!PackBytes(pDst, ofs, "%", 1)) break;
+            p += 2;
+            continue;
+        }
+        memcpy(sSpec, p, spec.len);
+        sSpec[spec.len] = '\0';
+        p += spec.len;
+
+        int stars[2] = {0, 0};
+        for (int i = 0; i < spec.nStars; i++) {
+            memcpy(&stars[i], src, sizeof(int));
+            src += sizeof(int);
+        }
+        const char *srcValue = src;
+        int res;
+        for (;;) {
+            src = srcValue;
+            char *dst = pDst->GetBuffer() + ofs;
+            size_t nMax = (size_t) (pDst->GetSize() - ofs);
+
+#define FORMAT_VALUE(__type) { \
+                UNPACK_VALUE(__type, v); \
+                if (spec.nStars == 2) res = snprintf(dst, nMax, sSpec, stars[0], stars[1], v); \
+                else if (spec.nStars == 1) res = snprintf(dst, nMax, sSpec, stars[0], v); \
+                else res = snprintf(dst, nMax, sSpec, v); \
+            }
+            switch (spec.kind) {
+                case kArgInt : FORMAT_VALUE(int); break;
+                case kArgLong : FORMAT_VALUE(long); break;
+                case kArgLongLong : FORMAT_VALUE(long long); break;
+                case kArgIntMax : FORMAT_VALUE(intmax_t); break;
+                case kArgSize : FORMAT_VALUE(size_t); break;
+                case kArgPtrDiff : FORMAT_VALUE(ptrdiff_t); break;
+                case kArgUInt : FORMAT_VALUE(unsigned int); break;
+                case kArgULong : FORMAT_VALUE(unsigned long); break;
+                case kArgULongLong : FORMAT_VALUE(unsigned long long); break;
+                case kArgUIntMax : FORMAT_VALUE(uintmax_t); break;
+                case kArgDouble : FORMAT_VALUE(double); break;
+                case kArgLongDouble : FORMAT_VALUE(long double); break;
+                case kArgPointer : FORMAT_VALUE(void *); break;
+                case kArgString : {
+                    UNPACK_VALUE(int, len);
+                    const char *v = src;
+                    src += len;
+                    if (spec.nStars == 2) res = snprintf(dst, nMax, sSpec, stars[0], stars[1], v);
+                    else if (spec.nStars == 1) res = snprintf(dst, nMax, sSpec, stars[0], v);
+                    else res = snprintf(dst, nMax, sSpec, v);
+                }
+                    break;
+                default:
+                    res = 0;
+                    break;
+            }
+#undef FORMAT_VALUE
+            if ((res >= 0) && ((size_t) res < nMax)) {
+                ofs += res;
+                break;
+            }
+            int szBefore = pDst->GetSize();
+            pDst->Extend(ofs + (res > 0 ? res : 0) + 1);
+            if (pDst->GetSize() == szBefore) {
+                // out of memory, keep what we have
+                ofs = pDst->GetSize() - 1;
+                break;
+            }
+        }
+    }
+    // terminate, keep room for the newline
+    if (ofs + 2 > pDst->GetSize()) {
+        pDst->Extend(ofs + 2);
+        if (ofs + 2 > pDst->GetSize()) {
+            ofs = pDst->GetSize() - 2;
+        }
+    }
+    pDst->GetBuffer()[ofs] = '\0';
+}
+
+// ---------------------------------------------------------------------------
+//
+// Structured fields
+// The calling thread only copies the message and encodes the fields behind it (see logger_internal.h),
+// the text form is rendered when the record is dispatched - once, all text sinks share it.
+//
+static bool PackVarint(MsgBuffer *pBuf, int &ofs, uint64_t v) {
+    uint8_t tmp[LOG_BIN_MAX_VARINT];
+    return PackBytes(pBuf, ofs, tmp, LogPutVarint(tmp, v));
+}
+
+static bool PackField(MsgBuffer *pBuf, int &ofs, const LogField &field) {
+    const char *key = (field.key != NULL) ? field.key : "";
+    uint8_t type = (uint8_t) field.type;
+    if (!PackBytes(pBuf, ofs, key, (int) strlen(key) + 1) || !PackBytes(pBuf, ofs, &type, 1)) {
+        return false;
+    }
+    switch (field.type) {
+        case LogField::kInt :
+            return PackVarint(pBuf, ofs, LogZigZag(field.value.i));
+        case LogField::kUInt :
+            return PackVarint(pBuf, ofs, field.value.u);
+        case LogField::kDouble : {
+            uint64_t bits;
+            uint8_t tmp[8];
+            memcpy(&bits, &field.value.d, sizeof(bits));
+            for (int i = 0; i < 8; i++) {
+                tmp[i] = (uint8_t) (bits >> (8 * i));
+            }
+            return PackBytes(pBuf, ofs, tmp, 8);
+        }
+        case LogField::kBool : {
+            uint8_t v = field.value.b ? 1 : 0;
+            return PackBytes(pBuf, ofs, &v, 1);
+        }
+        case LogField::kString :
+            return PackVarint(pBuf, ofs, field.strLen) && PackBytes(pBuf, ofs, field.str, (int) field.strLen);
+    }
+    return false;
+}
+
+bool LogFieldReader::Next(LogField &field) {
+    const uint8_t *end = (left > 0) ? (const uint8_t *) memchr(ptr, 0, left) : NULL;
+    if ((end == NULL) || (end + 1 >= ptr + left)) {
+        left = 0;
+        return false;
+    }
+    int pos = (int) (end - ptr) + 1;
+    int type = ptr[pos++];
+    uint64_t v;
+    int n;
+    field.key = (const char *) ptr;
+    field.str = NULL;
+    field.strLen = 0;
+    switch (type) {
+        case LogField::kInt :
+        case LogField::kUInt :
+            n = LogGetVarint(ptr + pos, left - pos, &v);
+            if (n == 0) {
+                left = 0;
+                return false;
+            }
+            if (type == LogField::kInt) {
+                field.value.i = LogUnZigZag(v);
+            } else {
+                field.value.u = v;
+            }
+            pos += n;
+            break;
+        case LogField::kDouble :
+            if (left - pos < 8) {
+                left = 0;
+                return false;
+            }
+            v = 0;
+            for (int i = 0; i < 8; i++) {
+                v |= (uint64_t) ptr[pos + i] << (8 * i);
+            }
+            memcpy(&field.value.d, &v, sizeof(v));
+            pos += 8;
+            break;
+        case LogField::kBool :
+            if (left - pos < 1) {
+                left = 0;
+                return false;
+            }
+            field.value.b = (ptr[pos++] != 0);
+            break;
+        case LogField::kString :
+            n = LogGetVarint(ptr + pos, left - pos, &v);
+            if ((n == 0) || (v > (uint64_t) (left - pos - n))) {
+                left = 0;
+                return false;
+            }
+            field.str = (const char *) ptr + pos + n;
+            field.strLen = (size_t) v;
+            pos += n + (int) v;
+            break;
+        default:
+            left = 0;
+            return false;
+    }
+    field.type = (LogField::Type) type;
+    ptr += pos;
+    left -= pos;
+    return true;
+}
+
+// Empty strings and strings with spaces, '=', quotes or control chars are quoted
+static bool NeedsQuotes(const char *str, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+        if ((c <= ' ') || (c == '=') || (c == '"') || (c == '\\')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t LogFieldReader::MaxTextSize(const LogField &field) {
+    size_t n = strlen(field.key) + 2;
+    if (field.type == LogField::kString) {
+        return n + 2 * field.strLen + 2;
+    }
+    return n + 32;
+}
+
+size_t LogFieldReader::Render(char *dst, const LogField &field) {
+    size_t n = 0;
+    size_t keyLen = strlen(field.key);
+    dst[n++] = ' ';
+    memcpy(&dst[n], field.key, keyLen);
+    n += keyLen;
+    dst[n++] = '=';
+    int res = 0;
+    switch (field.type) {
+        case LogField::kInt :
+            res = snprintf(&dst[n], 32, "%lld", field.value.i);
+            break;
+        case LogField::kUInt :
+            res = snprintf(&dst[n], 32, "%llu", field.value.u);
+            break;
+        case LogField::kDouble :
+            res = snprintf(&dst[n], 32, "%g", field.value.d);
+            break;
+        case LogField::kBool :
+            res = snprintf(&dst[n], 32, "%s", field.value.b ? "true" : "false");
+            break;
+        case LogField::kString :
+            if (!NeedsQuotes(field.str, field.strLen)) {
+                memcpy(&dst[n], field.str, field.strLen);
+                return n + field.strLen;
+            }
+            dst[n++] = '"';
+            for (size_t i = 0; i < field.strLen; i++) {
+                char c = field.str[i];
+                switch (c) {
+                    case '"' :
+                    case '\\' :
+                        dst[n++] = '\\';
+                        dst[n++] = c;
+                        break;
+                    case '\n' :
+                        dst[n++] = '\\';
+                        dst[n++] = 'n';
+                        break;
+                    case '\r' :
+                        dst[n++] = '\\';
+                        dst[n++] = 'r';
+                        break;
+                    case '\t' :
+                        dst[n++] = '\\';
+                        dst[n++] = 't';
+                        break;
+                    default:
+                        dst[n++] = c;
+                        break;
+                }
+            }
+            dst[n++] = '"';
+            return n;
+    }
+    if (res < 0) {
+        return n;
+    }
+    return n + ((res < 32) ? res : 31);
+}
+
+//
+// Renders the message with the fields as text behind the encoded fields, once per record
+// Without memory for the text the fields are dropped and the record is written with the message only
+//
+static void RenderFields(LogCapture &rec) {
+    if ((rec.fieldsLen == 0) || (rec.textOfs != 0)) {
+        return;
+    }
+    int msgLen = rec.fieldsOfs - 1;
+    int textOfs = rec.fieldsOfs + rec.fieldsLen;
+    size_t nMax = (size_t) msgLen + 2;
+    LogField field;
+    LogFieldReader sizer((const uint8_t *) rec.pBuf->GetBuffer() + rec.fieldsOfs, rec.fieldsLen);
+    while (sizer.Next(field)) {
+        nMax += LogFieldReader::MaxTextSize(field);
+    }
+    if (textOfs + nMax > (size_t) rec.pBuf->GetSize()) {
+        rec.pBuf->Extend((int) (textOfs + nMax));
+        if (textOfs + nMax > (size_t) rec.pBuf->GetSize()) {
+            rec.fieldsLen = 0;
+            return;
+        }
+    }
+
+    char *buf = rec.pBuf->GetBuffer();
+    char *dst = buf + textOfs;
+    size_t len = (size_t) msgLen;
+    memcpy(dst, buf, len);
+    LogFieldReader reader((const uint8_t *) buf + rec.fieldsOfs, rec.fieldsLen);
+    while (reader.Next(field)) {
+        len += LogFieldReader::Render(dst + len, field);
+    }
+#ifdef LOGGER_HAVE_NEWLINE
+    dst[len++] = '\n';
+#endif
+    dst[len] = '\0';
+    rec.textOfs = textOfs;
+}
+
+//
+// Deferred formatting only pays off when the writer thread does the formatting
+//
+bool Logger::IsDeferredFormattingActive() {
+#ifdef LOGGER_HAVE_PTHREADS
+    if (!bDeferredFormatting) {
+        return false;
+    }
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    return ((pWriter != NULL) && pWriter->IsRunning() && !pWriter->IsWriterThread());
+#else
+    return false;
+#endif
+}
+
+static void AppendNewline(MsgBuffer *pBuf) {
+#ifdef LOGGER_HAVE_NEWLINE
+    char *string = pBuf->GetBuffer();
+    size_t len = strlen(string);
+    if ((int) len + 1 < pBuf->GetSize()) {
+        string[len] = '\n';
+        string[len + 1] = '\0';
+    }
 #endif
-    if (this->sPrefix == NULL) {
-        if (IsAutoPrefixEnabled()) {
-            snprintf(sHdr, MAX_INDENT + 64, "%s [%.8x::                ] %8s %32s - %s", sTime, tid, sLevel, sName,
-                     sIndent);
+}
+
+//
+// Indentation (Enter/Leave) is kept per thread - threads sharing a logger don't see each other's indentation.
+// Only the loggers indented on this thread have an entry, it is dropped when the indentation is back at 0
+// so the table stays as small as the nesting, however many loggers the thread has used.
+//
+typedef struct
+{
+    uint32_t idx;
+    int indent;
+} LogThreadIndent;
+
+static thread_local std::vector<LogThreadIndent> threadIndents;
+
+static __inline int ThreadIndent(uint32_t idx) {
+    for (auto &entry: threadIndents) {
+        if (entry.idx == idx) {
+            return entry.indent;
+        }
+    }
+    return 0;
+}
+
+static void SetThreadIndent(uint32_t idx, int indent) {
+    for (size_t i = 0; i < threadIndents.size(); i++) {
+        if (threadIndents[i].idx != idx) {
+            continue;
+        }
+        if (indent > 0) {
+            threadIndents[i].indent = indent;
         } else {
-            snprintf(sHdr, MAX_INDENT + 64, "%s [%.8x] %8s %32s - %s", sTime, tid, sLevel, sName, sIndent);
+            threadIndents[i] = threadIndents.back();
+            threadIndents.pop_back();
+        }
+        return;
+    }
+    if (indent > 0) {
+        threadIndents.push_back({ idx, indent });
+    }
+}
+
+//
+// Captures everything which depends on the calling thread and either queues the record for the
+// async writer or dispatches it directly to the sinks
+//
+void Logger::WriteReportString(int mc, LogEvent &evt, bool bDeferred /* = false */, int fieldsOfs /* = 0 */,
+                               int fieldsLen /* = 0 */) {
+    LogThreadCounters::Inc(ThreadCounters().produced[StatsLevelIndex(mc)]);
+    MsgBuffer *pBuf = evt.GetBuffer();
+    if (!bDeferred && (fieldsLen == 0)) {
+        AppendNewline(pBuf);
+    }
+
+    LogCapture rec;
+    rec.level = mc;
+    rec.pLogger = this;
+    GetTimestamp(&rec.ts);
+    rec.tid = CurrentThreadId();
+    rec.threadName = threadIdentity.name;
+    rec.indent = ThreadIndent(iIndex);
+    rec.deferred = bDeferred;
+    rec.pBuf = pBuf;
+    rec.fieldsOfs = fieldsOfs;
+    rec.fieldsLen = fieldsLen;
+    rec.textOfs = 0;
+
+#ifdef LOGGER_HAVE_PTHREADS
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    // A sink logging from within the writer thread can't wait for the ring, it is written directly
+    if ((pWriter != NULL) && !pWriter->IsWriterThread()) {
+        LogAsyncWriter::PushResult res = pWriter->Push(rec);
+        if (res == LogAsyncWriter::kQueued) {
+            // The writer owns the buffer now and releases it once written
+            evt.Detach();
+            return;
+        } else if (res == LogAsyncWriter::kDropped) {
+            return;
+        }
+        // not running, fall through and write directly
+    }
+#endif
+    DispatchRecord(rec);
+}
+
+//
+// Builds the header for a captured record and sends it to the sinks
+// Does not release the buffer
+//
+void Logger::DispatchRecord(const LogCapture &rec) {
+    MsgBuffer *pBody = rec.pBuf;
+    // Only a deferred record needs a buffer of its own, for the formatted message
+    LogEvent fmtEvt(rec.deferred ? (MsgBuffer *) RequestBuffer() : NULL);
+    if (rec.deferred) {
+        pBody = fmtEvt.GetBuffer();
+        FormatPackedArguments(pBody, rec.pBuf);
+        AppendNewline(pBody);
+    }
+
+    LogCapture formatted = rec;
+    formatted.pBuf = pBody;
+    RenderFields(formatted);
+
+    if (pDedup.load(std::memory_order_relaxed) != NULL) {
+        LogCapture repeated;
+        uint64_t nRepeated;
+        if (!Deduplicate(formatted, &repeated, &nRepeated)) {
+            return;
+        }
+        if (nRepeated > 0) {
+            WriteRepeated(repeated, nRepeated);
+        }
+    }
+
+    LogRecord record;
+    BuildRecord(formatted, record);
+    Logger::SendToSinks(record);
+}
+
+//
+// Replaces packed arguments with the formatted message, the packed buffer is released
+//
+void Logger::ResolveDeferred(LogCapture &rec) {
+    if (!rec.deferred) {
+        return;
+    }
+    LogEvent fmtEvt;
+    MsgBuffer *pBody = fmtEvt.GetBuffer();
+    FormatPackedArguments(pBody, rec.pBuf);
+    AppendNewline(pBody);
+    ReleaseBuffer(rec.pBuf);
+    rec.pBuf = fmtEvt.Detach();
+    rec.deferred = false;
+}
+
+//
+// Writes the header piece by piece, stops at the end of the buffer
+//
+class LogHeaderWriter
+{
+public:
+    LogHeaderWriter(char *dst, int maxLen) : ptr(dst), start(dst), end(dst + maxLen - 1) {}
+    __inline void Put(const char *str, int len) {
+        if (len > end - ptr) len = (int) (end - ptr);
+        memcpy(ptr, str, len);
+        ptr += len;
+    }
+    __inline void PutSpaces(int n) {
+        if (n > end - ptr) n = (int) (end - ptr);
+        if (n > 0) {
+            memset(ptr, ' ', n);
+            ptr += n;
+        }
+    }
+    __inline void PutHex8(uint32_t v) {
+        if (end - ptr >= 8) {
+            ptr += RenderHex(ptr, v, 8);
         }
+    }
+    __inline int Finish() {
+        *ptr = '\0';
+        return (int) (ptr - start);
+    }
+private:
+    char *ptr;
+    char *start;
+    char *end;
+};
+
+//
+// The prefix block and the padded name never change after construction
+// Rendered once here as "::%16s] " and " %32s - ", FormatHeader just copies them
+//
+void Logger::BuildHeaderFragments() {
+    nPrefixFragment = 0;
+    if (sPrefix != NULL) {
+        int nPrefix = (int) strlen(sPrefix);
+        nPrefixFragment = 2 + ((nPrefix > 16) ? nPrefix : 16) + 2;
+    }
+    int nName = (int) strlen(sName);
+    nNameFragment = 1 + ((nName > 32) ? nName : 32) + 3;
+
+    sFragments = (char *) malloc(nPrefixFragment + nNameFragment + 1);
+    if (sPrefix != NULL) {
+        snprintf(sFragments, nPrefixFragment + 1, "::%16s] ", sPrefix);
+    }
+    snprintf(sFragments + nPrefixFragment, nNameFragment + 1, " %32s - ", sName);
+}
+
+//
+// Renders the header for a record, returns the length of the header
+// Format: "time [thread] msglevel module - "
+//
+int Logger::FormatHeader(const LogCapture &rec, char *dst, int maxLen) {
+    char sTime[32];    // saftey, 29 is enough
+
+    // All sinks have a layout of their own, see SendBatchWithLayouts
+    if (!bDefaultHeader.load(std::memory_order_relaxed)) {
+        dst[0] = '\0';
+        return 0;
+    }
+
+    TimeString(32, sTime, rec.ts.tv_sec, rec.ts.tv_nsec);
+    LogHeaderWriter hdr(dst, maxLen);
+    hdr.Put(sTime, (int) strlen(sTime));
+    hdr.Put(" [", 2);
+    hdr.PutHex8(rec.tid);
+    if (this->sPrefix != NULL) {
+        hdr.Put(sFragments, nPrefixFragment);
+    } else if (IsAutoPrefixEnabled()) {
+        hdr.Put("::                ] ", 20);
+    } else {
+        hdr.Put("] ", 2);
+    }
+    hdr.Put(lPaddedLevelNames[StatsLevelIndex(rec.level)], LOG_LEVEL_NAME_WIDTH);
+    hdr.Put(sFragments + nPrefixFragment, nNameFragment);
+    hdr.PutSpaces(rec.indent);
+    return hdr.Finish();
+}
+
+
+//
+// Fills in the record for the sinks, the default header is rendered in to the record buffer after the text
+// so a sink retaining the record (see LogRecord::Retain) keeps all of it without a copy
+//
+void Logger::BuildRecord(const LogCapture &rec, LogRecord &out) {
+    static char sNoHeader[1] = { '\0' };
+    MsgBuffer *pBuf = rec.pBuf;
+    int len = (int) strlen(rec.GetText());
+    int hdrOfs = rec.textOfs + len + 1;
+    if (hdrOfs + LOG_RECORD_HEADER_SIZE > pBuf->GetSize()) {
+        pBuf->Extend(hdrOfs + LOG_RECORD_HEADER_SIZE);
+    }
+    // Less room than asked for only if the buffer could not grow, the header is cut
+    if (hdrOfs < pBuf->GetSize()) {
+        out.hdr = pBuf->GetBuffer() + hdrOfs;
+        out.hdrLen = FormatHeader(rec, out.hdr, pBuf->GetSize() - hdrOfs);
+    } else {
+        out.hdr = sNoHeader;
+        out.hdrLen = 0;
+    }
+
+    out.level = rec.level;
+    out.string = rec.GetText();
+    out.len = len;
+    if (rec.fieldsLen > 0) {
+        out.fields = (const uint8_t *) pBuf->GetBuffer() + rec.fieldsOfs;
+        out.fieldsLen = rec.fieldsLen;
+        out.msgLen = rec.fieldsOfs - 1;
     } else {
-        snprintf(sHdr, MAX_INDENT + 64, "%s [%.8x::%16s] %8s %32s - %s", sTime, tid, sPrefix, sLevel, sName, sIndent);
+        out.fields = NULL;
+        out.fieldsLen = 0;
+        out.msgLen = len;
+    }
+    out.ts = rec.ts;
+    out.tid = rec.tid;
+    out.threadName = rec.threadName;
+    out.indent = rec.indent;
+    out.pLogger = rec.pLogger;
+    out.pBuf = pBuf;
+}
+
+//
+// Retained records, the buffer stays out of the pool until the last reference is gone
+//
+LogRecord LogRecord::Retain() const {
+    LogRecord copy = *this;
+    if ((pBuf != NULL) && pBuf->Contains(string) && ((hdr == NULL) || pBuf->Contains(hdr))) {
+        pBuf->AddRef();
+        return copy;
     }
 
-    Logger::SendToSinks((int) mc, sHdr, string);
+    // Held elsewhere, copied in to a buffer of its own: [message][0][fields][header][0]
+    MsgBuffer *pCopy = (MsgBuffer *) Logger::RequestBuffer();
+    int nNeeded = len + 1 + fieldsLen + hdrLen + 1;
+    if (nNeeded > pCopy->GetSize()) {
+        pCopy->Extend(nNeeded);
+    }
+    char *buf = pCopy->GetBuffer();
+    copy.pBuf = pCopy;
+    if (nNeeded > pCopy->GetSize()) {
+        // Out of memory, the record is kept without any text
+        buf[0] = '\0';
+        copy.string = buf;
+        copy.len = copy.msgLen = 0;
+        copy.hdr = (hdr != NULL) ? buf : NULL;
+        copy.hdrLen = 0;
+        copy.fields = NULL;
+        copy.fieldsLen = 0;
+        return copy;
+    }
+    memcpy(buf, string, len);
+    buf[len] = '\0';
+    copy.string = buf;
+    char *ptr = buf + len + 1;
+    if (fieldsLen > 0) {
+        memcpy(ptr, fields, fieldsLen);
+        copy.fields = (const uint8_t *) ptr;
+        ptr += fieldsLen;
+    }
+    if (hdr != NULL) {
+        memcpy(ptr, hdr, hdrLen);
+        ptr[hdrLen] = '\0';
+        copy.hdr = ptr;
+    }
+    return copy;
 }
 
-void Logger::GenerateIndentString() {
-    memset(this->sIndent, 0, MAX_INDENT + 1);
-    memset(this->sIndent, ' ', iIndentLevel);
+void LogRecord::Release() {
+    if (pBuf != NULL) {
+        Logger::ReleaseBuffer(pBuf);
+        pBuf = NULL;
+    }
 }
 
-
 // This functionality is duplicated by all 'write'-functions. It composes the message
 // string. The reason why it is not in a function is because of the va_xxx functions.
 // Event is essentially a container around the buffer which makes a query for the buffer
@@ -940,17 +4739,32 @@ void Logger::GenerateIndentString() {
         LogEvent evt;                                                    \
         MsgBuffer *pBuf = evt.GetBuffer();                                \
         int res;                                                        \
-        do                                                                \
+        bool bDeferred = false;                                            \
+        if (Logger::IsDeferredFormattingActive()) {                        \
+            va_start( values, sFormat );                                \
+            bDeferred = PackArguments(pBuf, sFormat, values);            \
+            va_end(    values);                                            \
+        }                                                                \
+        while(!bDeferred)                                                \
         {                                                                \
             newstr=pBuf->GetBuffer();                                    \
             va_start( values, sFormat );                                \
             res = vsnprintf(newstr, pBuf->GetSize(), sFormat, values);    \
             va_end(    values);                                            \
-            if (res < 0) {                                                \
+            if ((res >= 0) && (res + 2 > pBuf->GetSize())) {                \
+                /* truncated, need room for string + newline + terminator */ \
+                int szBefore = pBuf->GetSize();                            \
+                pBuf->Extend(res + 2);                                    \
+                res = (pBuf->GetSize() != szBefore) ? -1 : res;            \
+            } else if (res < 0) {                                        \
+                int szBefore = pBuf->GetSize();                            \
                 pBuf->Extend();                                            \
+                /* out of memory, give up and keep what we have */         \
+                res = (pBuf->GetSize() != szBefore) ? -1 : 0;            \
             }                                                            \
-        } while(res < 0);                                                \
-        Logger::WriteReportString(__DBGTYPE__, pBuf);                    \
+            if (res >= 0) break;                                        \
+        }                                                                \
+        Logger::WriteReportString(__DBGTYPE__, evt, bDeferred);         \
     } catch(...) {                                                        \
     }                                                                    \
 
@@ -958,55 +4772,602 @@ void Logger::GenerateIndentString() {
 
 void Logger::WriteLine(int iDbgLevel, const char *sFormat, ...) {
     // Always write stuff without global filtering - let appenders figure it out..
+    // ..except for the compile time level and if no sink would take it
+    if ((iDbgLevel < LOGGER_MIN_LEVEL) || (iDbgLevel < iSinkMinLevel.load(std::memory_order_relaxed))) {
+        CountFilteredEarly();
+        return;
+    }
+    if (!IsWithinLimits(iDbgLevel, sFormat)) {
+        return;
+    }
     WRITE_REPORT_STRING(iDbgLevel);
 }
 void Logger::WriteLine(const char *sFormat, ...) {
     // Always write stuff without global filtering - let appenders figure it out..
+    if ((int) kMCNone < iSinkMinLevel.load(std::memory_order_relaxed)) {
+        CountFilteredEarly();
+        return;
+    }
+    if (!IsWithinLimits(kMCNone, sFormat)) {
+        return;
+    }
     WRITE_REPORT_STRING(kMCNone);
 }
+// Bypasses the rate limits, used for the summaries of what they suppressed
+void Logger::WriteUnlimited(int iDbgLevel, const char *sFormat, ...) {
+    WRITE_REPORT_STRING(iDbgLevel);
+}
 void Logger::Critical(const char *sFormat, ...) {
     if (IsCriticalEnabled()) {
-        WRITE_REPORT_STRING(kMCCritical);
+        if (IsWithinLimits(kMCCritical, sFormat)) {
+            WRITE_REPORT_STRING(kMCCritical);
+        }
+    } else {
+        CountFilteredEarly();
     }
 }
 void Logger::Error(const char *sFormat, ...) {
     if (IsErrorEnabled()) {
-        WRITE_REPORT_STRING(kMCError);
+        if (IsWithinLimits(kMCError, sFormat)) {
+            WRITE_REPORT_STRING(kMCError);
+        }
+    } else {
+        CountFilteredEarly();
     }
 }
 void Logger::Warning(const char *sFormat, ...) {
     if (IsWarningEnabled()) {
-        WRITE_REPORT_STRING(kMCWarning);
+        if (IsWithinLimits(kMCWarning, sFormat)) {
+            WRITE_REPORT_STRING(kMCWarning);
+        }
+    } else {
+        CountFilteredEarly();
     }
 }
 void Logger::Info(const char *sFormat, ...) {
     if (IsInfoEnabled()) {
-        WRITE_REPORT_STRING(kMCInfo);
+        if (IsWithinLimits(kMCInfo, sFormat)) {
+            WRITE_REPORT_STRING(kMCInfo);
+        }
+    } else {
+        CountFilteredEarly();
     }
 }
 void Logger::Debug(const char *sFormat, ...) {
     if (IsDebugEnabled()) {
-        WRITE_REPORT_STRING(kMCDebug);
+        if (IsWithinLimits(kMCDebug, sFormat)) {
+            WRITE_REPORT_STRING(kMCDebug);
+        }
+    } else {
+        CountFilteredEarly();
+    }
+}
+
+// Structured record, the message is copied as is and followed by the encoded fields
+void Logger::WriteFields(int iDbgLevel, const char *sMessage, const LogField *fields, int nFields) {
+    if (!isEnabled || (iDbgLevel < iSinkMinLevel.load(std::memory_order_relaxed))) {
+        CountFilteredEarly();
+        return;
+    }
+    try {
+        LogEvent evt;
+        MsgBuffer *pBuf = evt.GetBuffer();
+        int ofs = 0;
+        if (sMessage == NULL) {
+            sMessage = "";
+        }
+        if (!PackBytes(pBuf, ofs, sMessage, (int) strlen(sMessage) + 1)) {
+            return;
+        }
+        int fieldsOfs = ofs;
+        for (int i = 0; i < nFields; i++) {
+            if (!PackField(pBuf, ofs, fields[i])) {
+                return;
+            }
+        }
+        Logger::WriteReportString(iDbgLevel, evt, false, fieldsOfs, ofs - fieldsOfs);
+    } catch (...) {
     }
 }
 
+// Type safe front-end, the message has already been written to the buffer by LogFmt
+void Logger::WriteFormatted(int iDbgLevel, LogMsgWriter &writer) {
+    if (!isEnabled || (iDbgLevel < iSinkMinLevel.load(std::memory_order_relaxed))) {
+        CountFilteredEarly();
+        return;
+    }
+    try {
+        LogEvent evt(writer.Detach());
+        Logger::WriteReportString(iDbgLevel, evt);
+    } catch (...) {
+    }
+}
+
+int Logger::GetIndent() {
+    return ThreadIndent(iIndex);
+}
+
+int Logger::SetIndent(int nIndent) {
+    if (nIndent < 0) {
+        nIndent = 0;
+    } else if (nIndent > MAX_INDENT) {
+        nIndent = MAX_INDENT;
+    }
+    SetThreadIndent(iIndex, nIndent);
+    return nIndent;
+}
 
 // Increases intendation
 void Logger::Enter() {
-    iIndentLevel += Logger::iIndentStep;
-    if (iIndentLevel > MAX_INDENT) {
-        iIndentLevel = MAX_INDENT;
+    int indent = ThreadIndent(iIndex) + Logger::iIndentStep;
+    if (indent > MAX_INDENT) {
+        indent = MAX_INDENT;
     }
-    GenerateIndentString();
+    SetThreadIndent(iIndex, indent);
 }
 
 // Decreases intendation
 void Logger::Leave() {
-    iIndentLevel -= Logger::iIndentStep;
-    if (iIndentLevel < 0) {
-        iIndentLevel = 0;
+    int indent = ThreadIndent(iIndex) - Logger::iIndentStep;
+    if (indent < 0) {
+        indent = 0;
+    }
+    SetThreadIndent(iIndex, indent);
+}
+
+// ---------------------------------------------------------------------------
+//
+// Async mode
+// Producers push captured records to a bounded lock-free ring, a single writer thread drains
+// the ring in slot order and dispatches the records to the sinks.
+//
+#ifdef LOGGER_HAVE_PTHREADS
+// Serializes EnableAsync/DisableAsync
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stopped writers, producers might still hold one so they are never deleted but reused by the next EnableAsync
+static std::vector<LogAsyncWriter *> stoppedWriters;
+#endif
+
+bool Logger::EnableAsync(int nCapacity /* = LOG_ASYNC_DEFAULT_CAPACITY */, bool bDropWhenFull /* = false */) {
+#ifdef LOGGER_HAVE_PTHREADS
+    static bool bAtExitRegistered = false;
+    Initialize();
+
+    pthread_mutex_lock(&asyncLock);
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    if ((pWriter != NULL) && pWriter->IsRunning()) {
+        pthread_mutex_unlock(&asyncLock);
+        return true;
+    }
+    // The ring can't be resized, a stopped writer is reused if it has the capacity asked for
+    pWriter = NULL;
+    size_t szRing = 2;
+    while (szRing < (size_t) nCapacity) szRing <<= 1;
+    for (auto it = stoppedWriters.begin(); it != stoppedWriters.end(); it++) {
+        if ((*it)->Capacity() == szRing) {
+            pWriter = *it;
+            stoppedWriters.erase(it);
+            break;
+        }
+    }
+    if (pWriter == NULL) {
+        pWriter = new LogAsyncWriter(nCapacity, bDropWhenFull);
+    }
+    if (!pWriter->Start(bDropWhenFull)) {
+        stoppedWriters.push_back(pWriter);
+        pthread_mutex_unlock(&asyncLock);
+        return false;
+    }
+    LogAsyncWriter *pPrevious = asyncWriter.exchange(pWriter, std::memory_order_acq_rel);
+    if (pPrevious != NULL) {
+        stoppedWriters.push_back(pPrevious);
+    }
+    if (!bAtExitRegistered) {
+        atexit(Logger::AsyncAtExit);
+        bAtExitRegistered = true;
+    }
+    pthread_mutex_unlock(&asyncLock);
+    return true;
+#else
+    return false;
+#endif
+}
+
+//
+// Stops the writer thread, everything queued is written before this returns
+// The writer object is kept, a producer which picked it up before the stop just falls back to direct writes
+//
+void Logger::DisableAsync() {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    if ((pWriter == NULL) || pWriter->IsWriterThread()) {
+        return;
+    }
+    pthread_mutex_lock(&asyncLock);
+    asyncWriter.load(std::memory_order_relaxed)->Stop();
+    pthread_mutex_unlock(&asyncLock);
+#endif
+}
+
+bool Logger::IsAsyncEnabled() {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    return ((pWriter != NULL) && pWriter->IsRunning());
+#else
+    return false;
+#endif
+}
+
+uint64_t Logger::GetAsyncDropCount() {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogAsyncWriter *pWriter = asyncWriter.load(std::memory_order_acquire);
+    if (pWriter != NULL) {
+        return pWriter->GetDropCount();
+    }
+#endif
+    return 0;
+}
+
+void Logger::AsyncAtExit() {
+    DisableAsync();
+    Flush();
+}
+
+#ifdef LOGGER_HAVE_PTHREADS
+// Max time the writer sleeps when the ring is empty, covers a wakeup racing with the writer going to sleep
+#define ASYNC_WRITER_IDLE_WAIT_MS 10
+
+LogAsyncWriter::LogAsyncWriter(int nCapacity, bool bDropWhenFull) : queue(nCapacity) {
+    this->bDropWhenFull.store(bDropWhenFull);
+    this->bThreadStarted.store(false);
+    nPushing.store(0);
+    bAccepting.store(false);
+    bRunning.store(false);
+    bSleeping.store(false);
+    nDropped.store(0);
+    nDispatched.store(0);
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&drainLock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+LogAsyncWriter::~LogAsyncWriter() {
+    Stop();
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&drainLock);
+    pthread_mutex_destroy(&lock);
+}
+
+// Also restarts a stopped writer, the ring and the counters are kept
+bool LogAsyncWriter::Start(bool bDropWhenFull) {
+    if (bThreadStarted.load()) {
+        return true;
+    }
+    this->bDropWhenFull.store(bDropWhenFull);
+    bRunning.store(true);
+    if (pthread_create(&thread, NULL, LogAsyncWriter::ThreadFunc, this) != 0) {
+        bRunning.store(false);
+        return false;
+    }
+    bThreadStarted.store(true, std::memory_order_release);
+    bAccepting.store(true, std::memory_order_release);
+    return true;
+}
+
+void LogAsyncWriter::Stop() {
+    if (!bThreadStarted.load()) {
+        return;
+    }
+    // A producer either sees 'accepting' cleared or is counted in 'nPushing' before we look at it
+    bAccepting.store(false);
+    while (nPushing.load() != 0) {
+        Wakeup();
+        sched_yield();
+    }
+    bRunning.store(false);
+    Wakeup();
+    pthread_join(thread, NULL);
+    bThreadStarted.store(false, std::memory_order_release);
+    // The writer drains before it exits, this only picks up what a sink logged while it did so
+    Drain();
+}
+
+LogAsyncWriter::PushResult LogAsyncWriter::Push(const LogCapture &rec) {
+    nPushing.fetch_add(1);
+    if (!bAccepting.load()) {
+        nPushing.fetch_sub(1, std::memory_order_release);
+        return kStopped;
+    }
+    while (!queue.Push(rec)) {
+        if (bDropWhenFull.load(std::memory_order_relaxed)) {
+            nPushing.fetch_sub(1, std::memory_order_release);
+            nDropped.fetch_add(1, std::memory_order_relaxed);
+            return kDropped;
+        }
+        // Full, make sure the writer is awake and wait for a slot
+        Wakeup();
+        sched_yield();
+        if (!bAccepting.load(std::memory_order_acquire)) {
+            nPushing.fetch_sub(1, std::memory_order_release);
+            return kStopped;
+        }
+    }
+    nPushing.fetch_sub(1, std::memory_order_release);
+    if (bSleeping.load()) {
+        Wakeup();
+    }
+    return kQueued;
+}
+
+//
+// Waits until everything pushed before the call has been written to the sinks
+//
+void LogAsyncWriter::WaitDrained() {
+    size_t target = queue.EnqueueCount();
+    while (nDispatched.load(std::memory_order_acquire) < target) {
+        if (!bThreadStarted.load(std::memory_order_acquire)) {
+            Drain();
+            break;
+        }
+        Wakeup();
+        sched_yield();
+    }
+}
+
+void *LogAsyncWriter::ThreadFunc(void *arg) {
+    LogAsyncWriter *pWriter = (LogAsyncWriter *) arg;
+    pWriter->Run();
+    return NULL;
+}
+
+void LogAsyncWriter::Run() {
+    for (;;) {
+        if (Drain() > 0) {
+            continue;
+        }
+        if (!bRunning.load()) {
+            break;
+        }
+        bSleeping.store(true);
+        // A producer might have pushed before it saw the sleeping flag, check again before going to sleep
+        if (Drain() > 0) {
+            bSleeping.store(false);
+            continue;
+        }
+        struct timeval now;
+        struct timespec until;
+        gettimeofday(&now, NULL);
+        long nsec = now.tv_usec * 1000L + ASYNC_WRITER_IDLE_WAIT_MS * 1000000L;
+        until.tv_sec = now.tv_sec + nsec / 1000000000L;
+        until.tv_nsec = nsec % 1000000000L;
+
+        pthread_mutex_lock(&lock);
+        if (bRunning.load()) {
+            pthread_cond_timedwait(&cond, &lock, &until);
+        }
+        pthread_mutex_unlock(&lock);
+        bSleeping.store(false);
+    }
+}
+
+//
+// Writes everything currently in the ring, returns number of records written
+// Records are taken in batches, headers are rendered in to the record buffers and each batch
+// is handed to the sinks in one call
+//
+int LogAsyncWriter::Drain() {
+    int nRecords = 0;
+    // Normally only the writer thread drains, but Stop and WaitDrained can do it from other threads
+    pthread_mutex_lock(&drainLock);
+    for (;;) {
+        int nBatch = 0;
+        while ((nBatch < ASYNC_WRITER_BATCH_SIZE) && queue.Pop(batch[nBatch])) {
+            nBatch++;
+        }
+        if (nBatch == 0) {
+            break;
+        }
+
+        int nOut = 0;
+        for (int i = 0; i < nBatch; i++) {
+            LogCapture &rec = batch[i];
+            try {
+                rec.pLogger->ResolveDeferred(rec);
+                RenderFields(rec);
+                if (rec.pLogger->pDedup.load(std::memory_order_relaxed) != NULL) {
+                    LogCapture repeated;
+                    uint64_t nRepeated;
+                    if (!rec.pLogger->Deduplicate(rec, &repeated, &nRepeated)) {
+                        continue;
+                    }
+                    if (nRepeated > 0) {
+                        // Keep the order, the records before the 'repeated' line go out first
+                        Logger::SendBatchToSinks(records, nOut);
+                        nOut = 0;
+                        rec.pLogger->WriteRepeated(repeated, nRepeated);
+                    }
+                }
+            } catch (...) {
+                continue;
+            }
+            try {
+                rec.pLogger->BuildRecord(rec, records[nOut]);
+            } catch (...) {
+                continue;
+            }
+            nOut++;
+        }
+        try {
+            Logger::SendBatchToSinks(records, nOut);
+        } catch (...) {
+        }
+        for (int i = 0; i < nBatch; i++) {
+            Logger::ReleaseBuffer(batch[i].pBuf);
+        }
+        nDispatched.fetch_add(nBatch, std::memory_order_release);
+        nRecords += nBatch;
+    }
+    pthread_mutex_unlock(&drainLock);
+    return nRecords;
+}
+
+void LogAsyncWriter::Wakeup() {
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+#endif
+
+// ---------------------------------------------------------------------------
+//
+// Housekeeping
+// File system work for the sinks (renames, deletes, preallocation) is done on one shared background thread.
+// Without thread support the jobs are run right away.
+//
+#ifdef LOGGER_HAVE_PTHREADS
+LogHousekeeper::LogHousekeeper() {
+    bBusy = false;
+    bThreadStarted = false;
+    timerIntervalMs = 0;
+    bTicking = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    pthread_cond_init(&idleCond, NULL);
+}
+
+// Never destroyed, the thread waits for work until the process exits
+LogHousekeeper &LogHousekeeper::Instance() {
+    static LogHousekeeper *pInstance = new LogHousekeeper();
+    return *pInstance;
+}
+
+// Lock must be held
+bool LogHousekeeper::StartThread() {
+    if (!bThreadStarted) {
+        if (pthread_create(&thread, NULL, LogHousekeeper::ThreadFunc, this) != 0) {
+            return false;
+        }
+        pthread_detach(thread);
+        bThreadStarted = true;
+    }
+    return true;
+}
+
+void LogHousekeeper::Post(const std::function<void()> &job) {
+    pthread_mutex_lock(&lock);
+    if (!StartThread()) {
+        // no thread, do it here
+        pthread_mutex_unlock(&lock);
+        job();
+        return;
+    }
+    jobs.push_back(job);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void LogHousekeeper::SetTimer(const std::function<void()> &tick, int intervalMs) {
+    pthread_mutex_lock(&lock);
+    bool bSelf = bThreadStarted && pthread_equal(pthread_self(), thread);
+    while (bTicking && !bSelf) {
+        pthread_cond_wait(&idleCond, &lock);
+    }
+    timer = tick;
+    timerIntervalMs = (intervalMs > 0) ? intervalMs : 1;
+    if (timer) {
+        StartThread();
+    }
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+//
+// Waits until all jobs posted so far are done
+//
+void LogHousekeeper::WaitIdle() {
+    pthread_mutex_lock(&lock);
+    if (!bThreadStarted || pthread_equal(pthread_self(), thread)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    while (bBusy || !jobs.empty()) {
+        pthread_cond_wait(&idleCond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void *LogHousekeeper::ThreadFunc(void *arg) {
+    LogHousekeeper *pKeeper = (LogHousekeeper *) arg;
+    pKeeper->Run();
+    return NULL;
+}
+
+// Absolute time 'ms' from now, for pthread_cond_timedwait
+static void DeadlineIn(struct timespec *ts, int ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long) (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
     }
-    GenerateIndentString();
+}
+
+void LogHousekeeper::Run() {
+    struct timespec tNextTick;
+    pthread_mutex_lock(&lock);
+    DeadlineIn(&tNextTick, timerIntervalMs);
+    for (;;) {
+        while (jobs.empty()) {
+            if (!timer) {
+                pthread_cond_wait(&cond, &lock);
+                DeadlineIn(&tNextTick, timerIntervalMs);
+                continue;
+            }
+            if (pthread_cond_timedwait(&cond, &lock, &tNextTick) == ETIMEDOUT) {
+                std::function<void()> tick = timer;
+                bTicking = true;
+                pthread_mutex_unlock(&lock);
+                try {
+                    tick();
+                } catch (...) {
+                }
+                pthread_mutex_lock(&lock);
+                bTicking = false;
+                pthread_cond_broadcast(&idleCond);
+                DeadlineIn(&tNextTick, timerIntervalMs);
+            }
+        }
+        std::function<void()> job = jobs.front();
+        jobs.pop_front();
+        bBusy = true;
+        pthread_mutex_unlock(&lock);
+        try {
+            job();
+        } catch (...) {
+        }
+        pthread_mutex_lock(&lock);
+        bBusy = false;
+        if (jobs.empty()) {
+            pthread_cond_broadcast(&idleCond);
+        }
+    }
+}
+#endif
+
+static void PostHousekeeping(const std::function<void()> &job) {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogHousekeeper::Instance().Post(job);
+#else
+    job();
+#endif
+}
+
+static void WaitHousekeeping() {
+#ifdef LOGGER_HAVE_PTHREADS
+    LogHousekeeper::Instance().WaitIdle();
+#endif
 }
 
 // ---------------------------------------------------------------------------
@@ -1032,19 +5393,158 @@ LoggerInstance::LoggerInstance(ILogger *pLogger) {
 MsgBuffer::MsgBuffer() {
     buffer = (char *) malloc(DEFAULT_BUFFER_SIZE);
     sz = DEFAULT_BUFFER_SIZE;
+    bGrown = false;
+    nRefs.store(1, std::memory_order_relaxed);
 }
 MsgBuffer::~MsgBuffer() {
     free(buffer);
 }
-void MsgBuffer::Extend() {
-    sz += DEFAULT_BUFFER_SIZE;
-    char *tmp = (char *) realloc(buffer, sz);
+// Grows the buffer by one block or to at least 'nMinSize' (rounded up to full blocks)
+void MsgBuffer::Extend(int nMinSize /* = 0 */) {
+    int newSize = sz + DEFAULT_BUFFER_SIZE;
+    if (nMinSize > newSize) {
+        newSize = ((nMinSize + DEFAULT_BUFFER_SIZE - 1) / DEFAULT_BUFFER_SIZE) * DEFAULT_BUFFER_SIZE;
+    }
+    char *tmp = (char *) realloc(buffer, newSize);
     if (tmp == NULL) {
         //exit(1);	// can't allocate memory, just leave..
-        tmp = buffer;
-        sz -= DEFAULT_BUFFER_SIZE;
+        return;
+    }
+    buffer = tmp;
+    sz = newSize;
+    bGrown = true;
+    LogThreadCounters::Inc(ThreadCounters().bufferGrows);
+}
+// Returns the buffer to the default size
+void MsgBuffer::Shrink() {
+    if (!IsExtended()) {
+        return;
+    }
+    char *tmp = (char *) realloc(buffer, DEFAULT_BUFFER_SIZE);
+    if (tmp == NULL) {
+        return;
     }
     buffer = tmp;
+    sz = DEFAULT_BUFFER_SIZE;
+}
+
+// ---------------------------------------------------------------------------
+//
+// Message writer, used by the type safe front-end to write directly in to a message buffer
+//
+LogMsgWriter::LogMsgWriter() {
+    pBuf = (MsgBuffer *) Logger::RequestBuffer();
+    data = pBuf->GetBuffer();
+    cap = (size_t) pBuf->GetSize();
+    len = 0;
+}
+
+LogMsgWriter::~LogMsgWriter() {
+    if (pBuf != NULL) {
+        Logger::ReleaseBuffer(pBuf);
+    }
+}
+
+// Makes room for at least 'n' more bytes, keeping space for a newline and terminator
+void LogMsgWriter::Grow(size_t n) {
+    while (len + n + 2 > cap) {
+        int szBefore = pBuf->GetSize();
+        pBuf->Extend((int) (len + n + 2));
+        if (pBuf->GetSize() == szBefore) {
+            // can't allocate memory, the record is dropped (see ILogger::write)
+            throw std::bad_alloc();
+        }
+        data = pBuf->GetBuffer();
+        cap = (size_t) pBuf->GetSize();
+    }
+}
+
+void LogMsgWriter::WriteDouble(double v) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%g", v);
+    if (n > 0) {
+        Write(tmp, (size_t) (n < (int) sizeof(tmp) ? n : (int) sizeof(tmp) - 1));
+    }
+}
+
+MsgBuffer *LogMsgWriter::Detach() {
+    if (len + 2 > cap) Grow(2);
+    data[len] = '\0';
+    MsgBuffer *pRes = pBuf;
+    pBuf = NULL;
+    return pRes;
+}
+
+// ---------------------------------------------------------------------------
+//
+// Per thread buffer cache
+// Size classes: default sized buffers are kept in the thread cache and the global pool. Extended buffers
+// are only kept in the thread cache, and only while the thread keeps producing long messages. A buffer
+// larger than MAX_RETAINED_BUFFER_SIZE, or one released after BUFFER_TRIM_AFTER releases without any growth,
+// is shrunk back to the default size. Buffers going to the global pool are always shrunk.
+//
+MsgBufferCache::MsgBufferCache() {
+    nBuffers = 0;
+    nReleasesSinceGrow = 0;
+}
+
+MsgBufferCache::~MsgBufferCache() {
+    // Thread is going away, hand our buffers over to someone else
+    while (nBuffers > 0) {
+        MsgBuffer *pBuf = buffers[--nBuffers];
+        pBuf->Shrink();
+        if (!GlobalPool().Push(pBuf)) {
+            LogThreadCounters::Inc(ThreadCounters().bufferFrees);
+            delete pBuf;
+        }
+    }
+}
+
+// Never destroyed, thread caches return buffers to it while the process is shutting down
+LogBoundedQueue<MsgBuffer *> &MsgBufferCache::GlobalPool() {
+    static LogBoundedQueue<MsgBuffer *> *pPool = new LogBoundedQueue<MsgBuffer *>(BUFFER_GLOBAL_POOL_SIZE);
+    return *pPool;
+}
+
+MsgBuffer *MsgBufferCache::Request() {
+    if (nBuffers > 0) {
+        MsgBuffer *pBuf = buffers[--nBuffers];
+        pBuf->ResetRefs();
+        return pBuf;
+    }
+    MsgBuffer *pBuf;
+    if (GlobalPool().Pop(pBuf)) {
+        pBuf->ResetRefs();
+        return pBuf;
+    }
+    LogThreadCounters::Inc(ThreadCounters().bufferAllocs);
+    return new MsgBuffer();
+}
+
+size_t MsgBufferCache::GlobalPoolSize() {
+    return GlobalPool().ApproxSize();
+}
+
+void MsgBufferCache::Release(MsgBuffer *pBuf) {
+    if (pBuf->HasGrown()) {
+        nReleasesSinceGrow = 0;
+        pBuf->ClearGrown();
+    } else {
+        nReleasesSinceGrow++;
+    }
+    if ((pBuf->GetSize() > MAX_RETAINED_BUFFER_SIZE) || (nReleasesSinceGrow > BUFFER_TRIM_AFTER)) {
+        pBuf->Shrink();
+    }
+
+    if (nBuffers < BUFFER_THREAD_CACHE_SIZE) {
+        buffers[nBuffers++] = pBuf;
+        return;
+    }
+    pBuf->Shrink();
+    if (!GlobalPool().Push(pBuf)) {
+        LogThreadCounters::Inc(ThreadCounters().bufferFrees);
+        delete pBuf;
+    }
 }
 // ---------------------------------------------------------------------------
 //
@@ -1060,6 +5560,7 @@ void LogProperties::SetDefaults() {
     this->nMaxBackupIndex = 10;
     this->nMaxLogfileSize = LOG_SZ_MB(10);
     this->autoPrefix = false; // Automatically split logger names like "Prefix::PostFix"
+    this->pLayout = NULL;
 }
 
 #define REPLACE_STR(__dst, __src)\
@@ -1069,6 +5570,12 @@ void LogProperties::SetDefaults() {
     }                        \
     __dst = strdup(__src);
 
+void LogProperties::SetDebugLevel(int newLevel) {
+    iDebugLevel = newLevel;
+    // The sink might be attached, let the logger recompute the early filter level
+    Logger::SinkLevelsChanged();
+}
+
 void LogProperties::SetName(const char *newName) {
     REPLACE_STR(this->name, newName);
 }
@@ -1081,6 +5588,12 @@ void LogProperties::SetClassName(const char *newName) {
     REPLACE_STR(this->className, newName);
 }
 
+void LogProperties::SetLayout(const char *pattern) {
+    pLayout = ((pattern != NULL) && (pattern[0] != '\0')) ? LogLayout::Get(pattern) : NULL;
+    // Sinks on the default header and sinks with a layout are written differently
+    Logger::SinkLevelsChanged();
+}
+
 // Called by the base class on 'SetValue' - use to update internal proper variables
 void LogProperties::OnValueChanged(const char *key, const char *value) {
     if (!strcmp(key, LOG_CONF_NAME)) {
@@ -1094,10 +5607,12 @@ void LogProperties::OnValueChanged(const char *key, const char *value) {
         SetMaxBackupIndex(atoi(value));
     } else if (!strcmp(key, LOG_CONF_MAXLOGSIZE)) {
         SetMaxLogfileSize(atoi(value));
-    } else if (!strcmp(key, LOG_CONF_LOGFILE)) {
+    } else if (!strcmp(key, LOG_CONF_LOGFILE) || !strcmp(key, LOG_CONF_FILE)) {
         SetLogfileName(value);
     } else if (!strcmp(key, LOG_CONF_CLASSNAME)) {
         SetClassName(value);
+    } else if (!strcmp(key, LOG_CONF_LAYOUT)) {
+        SetLayout(value);
     }
 }
 
@@ -1154,10 +5669,17 @@ LogPropertyReader::GetAllStartingWith(std::vector<std::pair<std::string, std::st
 }
 
 char *LogPropertyReader::GetValue(const char *key, char *dst, int nMax, const char *defValue) {
-    if (properties.find(key) != properties.end()) {
-        strncpy(dst, properties.find(key)->second.c_str(), nMax);
-    } else {
+    auto it = properties.find(key);
+    if (it != properties.end()) {
+        strncpy(dst, it->second.c_str(), nMax);
+    } else if (defValue != NULL) {
         strncpy(dst, defValue, nMax);
+    } else {
+        // Not found and no default
+        return NULL;
+    }
+    if (nMax > 0) {
+        dst[nMax - 1] = '\0';
     }
     return dst;
 }
@@ -7,20 +7,26 @@ Descr   :	Debug logger....
 --------------------------------------------------------------------------- 
 
  *** NOTE: This should be rewritten - it was started a very long time ago - and is completely outdated
-           It works 'fine' for your basic needs but can break quite hard if your try anything fancy (Add/Remove sinks for instance)
+           It works 'fine' for your basic needs, sinks can be added and removed while logging (see LogSinkSet)
 
 ---------------------------------------------------------------------------*/
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include <list>
 #include <queue>
+#include <deque>
 #include <map>
 #include <vector>
 #include <string>
 #include <memory>
 #include <utility>
+#include <atomic>
+#include <initializer_list>
 
 #ifdef WIN32
 #ifndef WIN32_LEAN_AND_MEAN
@@ -36,6 +42,11 @@ Descr   :	Debug logger....
 #ifndef __LOGGER_H__
 #define __LOGGER_H__
 
+// Compile time minimum level, see LOG_DEBUG and friends - statements below this level are removed
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL 0
+#endif
+
 
 using namespace std;
 
@@ -48,6 +59,124 @@ namespace gnilk
 #endif
 
 #define MAX_INDENT 256
+#define LOG_ASYNC_DEFAULT_CAPACITY 8192
+
+	class MsgBuffer;	// defined in logger_internal.h
+
+	// Writes a message straight in to a pooled message buffer, used by the type safe front-end (see LogFmt)
+	class LogMsgWriter
+	{
+	public:
+		LogMsgWriter();
+		virtual ~LogMsgWriter();
+
+		__inline void Write(char c) {
+			if (len + 1 >= cap) Grow(1);
+			data[len++] = c;
+		}
+		__inline void Write(const char *str, size_t n) {
+			if (len + n >= cap) Grow(n);
+			memcpy(&data[len], str, n);
+			len += n;
+		}
+		__inline void WriteUInt(unsigned long long v) {
+			char tmp[20];
+			int n = 0;
+			do {
+				tmp[n++] = (char)('0' + (v % 10));
+				v /= 10;
+			} while (v != 0);
+			if (len + n >= cap) Grow(n);
+			while (n > 0) data[len++] = tmp[--n];
+		}
+		__inline void WriteInt(long long v) {
+			if (v < 0) {
+				Write('-');
+				WriteUInt(0ULL - (unsigned long long)v);
+			} else {
+				WriteUInt((unsigned long long)v);
+			}
+		}
+		__inline void WriteHex(unsigned long long v) {
+			static const char digits[] = "0123456789abcdef";
+			char tmp[16];
+			int n = 0;
+			do {
+				tmp[n++] = digits[v & 15];
+				v >>= 4;
+			} while (v != 0);
+			if (len + n >= cap) Grow(n);
+			while (n > 0) data[len++] = tmp[--n];
+		}
+		void WriteDouble(double v);
+
+		// Terminates the string and hands over the buffer
+		MsgBuffer *Detach();
+	private:
+		void Grow(size_t n);
+	private:
+		MsgBuffer *pBuf;
+		char *data;
+		size_t cap;
+		size_t len;
+	};
+
+	// A typed key/value attached to a record, like: pLog->Info("request done", {{"status", 200}, {"path", path}})
+	// Nothing is copied here, strings (keys included) must live until the call returns
+	struct LogField
+	{
+		typedef enum
+		{
+			kInt,
+			kUInt,
+			kDouble,
+			kBool,
+			kString,
+		} Type;
+
+		const char *key;
+		Type type;
+		union
+		{
+			long long i;
+			unsigned long long u;
+			double d;
+			bool b;
+		} value;
+		const char *str;	// kString, not terminated - see strLen
+		size_t strLen;
+
+		LogField() : key(""), type(kInt), str(NULL), strLen(0) { value.i = 0; }
+		LogField(const char *k, int v) : key(k), type(kInt), str(NULL), strLen(0) { value.i = v; }
+		LogField(const char *k, long v) : key(k), type(kInt), str(NULL), strLen(0) { value.i = v; }
+		LogField(const char *k, long long v) : key(k), type(kInt), str(NULL), strLen(0) { value.i = v; }
+		LogField(const char *k, unsigned int v) : key(k), type(kUInt), str(NULL), strLen(0) { value.u = v; }
+		LogField(const char *k, unsigned long v) : key(k), type(kUInt), str(NULL), strLen(0) { value.u = v; }
+		LogField(const char *k, unsigned long long v) : key(k), type(kUInt), str(NULL), strLen(0) { value.u = v; }
+		LogField(const char *k, float v) : key(k), type(kDouble), str(NULL), strLen(0) { value.d = v; }
+		LogField(const char *k, double v) : key(k), type(kDouble), str(NULL), strLen(0) { value.d = v; }
+		LogField(const char *k, bool v) : key(k), type(kBool), str(NULL), strLen(0) { value.b = v; }
+		LogField(const char *k, const char *v) : key(k), type(kString), str(v != NULL ? v : "(null)"), strLen(strlen(str)) { value.i = 0; }
+		LogField(const char *k, const char *v, size_t len) : key(k), type(kString), str(v), strLen(len) { value.i = 0; }
+		LogField(const char *k, const std::string &v) : key(k), type(kString), str(v.c_str()), strLen(v.length()) { value.i = 0; }
+	};
+
+	// Reads the encoded fields of a record (LogRecord::fields), keys and strings point in to the record
+	class LogFieldReader
+	{
+	public:
+		LogFieldReader(const uint8_t *data, int len) : ptr(data), left((data != NULL) ? len : 0) {}
+		// False at the end (or if the data is malformed)
+		bool Next(LogField &field);
+
+		// Text form of a field, ' key=value' - strings are quoted when needed
+		static size_t MaxTextSize(const LogField &field);
+		static size_t Render(char *dst, const LogField &field);	// dst must hold MaxTextSize chars, not terminated
+	private:
+		const uint8_t *ptr;
+		int left;
+	};
+
 	// Main public interface - this is the one you will normally use
 	class ILogger
 	{
@@ -69,6 +198,29 @@ namespace gnilk
 		virtual void Info(const char *sFormat, ...) = 0;
 		virtual void Debug(const char *sFormat, ...) = 0;
 
+		// Type safe front-end, use '{}' as placeholder - like: pLog->debug("x={} y={}", x, y)
+		// The LOG_DEBUG/LOG_INFO/... macros also verify the placeholder count at compile time
+		template<typename... Args> void critical(const char *sFormat, const Args&... args);
+		template<typename... Args> void error(const char *sFormat, const Args&... args);
+		template<typename... Args> void warning(const char *sFormat, const Args&... args);
+		template<typename... Args> void info(const char *sFormat, const Args&... args);
+		template<typename... Args> void debug(const char *sFormat, const Args&... args);
+		template<typename... Args> void write(int iDbgLevel, const char *sFormat, const Args&... args);
+
+		// Structured records, the message is written as is and the fields are kept as typed values
+		// Sinks get them through ILogOutputSink::WriteFields, text sinks see them as 'key=value' after the message
+		void Critical(const char *sMessage, std::initializer_list<LogField> fields);
+		void Error(const char *sMessage, std::initializer_list<LogField> fields);
+		void Warning(const char *sMessage, std::initializer_list<LogField> fields);
+		void Info(const char *sMessage, std::initializer_list<LogField> fields);
+		void Debug(const char *sMessage, std::initializer_list<LogField> fields);
+		virtual void WriteFields(int iDbgLevel, const char *sMessage, const LogField *fields, int nFields) = 0;
+
+		// Takes an already formatted message, used by the type safe front-end
+		virtual void WriteFormatted(int iDbgLevel, LogMsgWriter &writer) = 0;
+		// Rate limits and sampling, checked before the message is formatted
+		virtual bool AcceptRecord(int iDbgLevel, const char *sFormat) = 0;
+
         virtual void Enter() = 0;
 		virtual void Leave() = 0;
 	};
@@ -91,6 +243,8 @@ namespace gnilk
 
 		virtual void OnValueChanged(const char *key, const char *value) = 0;
 	};
+	class LogLayout;	// defined in logger_internal.h
+
 	// Holds properties for the logger and/or sink
 	class LogProperties : public LogPropertyReader
 	{
@@ -99,7 +253,7 @@ namespace gnilk
 
 		__inline bool IsLevelEnabled(int iDbgLevel) { return ((iDbgLevel>=iDebugLevel)?true:false); }
 		__inline int GetDebugLevel() { return iDebugLevel; }
-		__inline void SetDebugLevel(int newLevel) { iDebugLevel = newLevel; }
+		void SetDebugLevel(int newLevel);	// Notifies the logger, see Logger::SinkLevelsChanged
 		__inline bool IsAutoPrefixEnabled() { return autoPrefix; }
 		__inline void AutoPrefixEnable(bool bEnable) { autoPrefix = bEnable; }
         __inline bool IsEnabledOnCreate() { return createEnabled; }
@@ -119,6 +273,10 @@ namespace gnilk
 		__inline int GetMaxBackupIndex() { return nMaxBackupIndex; };
 		__inline void SetMaxBackupIndex(const int nIndex) { nMaxBackupIndex = nIndex; }; 
 
+		// Header pattern of a sink, NULL - the default header
+		__inline LogLayout *GetLayout() { return pLayout; }
+		void SetLayout(const char *pattern);	// NULL or "" - back to the default header
+
 		// Event from reader
 		void OnValueChanged(const char *key, const char *value);
 	protected:
@@ -132,6 +290,7 @@ namespace gnilk
 		char *className;
 		bool autoPrefix;	// This enables splitting logger names like 'prefix::postfix' and print them differently
         bool createEnabled = true;
+		LogLayout *pLayout;
 	};
 
 	// Used to wrap up indentation when using exceptions
@@ -151,6 +310,66 @@ namespace gnilk
 #define SINK_WRITE_IO_ERROR -1
 #define SINK_WRITE_FILTERED 0
 
+	// A formatted record as handed to 'WriteRecord' and 'WriteBatch', header and message are kept apart
+	// Only valid during the call, a sink keeping it (like an async sink) takes a reference with Retain
+	struct LogRecord
+	{
+		int level;
+		char *hdr;			// may be NULL
+		int hdrLen;
+		char *string;
+		int len;
+		// What the header was built from, zero/NULL for records coming through 'WriteLine'
+		struct timespec ts;
+		uint32_t tid;
+		int indent;
+		ILogger *pLogger;
+		const char *threadName;	// see Logger::SetThreadName, NULL if not set
+		// Structured records, 'string' is the message with the fields rendered as ' key=value' after it
+		const uint8_t *fields;	// NULL if none, read with LogFieldReader
+		int fieldsLen;
+		int msgLen;				// length of the message in 'string', without the rendered fields
+		// Holds header, message and fields - NULL when they live elsewhere (like the stack of a 'WriteLine' caller)
+		MsgBuffer *pBuf;
+
+		// Returns a copy of the record which stays valid until it is released
+		// Normally just a reference on 'pBuf', records not held by a buffer (or with the header of a layout) are copied once
+		LogRecord Retain() const;
+		void Release();
+	};
+
+	// Statistics, see Logger::GetStats
+#define LOG_STATS_LEVELS 7				// NONE, DEBUG, INFO, WARN, ERROR, CRITICAL and anything else (CUSTOM)
+#define LOG_STATS_LATENCY_BUCKETS 32	// bucket n counts sink calls taking [2^n, 2^(n+1)) ns
+
+	struct LogSinkStats
+	{
+		std::string name;
+		uint64_t records;		// records handed to the sink at or above its level
+		uint64_t filtered;		// records handed to the sink below its level
+		uint64_t bytes;			// as returned by the sink
+		uint64_t ioErrors;		// calls returning SINK_WRITE_IO_ERROR
+		uint64_t calls;
+		uint64_t timeNs;		// total time in the sink, only with Logger::SetSinkTiming(true)
+		uint64_t latency[LOG_STATS_LATENCY_BUCKETS];
+	};
+
+	struct LogStats
+	{
+		uint64_t produced[LOG_STATS_LEVELS];	// records which passed the level checks, see Logger::StatsLevelIndex
+		uint64_t filteredEarly;		// calls rejected before anything was formatted
+		uint64_t filteredLate;		// formatted records rejected by a sink level, once per sink
+		uint64_t asyncDropped;
+		uint64_t bufferAllocs;		// MsgBuffer's allocated, the ones not in use are kept in the pools
+		uint64_t bufferFrees;
+		uint64_t bufferGrows;		// MsgBuffer::Extend calls
+		uint64_t bufferPoolSize;	// buffers in the global pool right now, the thread caches are not included
+		uint64_t rateLimited;		// records suppressed by a logger or call site rate limit
+		uint64_t sampledOut;		// DEBUG/INFO records dropped by sampling
+		uint64_t duplicates;		// records collapsed in to a 'repeated' line
+		std::vector<LogSinkStats> sinks;
+	};
+
 	class ILogOutputSink
 	{
 	public:
@@ -158,6 +377,25 @@ namespace gnilk
 		virtual const char *GetName() = 0;
 		virtual void Initialize(int argc, const char **argv) = 0;
 		virtual int WriteLine(int dbgLevel, char *hdr, char *string) = 0;
+		// Optional, one record with timestamp, level, logger and thread as data - the default hands header and text to 'WriteLine'
+		virtual int WriteRecord(const LogRecord &record) {
+			return WriteLine(record.level, record.hdr, record.string);
+		}
+		// Optional, writes several records in one go - returns number of bytes written or SINK_WRITE_IO_ERROR
+		virtual int WriteBatch(const LogRecord *records, int nRecords) {
+			int nTotal = 0;
+			for (int i = 0; i < nRecords; i++) {
+				int res = WriteRecord(records[i]);
+				if (res > 0) {
+					nTotal += res;
+				}
+			}
+			return nTotal;
+		}
+		// Optional, a record with fields - the default writes it like any other record (with the fields as text)
+		virtual int WriteFields(const LogRecord &record) {
+			return WriteBatch(&record, 1);
+		}
 		virtual void Flush() = 0;
 		virtual void Close() = 0;
 		virtual LogProperties *GetProperties() = 0;
@@ -210,11 +448,13 @@ namespace gnilk
 		void Open(const char *filename, bool bAppend);
 		long Size();
 		void ParseArgs(int argc, const char **argv);
+		int WriteBuffered(const LogRecord *records, int nRecords);
 	public:
 		LogFileSink();
 		virtual ~LogFileSink();
 		void Initialize(int argc, const char **argv) override;
 		int WriteLine(int dbgLevel, char *hdr, char *string) override;
+		int WriteBatch(const LogRecord *records, int nRecords) override;
 		void Close() override;
 		void Flush() override;
 
@@ -223,24 +463,197 @@ namespace gnilk
         bool autoflush = false;
 	};	
 
+	class LogMutex;		// defined in logger_internal.h
+
+	// Writes to '<file>.1.log', older files are '<file>.2.log' up to 'maxbackupindex'
+	// The next file is opened (and preallocated) ahead of time, rolling over only swaps the file on the writing
+	// thread - the renames and deletes are done by the housekeeping thread.
 	class LogRollingFileSink : public LogFileSink
 	{
 	private:
 		int nMaxBackupIndex;
 		long nBytesRollLimit;
 		long nBytes;
+		FILE *fNext;		// ready to take over, NULL while being prepared
+		bool bPreparing;	// housekeeping job for 'fNext' is pending
+		LogMutex *pLock;
 
 		char *GetFileName(char *dst, int idx);
+		char *GetNextFileName(char *dst);
 		void RollOver();
 		void CheckApplyRules();
+		void PrepareNext();
+		void ShiftBackups(FILE *fPrevious);
+		void ShiftFiles();
+		void RecoverNext();
 	public:
 		LogRollingFileSink();
 		virtual ~LogRollingFileSink();
 		void Initialize(int argc, const char **argv) override;
 		int WriteLine(int dbgLevel, char *hdr, char *string) override;
+		int WriteBatch(const LogRecord *records, int nRecords) override;
+		void Close() override;
+		void Flush() override;
+
+		static ILogOutputSink * LOG_CALLCONV CreateInstance();
+	};
+
+	// Rolls over per time period ('period' is minute, hour or day - UTC) and at 'maxlogsize' within a period
+	// Files are named '<file>.2026-10-18T13.log', '<file>.2026-10-18T13.1.log', ... and are never renamed,
+	// '<file>.current.log' is a symlink to the file being written (not on Windows). The sink keeps the last
+	// 'maxbackupindex' files, including those left by earlier runs, older ones are deleted on the housekeeping thread.
+	class LogTimeRollingFileSink : public LogFileSink
+	{
+	public:
+		typedef enum
+		{
+			kPeriodMinute,
+			kPeriodHour,
+			kPeriodDay,
+		} Period;
+	public:
+		LogTimeRollingFileSink();
+		virtual ~LogTimeRollingFileSink();
+		void Initialize(int argc, const char **argv) override;
+		int WriteLine(int dbgLevel, char *hdr, char *string) override;
+		int WriteBatch(const LogRecord *records, int nRecords) override;
+		void Close() override;
+		void Flush() override;
 
 		static ILogOutputSink * LOG_CALLCONV CreateInstance();
+	private:
+		char *GetFileName(char *dst, time_t tPeriod, int idx);
+		time_t PeriodStart(time_t t);
+		time_t PeriodEnd(time_t tStart);
+		void OpenFile(time_t tPeriod, int idx);
+		void CheckApplyRules();
+		void ScanFiles();
+	private:
+		Period period;
+		long nBytesRollLimit;
+		long nBytes;
+		int nMaxBackupIndex;
+		time_t tPeriodStart;
+		time_t tPeriodEnd;
+		int nPeriodIndex;
+		bool bClosed;
+		std::deque<std::string> files;		// on disk, oldest first
+		LogMutex *pLock;
 	};
+
+	// Writes compact binary records, see logger_internal.h for the format and 'logdecode' to read the files
+	// Logger names and prefixes are written once per file, records refer to them by id
+	class LogBinaryFileSink : public LogFileSink
+	{
+	public:
+		LogBinaryFileSink();
+		virtual ~LogBinaryFileSink();
+		void Initialize(int argc, const char **argv) override;
+		int WriteLine(int dbgLevel, char *hdr, char *string) override;
+		int WriteRecord(const LogRecord &record) override;
+		int WriteBatch(const LogRecord *records, int nRecords) override;
+		void Close() override;
+		void Flush() override;
+
+		static ILogOutputSink * LOG_CALLCONV CreateInstance();
+	private:
+		int EncodeRecord(const LogRecord &rec);
+		uint32_t LoggerId(ILogger *pLogger);
+	private:
+		std::map<ILogger *, uint32_t> loggerIds;
+		int64_t tPrevious;		// ns, timestamps are written as the difference to the previous record
+		LogMutex *pLock;
+	};
+
+#ifndef WIN32
+	// File sink with its own aligned write buffer, written with write(2) instead of stdio
+	// The buffer is written out when it holds 'flushbytes', when 'flushinterval' ms have passed since the last
+	// write-out or right away for records at 'flushlevel' and above. With 'sync' each write-out is followed by fdatasync.
+	// With LOGGER_HAVE_PTHREADS a timer thread writes out a quiet buffer, otherwise the interval is checked when
+	// records arrive and a quiet sink keeps its data until the next record, Flush or Close.
+	class LogDirectFileSink : public LogBaseSink
+	{
+	public:
+		LogDirectFileSink();
+		virtual ~LogDirectFileSink();
+		void Initialize(int argc, const char **argv) override;
+		int WriteLine(int dbgLevel, char *hdr, char *string) override;
+		int WriteBatch(const LogRecord *records, int nRecords) override;
+		void Close() override;
+		void Flush() override;
+
+		static ILogOutputSink * LOG_CALLCONV CreateInstance();
+	private:
+		void ParseArgs(int argc, const char **argv);
+		bool Append(const char *data, size_t len);
+		bool WriteOut();
+		bool ApplyFlushPolicy(int maxLevel);
+#ifdef LOGGER_HAVE_PTHREADS
+		void StartTimer();
+		void StopTimer();
+		static void *TimerFunc(void *arg);
+		void RunTimer();
+#endif
+	private:
+		int fd;
+		char *buffer;
+		size_t szBuffer;
+		size_t nBuffered;
+		size_t nFlushBytes;
+		int flushIntervalMs;
+		int flushLevel;
+		bool bSync;
+		bool bAppend;
+		uint64_t tLastWriteOut;		// ms, monotonic clock
+		LogMutex *pLock;
+#ifdef LOGGER_HAVE_PTHREADS
+		pthread_t timerThread;
+		pthread_mutex_t timerLock;
+		pthread_cond_t timerCond;
+		bool bTimerStarted;
+		bool bStopTimer;
+#endif
+	};
+
+	struct LogMMapSegment;	// defined in logger_internal.h
+
+	// Appends to a preallocated memory mapped segment, '<file>.<n>.log'. A record is written with an atomic
+	// reservation of its range and a memcpy, no syscall and no lock. When a segment is full the next one is
+	// created and the old one is truncated to what was written on the housekeeping thread. The kernel owns the
+	// dirty pages, a crashing process does not lose what it logged, the file keeps its zero filled tail in that case.
+	// Numbering continues after the segments found at start, the last 'maxbackupindex' segments are kept (0 keeps all).
+	class LogMMapFileSink : public LogBaseSink
+	{
+	public:
+		LogMMapFileSink();
+		virtual ~LogMMapFileSink();
+		void Initialize(int argc, const char **argv) override;
+		int WriteLine(int dbgLevel, char *hdr, char *string) override;
+		int WriteBatch(const LogRecord *records, int nRecords) override;
+		void Close() override;
+		void Flush() override;
+
+		static ILogOutputSink * LOG_CALLCONV CreateInstance();
+	private:
+		void ParseArgs(int argc, const char **argv);
+		void ScanSegments();
+		LogMMapSegment *OpenSegment(int idx);
+		LogMMapSegment *OpenNext(std::vector<std::string> &expired);
+		bool Rotate(LogMMapSegment *pFull);
+		void Retire(LogMMapSegment *pSeg);
+		LogMMapSegment *Pin();
+		char *Reserve(size_t len, LogMMapSegment **ppSeg);
+	private:
+		size_t szSegment;
+		int nextIndex;
+		int nMaxSegments;
+		bool bClosed;
+		std::deque<int> segments;		// indices on disk, oldest first
+		std::atomic<LogMMapSegment *> current;
+		std::vector<LogMMapSegment *> retired;
+		LogMutex *pLock;
+	};
+#endif
 	
 	class LoggerInstance
 	{
@@ -257,7 +670,13 @@ namespace gnilk
 	typedef std::list<LoggerInstance *> ILoggerList;
 	typedef std::list<std::unique_ptr<ILogOutputSink>>ILoggerSinkList;
 
-	class MsgBuffer;	// defined in logger_internal.h
+	class LogEvent;		// defined in logger_internal.h
+	class LogAsyncWriter;	// defined in logger_internal.h
+	struct LogLimits;		// defined in logger_internal.h
+	struct LogDedupState;	// defined in logger_internal.h
+	class LogCallSiteTable;	// defined in logger_internal.h
+	struct LogCapture;		// defined in logger_internal.h
+	class LogRegistry;		// defined in logger_internal.h
 
 	class Logger : public ILogger
 	{
@@ -278,6 +697,19 @@ namespace gnilk
 			kTFLog4Net,
 			kTFUnix,			
 		} TimeFormat;
+
+		typedef enum
+		{
+			kTCRealtime,
+			kTCRealtimeCoarse,	// Faster, resolution is the kernel tick (typically 1-4ms), falls back to realtime if not available
+		} TimeClock;
+
+		typedef enum
+		{
+			kTPMillis,
+			kTPMicros,
+			kTPNanos,
+		} TimePrecision;
 	public:
 	
 		virtual ~Logger();
@@ -288,6 +720,36 @@ namespace gnilk
 		static void AddSink(ILogOutputSink *pSink, const char *sName);
 		static void AddSink(ILogOutputSink *pSink, const char *sName, int argc, const char **argv);
         static bool RemoveSink(const char *sName);
+        static void Flush();
+
+        // Async mode, records are queued to a ring buffer and written to the sinks by a background thread
+        static bool EnableAsync(int nCapacity = LOG_ASYNC_DEFAULT_CAPACITY, bool bDropWhenFull = false);
+        static void DisableAsync();
+        static bool IsAsyncEnabled();
+        static uint64_t GetAsyncDropCount();
+
+        // Pipeline statistics, counters are kept per thread and summed up here
+        static LogStats GetStats();
+        // Time the calls to the sinks for LogSinkStats::latency, costs two clock reads per call
+        static void SetSinkTiming(bool bEnable);
+        static int StatsLevelIndex(int iDbgLevel);
+        // Counts a call rejected by the inline level checks
+        static void CountFilteredEarly();
+
+        // Records per second for the loggers with this name (NULL - default for all loggers), 0 - no limit
+        // burst 0 allows one second worth of records in one go
+        static void SetRateLimit(const char *name, double perSecond, int burst = 0);
+        // Keep one in n DEBUG and INFO records for the loggers with this name (NULL - all loggers), 1 keeps all
+        static void SetSampling(const char *name, int n);
+        // Records per second from each call site (format string) across all loggers, 0 - no limit
+        static void SetCallSiteRateLimit(double perSecond, int burst = 0);
+        // Seconds between the 'records suppressed' lines
+        static void SetSuppressionSummaryInterval(int seconds);
+        // Collapse a message repeated within 'windowMs' in to one 'last message repeated n times' line, 0 - off
+        // For the loggers with this name, NULL - default for all loggers
+        static void SetDeduplication(const char *name, int windowMs);
+        // Pack the printf arguments and let the async writer format them, the format string must outlive the record
+        static void SetDeferredFormatting(bool bEnable) { Logger::bDeferredFormatting = bEnable; }
 
 		// Refactor this to a LogManager
 		static void *RequestBuffer();
@@ -304,20 +766,39 @@ namespace gnilk
 
         static LogProperties *GetProperties() { return &Logger::properties; }
 
+        // True if a record at this level passes the compile time level, the global level and at least one sink
+        static __inline bool IsLevelAccepted(int iDbgLevel) {
+            return ((iDbgLevel >= LOGGER_MIN_LEVEL) && Logger::properties.IsLevelEnabled(iDbgLevel) &&
+                    (iDbgLevel >= Logger::iSinkMinLevel.load(std::memory_order_relaxed)));
+        }
+        // Recomputes the lowest level accepted by any sink and if the default header is used by any sink,
+        // called when sinks, their levels or their layouts change
+        static void SinkLevelsChanged();
+
+        static void SetTimeClock(TimeClock clock) { Logger::kTimeClock = clock; }
+        static void SetTimePrecision(TimePrecision precision) { Logger::kTimePrecision = precision; }
+        static TimePrecision GetTimePrecision() { return Logger::kTimePrecision; }
+        // Current time from the selected clock
+        static void GetTimestamp(struct timespec *ts);
+        // Name of the calling thread, '%t' in a sink layout shows it instead of the thread id (NULL - no name)
+        static void SetThreadName(const char *name);
+        static const char *GetThreadName();
+
         // Instance interface
     public:
 
-		__inline bool IsDebugEnabled() { return (isEnabled && Logger::properties.IsLevelEnabled((int)kMCDebug)?true:false);}
-		__inline bool IsInfoEnabled() { return (isEnabled && Logger::properties.IsLevelEnabled((int)kMCInfo)?true:false);}
-		__inline bool IsWarningEnabled() { return (isEnabled && Logger::properties.IsLevelEnabled((int)kMCWarning)?true:false);}
-		__inline bool IsErrorEnabled() { return (isEnabled && Logger::properties.IsLevelEnabled((int)kMCError)?true:false);}
-		__inline bool IsCriticalEnabled() { return (isEnabled && Logger::properties.IsLevelEnabled((int)kMCCritical)?true:false);}
+		__inline bool IsDebugEnabled() { return (isEnabled && IsLevelAccepted((int)kMCDebug)); }
+		__inline bool IsInfoEnabled() { return (isEnabled && IsLevelAccepted((int)kMCInfo)); }
+		__inline bool IsWarningEnabled() { return (isEnabled && IsLevelAccepted((int)kMCWarning)); }
+		__inline bool IsErrorEnabled() { return (isEnabled && IsLevelAccepted((int)kMCError)); }
+		__inline bool IsCriticalEnabled() { return (isEnabled && IsLevelAccepted((int)kMCCritical)); }
         __inline bool IsAutoPrefixEnabled() { return (isEnabled && Logger::properties.IsAutoPrefixEnabled()); }
 
 
         // properties
-		virtual int GetIndent() { return iIndentLevel; };
-		virtual int SetIndent(int nIndent) { iIndentLevel = nIndent; return iIndentLevel; };
+		// Indentation is per thread, each thread has its own indent for every logger
+		virtual int GetIndent();
+		virtual int SetIndent(int nIndent);
         virtual char *GetName() { return sName;};
         virtual char *GetPrefix() { return sPrefix;};
 		virtual bool IsEnabled()  { return isEnabled; };
@@ -331,6 +812,14 @@ namespace gnilk
 		virtual void Warning(const char *sFormat, ...);
 		virtual void Info(const char *sFormat, ...);
 		virtual void Debug(const char *sFormat, ...);
+		using ILogger::Critical;
+		using ILogger::Error;
+		using ILogger::Warning;
+		using ILogger::Info;
+		using ILogger::Debug;
+		virtual void WriteFields(int iDbgLevel, const char *sMessage, const LogField *fields, int nFields);
+		virtual void WriteFormatted(int iDbgLevel, LogMsgWriter &writer);
+		bool AcceptRecord(int iDbgLevel, const char *sFormat) override { return IsWithinLimits(iDbgLevel, sFormat); }
 
 
         // Enter leave functions, use to auto-indent flow statements, take care on exceptions!
@@ -342,40 +831,260 @@ namespace gnilk
         bool isEnabled;
         char *sName;
         char *sPrefix;
-        char *sIndent;
-        int iIndentLevel;
+        uint32_t iIndex;	// slot of this logger in the per thread indentation
+        char *sFragments;	// precomputed header pieces, [prefix block][padded name]
+        int nPrefixFragment;
+        int nNameFragment;
+        std::atomic<LogLimits *> pLimits;	// NULL - no rate limit or sampling
+        std::atomic<LogDedupState *> pDedup;	// NULL - duplicates are not suppressed
         Logger(const char *sName, const char *sPrefix);
-        void WriteReportString(int mc, gnilk::MsgBuffer *pBuf);
-        void GenerateIndentString();
+        __inline bool IsWithinLimits(int iDbgLevel, const char *sFormat) {
+            if ((pLimits.load(std::memory_order_relaxed) == NULL) && (callSites.load(std::memory_order_relaxed) == NULL)) {
+                return true;
+            }
+            return CheckLimits(iDbgLevel, sFormat);
+        }
+        bool CheckLimits(int iDbgLevel, const char *sFormat);
+        void ApplyLimits();
+        void WriteSuppressedSummary(int iDbgLevel, bool bForce);
+        void WriteUnlimited(int iDbgLevel, const char *sFormat, ...);
+        bool Deduplicate(const gnilk::LogCapture &rec, gnilk::LogCapture *pRepeated, uint64_t *pnRepeated);
+        void WriteRepeated(const gnilk::LogCapture &repeated, uint64_t nRepeated);
+        void FlushRepeated(bool bExpiredOnly = false);
+        void WriteReportString(int mc, gnilk::LogEvent &evt, bool bDeferred = false, int fieldsOfs = 0, int fieldsLen = 0);
+        void DispatchRecord(const gnilk::LogCapture &rec);
+        void BuildHeaderFragments();
+        int FormatHeader(const gnilk::LogCapture &rec, char *dst, int maxLen);
+        void BuildRecord(const gnilk::LogCapture &rec, gnilk::LogRecord &out);
+        void ResolveDeferred(gnilk::LogCapture &rec);
+        friend class LogAsyncWriter;
+        friend class LogLayout;
 
 	private:
-		static char *TimeString(int maxchar, char *dst);
-		static void SendToSinks(int dbgLevel, char *hdr, char *string);
+		static char *TimeString(int maxchar, char *dst, time_t tSec, long tNsec);
+		static void AsyncAtExit();
+		static bool IsDeferredFormattingActive();
+		static void SendToSinks(const LogRecord &record);
+		static void SendBatchToSinks(const LogRecord *records, int nRecords);
+		static void SendBatchWithLayouts(const LogRecord *records, int nRecords, bool bTiming);
 		static ILogOutputSink *CreateSink(const char *className);
 		static void RebuildSinksFromConfiguration();
-		static ILogger *GetLoggerFromName(const char *name);
-		static ILogger *GetLoggerFromNameWithPrefix(const char *name, const char *prefix);
+		static LogRegistry &Registry();
+		static void CopyLoggers(std::vector<Logger *> &dst);
+		static void SetEnabledByName(const char *name, bool bEnabled);
+		static void ApplyCallSiteRateLimit(double perSecond, int burst);
+		static void StartSummaryTimer();
+		static void StopSummaryTimer();
+		static void WriteDueSummaries();
+		static void WriteCallSiteSummaries(LogCallSiteTable *pSites, bool bForce);
 
 		// Create properties
     private:
         static TimeFormat kTimeFormat;
-        static bool bInitialized;
+        static TimeClock kTimeClock;
+        static TimePrecision kTimePrecision;
+        static bool bDeferredFormatting;
+        static std::atomic<bool> bInitialized;
         static int iIndentStep;
+        static std::atomic<uint32_t> iNextIndex;
         static ILoggerList loggers;
-        static ILoggerSinkList sinks;
         static LogProperties properties;
-        static std::queue<void *> buffers;
 		static std::map<std::string, bool> enabledLoggers;
-
-#ifdef WIN32
-        static CRITICAL_SECTION bufferLock;
-#endif
-#ifdef LOGGER_HAVE_PTHREADS
-        static pthread_mutex_t bufferLock;
-#endif
+		static std::atomic<LogAsyncWriter *> asyncWriter;
+		static std::atomic<int> iSinkMinLevel;
+		static std::atomic<bool> bDefaultHeader;	// some sink uses the default header
+		static std::atomic<bool> bSinkTiming;
+		static std::atomic<LogCallSiteTable *> callSites;	// NULL while no call site limit is active
+		static LogCallSiteTable *pCallSiteTable;			// kept once created, registry lock
+		static bool bSummaryTimer;
+		static std::atomic<int64_t> tSummaryInterval;
 
 	};
 	
+	//
+	// Type safe formatting, one instance of 'Format' is generated per combination of argument types.
+	// Arguments are written straight in to the message buffer without going through printf.
+	//
+	template<int N> struct LogFmtArgCount { static const int value = N; };
+
+	class LogFmt
+	{
+	public:
+		// Number of '{}' in the format, '{{' and '}}' are escaped braces, -1 if the format is malformed
+		// NOTE: evaluated recursively, compilers limit the depth to ~512 characters
+		static constexpr int CountPlaceholders(const char *s, int n = 0) {
+			return (*s == '\0') ? n :
+				((s[0] == '{') && (s[1] == '{')) ? CountPlaceholders(s + 2, n) :
+				((s[0] == '}') && (s[1] == '}')) ? CountPlaceholders(s + 2, n) :
+				((s[0] == '{') && (s[1] == '}')) ? CountPlaceholders(s + 2, n + 1) :
+				((s[0] == '{') || (s[0] == '}')) ? -1 :
+				CountPlaceholders(s + 1, n);
+		}
+		// Only used in unevaluated context, gives the number of arguments
+		template<typename... Args> static LogFmtArgCount<sizeof...(Args)> CountArgs(const Args&...);
+
+		static void Format(LogMsgWriter &w, const char *sFormat) {
+			// Rest of the format, placeholders without arguments are written as is
+			while (sFormat != NULL) {
+				sFormat = WriteUntilPlaceholder(w, sFormat);
+				if (sFormat != NULL) w.Write("{}", 2);
+			}
+		}
+		template<typename T, typename... Rest>
+		static void Format(LogMsgWriter &w, const char *sFormat, const T &value, const Rest&... rest) {
+			sFormat = WriteUntilPlaceholder(w, sFormat);
+			// More arguments than placeholders, the rest are ignored
+			if (sFormat == NULL) return;
+			WriteArg(w, value);
+			Format(w, sFormat, rest...);
+		}
+
+		static void WriteArg(LogMsgWriter &w, bool v) { if (v) w.Write("true", 4); else w.Write("false", 5); }
+		static void WriteArg(LogMsgWriter &w, char v) { w.Write(v); }
+		static void WriteArg(LogMsgWriter &w, signed char v) { w.WriteInt(v); }
+		static void WriteArg(LogMsgWriter &w, unsigned char v) { w.WriteUInt(v); }
+		static void WriteArg(LogMsgWriter &w, short v) { w.WriteInt(v); }
+		static void WriteArg(LogMsgWriter &w, unsigned short v) { w.WriteUInt(v); }
+		static void WriteArg(LogMsgWriter &w, int v) { w.WriteInt(v); }
+		static void WriteArg(LogMsgWriter &w, unsigned int v) { w.WriteUInt(v); }
+		static void WriteArg(LogMsgWriter &w, long v) { w.WriteInt(v); }
+		static void WriteArg(LogMsgWriter &w, unsigned long v) { w.WriteUInt(v); }
+		static void WriteArg(LogMsgWriter &w, long long v) { w.WriteInt(v); }
+		static void WriteArg(LogMsgWriter &w, unsigned long long v) { w.WriteUInt(v); }
+		static void WriteArg(LogMsgWriter &w, float v) { w.WriteDouble(v); }
+		static void WriteArg(LogMsgWriter &w, double v) { w.WriteDouble(v); }
+		static void WriteArg(LogMsgWriter &w, const char *v) {
+			if (v == NULL) v = "(null)";
+			w.Write(v, strlen(v));
+		}
+		static void WriteArg(LogMsgWriter &w, char *v) { WriteArg(w, (const char *)v); }
+		template<size_t N> static void WriteArg(LogMsgWriter &w, const char (&v)[N]) { WriteArg(w, (const char *)v); }
+		static void WriteArg(LogMsgWriter &w, const std::string &v) { w.Write(v.c_str(), v.length()); }
+		static void WriteArg(LogMsgWriter &w, std::nullptr_t) { w.Write("(null)", 6); }
+		template<typename T> static void WriteArg(LogMsgWriter &w, T *v) {
+			w.Write("0x", 2);
+			w.WriteHex((unsigned long long)(uintptr_t)v);
+		}
+	private:
+		// Copies literal text up to the next placeholder, returns the position after it or NULL at the end
+		static const char *WriteUntilPlaceholder(LogMsgWriter &w, const char *s) {
+			const char *lit = s;
+			for (;;) {
+				char c = *s;
+				if (c == '\0') {
+					w.Write(lit, (size_t)(s - lit));
+					return NULL;
+				}
+				if ((c == '{') || (c == '}')) {
+					w.Write(lit, (size_t)(s - lit));
+					if ((c == '{') && (s[1] == '}')) {
+						return s + 2;
+					}
+					// escaped (or stray) brace
+					w.Write(c);
+					s += ((s[1] == c) ? 2 : 1);
+					lit = s;
+					continue;
+				}
+				s++;
+			}
+		}
+	};
+
+	template<typename... Args> void ILogger::write(int iDbgLevel, const char *sFormat, const Args&... args) {
+		try {
+			LogMsgWriter writer;
+			LogFmt::Format(writer, sFormat, args...);
+			WriteFormatted(iDbgLevel, writer);
+		} catch (...) {
+		}
+	}
+	// The levels are checked inline, no virtual call or formatting if disabled
+#define LOG_FMT_LEVEL_FUNC(__name, __level) \
+	template<typename... Args> void ILogger::__name(const char *sFormat, const Args&... args) { \
+		if (!Logger::IsLevelAccepted(__level)) { Logger::CountFilteredEarly(); return; } \
+		if (!AcceptRecord(__level, sFormat)) return; \
+		write(__level, sFormat, args...); \
+	}
+	LOG_FMT_LEVEL_FUNC(critical, Logger::kMCCritical)
+	LOG_FMT_LEVEL_FUNC(error, Logger::kMCError)
+	LOG_FMT_LEVEL_FUNC(warning, Logger::kMCWarning)
+	LOG_FMT_LEVEL_FUNC(info, Logger::kMCInfo)
+	LOG_FMT_LEVEL_FUNC(debug, Logger::kMCDebug)
+#undef LOG_FMT_LEVEL_FUNC
+
+#define LOG_FIELDS_LEVEL_FUNC(__name, __level) \
+	inline void ILogger::__name(const char *sMessage, std::initializer_list<LogField> fields) { \
+		if (!Logger::IsLevelAccepted(__level)) { Logger::CountFilteredEarly(); return; } \
+		if (!AcceptRecord(__level, sMessage)) return; \
+		WriteFields(__level, sMessage, fields.begin(), (int)fields.size()); \
+	}
+	LOG_FIELDS_LEVEL_FUNC(Critical, Logger::kMCCritical)
+	LOG_FIELDS_LEVEL_FUNC(Error, Logger::kMCError)
+	LOG_FIELDS_LEVEL_FUNC(Warning, Logger::kMCWarning)
+	LOG_FIELDS_LEVEL_FUNC(Info, Logger::kMCInfo)
+	LOG_FIELDS_LEVEL_FUNC(Debug, Logger::kMCDebug)
+#undef LOG_FIELDS_LEVEL_FUNC
 }
 
+//
+// Type safe logging macros with compile time verification of the format, like:
+//   LOG_DEBUG(pLog, "x={} y={}", x, y);
+// Fails to compile if the number of '{}' doesn't match the number of arguments.
+//
+#define LOG_FMT_EXPAND(x) x
+#define LOG_FMT_FIRST_(first, ...) first
+#define LOG_FMT_FIRST(...) LOG_FMT_EXPAND(LOG_FMT_FIRST_(__VA_ARGS__, 0))
+#define LOG_FMT_CHECK(...) \
+	static_assert(gnilk::LogFmt::CountPlaceholders(LOG_FMT_FIRST(__VA_ARGS__)) == \
+		decltype(gnilk::LogFmt::CountArgs(__VA_ARGS__))::value - 1, \
+		"log format: number of '{}' placeholders does not match the number of arguments")
+
+//
+// Statements below LOGGER_MIN_LEVEL compile to nothing, neither the arguments nor the format string end up
+// in the binary. The format is still checked. The LOG_xxxF variants take printf style formats.
+//
+#define LOG_FMT_STRIPPED(...) do { LOG_FMT_CHECK(__VA_ARGS__); } while(0)
+#define LOG_PRINTF_STRIPPED(...) do { } while(0)
+
+#if LOGGER_MIN_LEVEL > 500
+#define LOG_CRITICAL(logger, ...) LOG_FMT_STRIPPED(__VA_ARGS__)
+#define LOG_CRITICALF(logger, ...) LOG_PRINTF_STRIPPED(__VA_ARGS__)
+#else
+#define LOG_CRITICAL(logger, ...) do { LOG_FMT_CHECK(__VA_ARGS__); (logger)->critical(__VA_ARGS__); } while(0)
+#define LOG_CRITICALF(logger, ...) do { (logger)->Critical(__VA_ARGS__); } while(0)
+#endif
+
+#if LOGGER_MIN_LEVEL > 400
+#define LOG_ERROR(logger, ...) LOG_FMT_STRIPPED(__VA_ARGS__)
+#define LOG_ERRORF(logger, ...) LOG_PRINTF_STRIPPED(__VA_ARGS__)
+#else
+#define LOG_ERROR(logger, ...) do { LOG_FMT_CHECK(__VA_ARGS__); (logger)->error(__VA_ARGS__); } while(0)
+#define LOG_ERRORF(logger, ...) do { (logger)->Error(__VA_ARGS__); } while(0)
+#endif
+
+#if LOGGER_MIN_LEVEL > 300
+#define LOG_WARNING(logger, ...) LOG_FMT_STRIPPED(__VA_ARGS__)
+#define LOG_WARNINGF(logger, ...) LOG_PRINTF_STRIPPED(__VA_ARGS__)
+#else
+#define LOG_WARNING(logger, ...) do { LOG_FMT_CHECK(__VA_ARGS__); (logger)->warning(__VA_ARGS__); } while(0)
+#define LOG_WARNINGF(logger, ...) do { (logger)->Warning(__VA_ARGS__); } while(0)
+#endif
+
+#if LOGGER_MIN_LEVEL > 200
+#define LOG_INFO(logger, ...) LOG_FMT_STRIPPED(__VA_ARGS__)
+#define LOG_INFOF(logger, ...) LOG_PRINTF_STRIPPED(__VA_ARGS__)
+#else
+#define LOG_INFO(logger, ...) do { LOG_FMT_CHECK(__VA_ARGS__); (logger)->info(__VA_ARGS__); } while(0)
+#define LOG_INFOF(logger, ...) do { (logger)->Info(__VA_ARGS__); } while(0)
+#endif
+
+#if LOGGER_MIN_LEVEL > 100
+#define LOG_DEBUG(logger, ...) LOG_FMT_STRIPPED(__VA_ARGS__)
+#define LOG_DEBUGF(logger, ...) LOG_PRINTF_STRIPPED(__VA_ARGS__)
+#else
+#define LOG_DEBUG(logger, ...) do { LOG_FMT_CHECK(__VA_ARGS__); (logger)->debug(__VA_ARGS__); } while(0)
+#define LOG_DEBUGF(logger, ...) do { (logger)->Debug(__VA_ARGS__); } while(0)
+#endif
+
 #endif
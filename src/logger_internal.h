@@ -16,11 +16,15 @@ Changes:
 ---------------------------------------------------------------------------*/
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include <list>
 #include <queue>
 #include <map>
 #include <string>
+#include <deque>
+#include <functional>
+#include <atomic>
 
 #ifndef __LOGGER_INTERNAL_H__
 #define __LOGGER_INTERNAL_H__
@@ -31,12 +35,39 @@ using namespace std;
 
 namespace gnilk
 {
+	#define DEFAULT_BUFFER_SIZE 4096
+	#define MAX_RETAINED_BUFFER_SIZE (64 * 1024)	// Extended buffers above this are shrunk when released
+	#define BUFFER_TRIM_AFTER 256					// Releases without growth before extended buffers are shrunk
+	#define BUFFER_THREAD_CACHE_SIZE 8
+	#define BUFFER_GLOBAL_POOL_SIZE 256
+
 	#define LOG_CONF_LOGFILE ("/sd/debug")
 	#define LOG_CONF_MAXLOGSIZE ("maxlogsize")
 	#define LOG_CONF_MAXBACKUPINDEX ("maxbackupindex")
 	#define LOG_CONF_DEBUGLEVEL ("debuglevel")
 	#define LOG_CONF_NAME ("name")
 	#define LOG_CONF_CLASSNAME ("class")
+	#define LOG_CONF_BUFFERSIZE ("buffersize")
+	#define LOG_CONF_FLUSHBYTES ("flushbytes")
+	#define LOG_CONF_FLUSHINTERVAL ("flushinterval")
+	#define LOG_CONF_FLUSHLEVEL ("flushlevel")
+	#define LOG_CONF_SYNC ("sync")
+	#define LOG_CONF_APPEND ("append")
+	#define LOG_CONF_SEGMENTSIZE ("segmentsize")
+	#define LOG_CONF_FILE ("file")					// alias for LOG_CONF_LOGFILE
+	#define LOG_CONF_PERIOD ("period")
+	#define LOG_CONF_RATELIMIT ("ratelimit")					// records per second, 'ratelimit.<logger name>' for one logger
+	#define LOG_CONF_RATELIMITBURST ("ratelimitburst")
+	#define LOG_CONF_SAMPLING ("sampling")						// keep one in n DEBUG/INFO records
+	#define LOG_CONF_CALLSITERATELIMIT ("callsiteratelimit")	// records per second per format string
+	#define LOG_CONF_CALLSITERATELIMITBURST ("callsiteratelimitburst")
+	#define LOG_CONF_SUPPRESSIONSUMMARY ("suppressionsummary")	// seconds between 'records suppressed' lines
+	#define LOG_CONF_DEDUP ("dedup")							// ms, collapse repeated messages within the window
+	#define LOG_CONF_LAYOUT ("layout")							// sink header pattern, see LogLayout
+	#define LOG_DEFAULT_SUPPRESSION_SUMMARY 10
+	#define LOG_CALLSITE_SLOTS 1024
+	#define LOG_CALLSITE_MAX_PROBE 16
+	#define LOG_SUMMARY_TICK_MS 100		// how often the housekeeping thread looks for summaries and 'repeated' lines due
 
 	extern "C"
 	{
@@ -51,20 +82,81 @@ namespace gnilk
 	} LOG_SINK_FACTORY;
 
 
+	//
+	// Binary log format, written by LogBinaryFileSink and read by logdecode
+	//   file   : magic "GNLKBLG1", flags (u8, LOG_BIN_FLAG_xxx), time precision (u8, Logger::TimePrecision)
+	//   record : varint length, tag (u8), body - the length covers tag and body, unknown tags can be skipped
+	//   LOG_BIN_TAG_LOGGER : varint id, varint name length, name, varint prefix length + 1 (0 - no prefix), prefix
+	//   LOG_BIN_TAG_RECORD : zigzag varint ns since the previous record (the first one since the epoch),
+	//                        varint level, varint logger id (0 - none), varint thread id, varint indent,
+	//                        message (rest of the record, without the trailing newline)
+	//   LOG_BIN_TAG_FIELDS : as LOG_BIN_TAG_RECORD up to the indent, varint message length, message,
+	//                        encoded fields (rest of the record)
+	// Varints are unsigned LEB128
+	//
+	// Field encoding, the same in the message buffer and in the binary files
+	//   key (zero terminated), type (u8, LogField::Type), value
+	//   kInt : zigzag varint, kUInt : varint, kDouble : 8 bytes IEEE 754 little endian, kBool : u8,
+	//   kString : varint length, chars
+	//
+	#define LOG_BIN_MAGIC "GNLKBLG1"
+	#define LOG_BIN_MAGIC_LEN 8
+	#define LOG_BIN_FILE_HEADER_LEN (LOG_BIN_MAGIC_LEN + 2)
+	#define LOG_BIN_FLAG_AUTOPREFIX 0x01
+	#define LOG_BIN_TAG_LOGGER 1
+	#define LOG_BIN_TAG_RECORD 2
+	#define LOG_BIN_TAG_FIELDS 3
+	#define LOG_BIN_MAX_VARINT 10
+
+	static __inline int LogPutVarint(uint8_t *dst, uint64_t v) {
+		int n = 0;
+		while (v >= 0x80) {
+			dst[n++] = (uint8_t)(v | 0x80);
+			v >>= 7;
+		}
+		dst[n++] = (uint8_t)v;
+		return n;
+	}
+	// Returns number of bytes used, 0 if the varint is truncated or too long
+	static __inline int LogGetVarint(const uint8_t *src, size_t len, uint64_t *v) {
+		uint64_t res = 0;
+		for (int n = 0; (n < LOG_BIN_MAX_VARINT) && ((size_t)n < len); n++) {
+			res |= (uint64_t)(src[n] & 0x7f) << (7 * n);
+			if (!(src[n] & 0x80)) {
+				*v = res;
+				return n + 1;
+			}
+		}
+		return 0;
+	}
+	static __inline uint64_t LogZigZag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+	static __inline int64_t LogUnZigZag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
 	// Internal class, not available to outside..
 	class MsgBuffer
 	{
 	private:
 		char *buffer;
 		int sz;
+		bool bGrown;	// Extended since last handed out
+		std::atomic<int> nRefs;	// owner plus retained records, see LogRecord::Retain
 	public:
 		MsgBuffer();
 		virtual ~MsgBuffer();
 		
 		__inline char *GetBuffer() { return buffer; }
 		__inline int GetSize() { return sz; }
+		__inline bool IsExtended() { return (sz > DEFAULT_BUFFER_SIZE); }
+		__inline bool HasGrown() { return bGrown; }
+		__inline void ClearGrown() { bGrown = false; }
+		__inline void ResetRefs() { nRefs.store(1, std::memory_order_relaxed); }
+		__inline void AddRef() { nRefs.fetch_add(1, std::memory_order_relaxed); }
+		// True when the last reference is gone
+		__inline bool Unref() { return (nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1); }
+		__inline bool Contains(const char *ptr) { return ((ptr >= buffer) && (ptr < buffer + sz)); }
 		
-		void Extend();
+		void Extend(int nMinSize = 0);
+		void Shrink();
 	};
 
 	class LogEvent
@@ -75,13 +167,572 @@ namespace gnilk
 		LogEvent() {
 			pBuffer = (MsgBuffer *)Logger::RequestBuffer();
 		}
+		// Takes ownership of an already filled buffer
+		LogEvent(MsgBuffer *pBuf) {
+			pBuffer = pBuf;
+		}
 		virtual ~LogEvent() {
-			Logger::ReleaseBuffer(pBuffer);
+			if (pBuffer != NULL) {
+				Logger::ReleaseBuffer(pBuffer);
+			}
 		}
 		__inline MsgBuffer *GetBuffer() {
 			return pBuffer;
 		}
+		// Hand over ownership of the buffer, used when the record is queued for the async writer
+		__inline MsgBuffer *Detach() {
+			MsgBuffer *pRes = pBuffer;
+			pBuffer = NULL;
+			return pRes;
+		}
+	};
+
+	// Everything needed to build the header and send a record to the sinks at a later point
+	// The timestamp, thread and indent are captured on the calling thread
+	struct LogCapture
+	{
+		int level;
+		Logger *pLogger;
+		struct timespec ts;
+		uint32_t tid;
+		const char *threadName;
+		int indent;
+		bool deferred;	// pBuf holds packed arguments, see PackArguments
+		MsgBuffer *pBuf;
+		// Structured records: [message][0][encoded fields][message with the fields rendered as text]
+		// The default header goes last when the record is sent, see Logger::BuildRecord
+		int fieldsOfs;
+		int fieldsLen;	// 0 - no fields
+		int textOfs;	// where the rendered text starts, see RenderFields
+
+		__inline char *GetText() const { return pBuf->GetBuffer() + textOfs; }
+	};
+
+	#define LOG_RECORD_HEADER_SIZE (MAX_INDENT + 128)	// room kept for the default header in the record buffer
+	#define LOG_LAYOUT_HEADER_SIZE (MAX_INDENT + 256)
+	#define LOG_LAYOUT_BATCH_SIZE 16	// records rendered per round, the headers are on the stack
+
+	//
+	// Header pattern for a sink, log4net style - like "%d [%t] %-5p %c - %m%n"
+	//   %d date, %t thread, %p level, %c logger, %x prefix, %i indentation, %% percent
+	//   (or %date, %thread, %level, %logger, %prefix, %indent)
+	//   %[-][min][.max]X pads to 'min' (left aligned with '-') and keeps the last 'max' chars
+	// Everything up to %m is the header, the message follows as is (with the newline if LOGGER_HAVE_NEWLINE)
+	// so %m and %n can only come last. Without %m the whole pattern is the header.
+	// Patterns are compiled in to a list of ops once, the same pattern gives the same instance.
+	//
+	class LogLayout
+	{
+	public:
+		typedef enum
+		{
+			kOpLiteral,
+			kOpDate,
+			kOpThread,
+			kOpLevel,
+			kOpLogger,
+			kOpPrefix,
+			kOpIndent,
+		} OpType;
+
+		struct Op
+		{
+			OpType type;
+			int minWidth;
+			int maxWidth;		// 0 - no limit
+			bool bLeftAlign;
+			int textOfs;		// kOpLiteral, in 'literals'
+			int textLen;
+		};
+	public:
+		// Never freed, the sinks and the writer thread can hold on to it
+		static LogLayout *Get(const char *pattern);
+
+		// Renders the header for a record, returns the length (the header is always terminated)
+		int Render(const LogRecord &rec, char *dst, int maxLen) const;
+		__inline const char *GetPattern() const { return pattern.c_str(); }
+	private:
+		LogLayout(const char *pattern);
+		void Compile();
+		void AddLiteral(const char *str, int len);
+	private:
+		std::string pattern;
+		std::string literals;
+		std::vector<Op> ops;
+	};
+
+	// Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's design)
+	// Each cell carries a sequence number telling producers and consumers whose turn it is,
+	// the only shared writes are one CAS on the enqueue (or dequeue) position.
+	template<typename T>
+	class LogBoundedQueue
+	{
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			T data;
+		};
+	public:
+		LogBoundedQueue(size_t nCapacity) {
+			// capacity must be a power of two
+			size_t sz = 2;
+			while (sz < nCapacity) sz <<= 1;
+			cells = new Cell[sz];
+			mask = sz - 1;
+			for (size_t i = 0; i < sz; i++) {
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+			enqueuePos.store(0, std::memory_order_relaxed);
+			dequeuePos.store(0, std::memory_order_relaxed);
+		}
+		virtual ~LogBoundedQueue() {
+			delete[] cells;
+		}
+
+		__inline size_t Capacity() { return mask + 1; }
+		__inline size_t EnqueueCount() { return enqueuePos.load(std::memory_order_acquire); }
+		// Snapshot, may be off while pushes and pops are in flight
+		__inline size_t ApproxSize() {
+			size_t nDequeued = dequeuePos.load(std::memory_order_relaxed);
+			size_t nEnqueued = enqueuePos.load(std::memory_order_relaxed);
+			return (nEnqueued > nDequeued) ? (nEnqueued - nDequeued) : 0;
+		}
+
+		// Returns false if the queue is full
+		bool Push(const T &item) {
+			Cell *cell;
+			size_t pos = enqueuePos.load(std::memory_order_relaxed);
+			for (;;) {
+				cell = &cells[pos & mask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+				if (dif == 0) {
+					if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (dif < 0) {
+					return false;
+				} else {
+					pos = enqueuePos.load(std::memory_order_relaxed);
+				}
+			}
+			cell->data = item;
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Returns false if the queue is empty
+		bool Pop(T &item) {
+			Cell *cell;
+			size_t pos = dequeuePos.load(std::memory_order_relaxed);
+			for (;;) {
+				cell = &cells[pos & mask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+				if (dif == 0) {
+					if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (dif < 0) {
+					return false;
+				} else {
+					pos = dequeuePos.load(std::memory_order_relaxed);
+				}
+			}
+			item = cell->data;
+			cell->sequence.store(pos + mask + 1, std::memory_order_release);
+			return true;
+		}
+	private:
+		Cell *cells;
+		size_t mask;
+		// keep the producer and consumer positions on separate cache lines
+		char pad0[64];
+		std::atomic<size_t> enqueuePos;
+		char pad1[64];
+		std::atomic<size_t> dequeuePos;
+		char pad2[64];
+	};
+
+	// Per thread cache of message buffers
+	// Buffers move between threads (e.g. from producers to the async writer), a thread with a full cache
+	// hands buffers to the global pool and a thread with an empty cache takes from it. Neither path takes a lock.
+	class MsgBufferCache
+	{
+	public:
+		MsgBufferCache();
+		virtual ~MsgBufferCache();
+
+		MsgBuffer *Request();
+		void Release(MsgBuffer *pBuf);
+		static size_t GlobalPoolSize();
+	private:
+		static LogBoundedQueue<MsgBuffer *> &GlobalPool();
+	private:
+		MsgBuffer *buffers[BUFFER_THREAD_CACHE_SIZE];
+		int nBuffers;
+		int nReleasesSinceGrow;
+	};
+
+#ifndef WIN32
+	// One mapped segment of the LogMMapFileSink
+	// Writers pin the segment (nWriters) while they copy, the range is claimed with an atomic add on 'offset'.
+	// Successful claims are contiguous from the start so 'nCommitted' is also the end of the written data.
+	struct LogMMapSegment
+	{
+		int fd;
+		char *base;
+		size_t size;
+		std::atomic<size_t> offset;
+		std::atomic<size_t> nCommitted;
+		std::atomic<int> nWriters;
+	};
+#endif
+
+	// Plain mutex for the slow paths, a no-op when built without thread support
+	class LogMutex
+	{
+	public:
+		LogMutex();
+		virtual ~LogMutex();
+
+		void Lock();
+		void Unlock();
+	private:
+#ifdef WIN32
+		CRITICAL_SECTION cs;
+#elif defined(LOGGER_HAVE_PTHREADS)
+		pthread_mutex_t mutex;
+#endif
+	};
+
+	// Holds the lock for the scope
+	class LogMutexLock
+	{
+	public:
+		LogMutexLock(LogMutex *_pMutex) : pMutex(_pMutex) { pMutex->Lock(); }
+		virtual ~LogMutexLock() { pMutex->Unlock(); }
+	private:
+		LogMutex *pMutex;
+	};
+
+	#define LOG_STATS_MAX_SINKS 16		// sinks counted at the same time, sinks added beyond that are not counted
+
+	// Counters of one sink in one thread, a part of LogThreadCounters
+	struct LogThreadSinkCounters
+	{
+		std::atomic<uint64_t> records;
+		std::atomic<uint64_t> filtered;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> ioErrors;
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> timeNs;
+		std::atomic<uint64_t> latency[LOG_STATS_LATENCY_BUCKETS];
+
+		LogThreadSinkCounters() { Reset(); }
+		void Reset();
+		void AddTo(LogSinkStats &stats);
+		void Add(const LogSinkStats &stats);
+	};
+
+	// Statistics counters of one thread, only that thread writes them so an increment is a relaxed load and store.
+	// Padded on both sides, threads never share a cache line. Logger::GetStats sums up all threads.
+	// Sinks are counted in 'sinks', indexed by the stats slot the sink got when it was added.
+	struct LogThreadCounters
+	{
+		char pad0[64];
+		std::atomic<uint64_t> produced[LOG_STATS_LEVELS];
+		std::atomic<uint64_t> filteredEarly;
+		std::atomic<uint64_t> filteredLate;
+		std::atomic<uint64_t> bufferAllocs;
+		std::atomic<uint64_t> bufferFrees;
+		std::atomic<uint64_t> bufferGrows;
+		std::atomic<uint64_t> rateLimited;
+		std::atomic<uint64_t> sampledOut;
+		std::atomic<uint64_t> duplicates;
+		LogThreadSinkCounters sinks[LOG_STATS_MAX_SINKS];
+		char pad1[64];
+
+		LogThreadCounters();
+		void AddTo(LogStats &stats);
+		static __inline void Inc(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+			counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+	};
+
+	// Keeps track of the counters of all threads, the counts of exited threads are folded in to 'exited'
+	class LogStatsRegistry
+	{
+	public:
+		static LogStatsRegistry &Instance();
+
+		LogThreadCounters *Register();
+		void Unregister(LogThreadCounters *pCounters);
+		void Collect(LogStats &stats);
+
+		// A slot for the counters of a sink, -1 when all are taken. Released once no thread can write the sink.
+		int AcquireSinkSlot();
+		void ReleaseSinkSlot(int slot);
+		void CollectSink(int slot, LogSinkStats &stats);
+	private:
+		LogStatsRegistry();
+	private:
+		LogMutex lock;
+		std::vector<LogThreadCounters *> threads;
+		LogThreadCounters exited;
+		bool sinkSlotInUse[LOG_STATS_MAX_SINKS];
+	};
+
+	// Generic cell rate algorithm, the whole state is the 'theoretical arrival time' of the next record.
+	// A record is accepted unless it is more than 'tolerance' ahead of its slot, one CAS when accepted.
+	class LogRateLimiter
+	{
+	public:
+		LogRateLimiter();
+
+		// perSecond <= 0 - no limit, burst <= 0 - one second worth of records
+		void Configure(double perSecond, int burst);
+		__inline bool IsActive() { return (interval.load(std::memory_order_relaxed) > 0); }
+		bool Accept(int64_t tNow);
+		__inline uint64_t TakeSuppressed() { return nSuppressed.exchange(0, std::memory_order_relaxed); }
+	private:
+		std::atomic<int64_t> interval;		// ns between records
+		std::atomic<int64_t> tolerance;		// (burst - 1) * interval
+		std::atomic<int64_t> tat;
+		std::atomic<uint64_t> nSuppressed;
+	};
+
+	// Rate limit and sampling state of a logger, allocated the first time a limit applies and kept
+	struct LogLimits
+	{
+		LogRateLimiter rate;
+		std::atomic<int> sampleEvery;		// keep one in n DEBUG/INFO records, 0 or 1 keeps all
+		std::atomic<uint32_t> sampleTick;
+		std::atomic<uint64_t> nSampledOut;
+		std::atomic<int64_t> tNextSummary;
+		LogLimits();
+	};
+
+	// Duplicate suppression state of a logger, see Logger::Deduplicate
+	// Records are compared on level, length and a 64 bit hash of the formatted message
+	struct LogDedupState
+	{
+		LogMutex lock;					// records are dispatched from any thread in sync mode
+		std::atomic<int64_t> window;	// ns, 0 - off
+		uint64_t hash;
+		int len;
+		int level;
+		int64_t tWindowStart;
+		LogCapture last;				// the last repeat, the 'repeated' line gets its time and thread
+		uint64_t nRepeated;
+		LogDedupState();
+	};
+
+	// Call sites seen while the call site rate limit is active, keyed on the format string pointer.
+	// Slots are claimed with a CAS and never freed, call sites not finding a slot are not limited.
+	class LogCallSiteTable
+	{
+	public:
+		struct CallSite
+		{
+			std::atomic<const char *> sFormat;
+			LogRateLimiter rate;
+			std::atomic<int64_t> tNextSummary;
+			std::atomic<Logger *> pLogger;		// the last one suppressed here, writes the summary
+			std::atomic<int> level;
+		};
+	public:
+		LogCallSiteTable();
+
+		CallSite *Find(const char *sFormat, int64_t tNow);
+		void Configure(double perSecond, int burst);
+		__inline CallSite &At(int idx) { return slots[idx]; }
+	private:
+		CallSite slots[LOG_CALLSITE_SLOTS];
+		std::atomic<double> perSecond;
+		std::atomic<int> burst;
+	};
+
+#ifdef LOGGER_HAVE_PTHREADS
+	// Background thread shared by the sinks for slow file system work, jobs are run in the order they are posted
+	// The thread also runs one periodic timer, used by Logger for the suppression summaries
+	class LogHousekeeper
+	{
+	public:
+		static LogHousekeeper &Instance();
+
+		void Post(const std::function<void()> &job);
+		void WaitIdle();
+		// Replaces the timer, an empty function stops it - returns once a tick in progress is done
+		void SetTimer(const std::function<void()> &tick, int intervalMs);
+	private:
+		LogHousekeeper();
+		bool StartThread();
+		static void *ThreadFunc(void *arg);
+		void Run();
+	private:
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		pthread_cond_t idleCond;
+		std::deque<std::function<void()> > jobs;
+		bool bBusy;
+		bool bThreadStarted;
+		pthread_t thread;
+		std::function<void()> timer;
+		int timerIntervalMs;
+		bool bTicking;
 	};
+#endif
+
+	// Hash index of all created loggers, keyed on (name, prefix) - a NULL prefix is a key of its own
+	// Find is lock-free, Insert/Clear must be called with the lock held. Open addressing with linear probing,
+	// slots are never emptied so a reader sees either NULL (end of probe) or a fully published logger.
+	// Growing publishes a new table, the old one is retired but kept since readers might still be probing it.
+	class LogRegistry
+	{
+	public:
+		LogRegistry();
+		virtual ~LogRegistry();
+
+		ILogger *Find(const char *name, const char *prefix);
+		void Insert(ILogger *pLogger);
+		void Clear();
+
+		__inline void Lock() { lock.Lock(); }
+		__inline void Unlock() { lock.Unlock(); }
+	private:
+		struct Slot
+		{
+			uint32_t hash;		// written before pLogger is published
+			std::atomic<ILogger *> pLogger;
+		};
+		struct Table
+		{
+			size_t mask;
+			Slot *slots;
+		};
+		static uint32_t Hash(const char *name, const char *prefix);
+		static Table *AllocTable(size_t nSlots);
+		static void Place(Table *pTable, uint32_t hash, ILogger *pLogger);
+	private:
+		LogMutex lock;
+		std::atomic<Table *> table;
+		std::vector<Table *> retired;
+		size_t nEntries;
+	};
+
+	// The sinks as an immutable snapshot, a contiguous array which is never changed once published
+	struct LogSinkSnapshot
+	{
+		std::vector<ILogOutputSink *> sinks;
+		std::vector<int> statsSlots;			// stats slot of each sink, see LogStatsRegistry::AcquireSinkSlot
+		std::vector<ILogOutputSink *> dropped;	// left out of the next snapshot, closed and deleted with this one
+		std::vector<int> droppedSlots;
+	};
+
+	// Readers pin the current snapshot in a hazard slot of their own, no lock is taken on the log path.
+	// Writers are serialized by the lock, they publish a new snapshot and retire the old one. Retired snapshots
+	// are reclaimed in order once no slot points at them. A writer waits for the readers, except when it is called
+	// from inside a sink - what is still pinned then is reclaimed by a later writer or flush.
+	class LogSinkSet
+	{
+	public:
+		static LogSinkSet &Instance();
+
+		// Nested pins on the same thread share the outermost snapshot
+		LogSinkSnapshot *Pin();
+		void Unpin();
+
+		// Copies the current sinks, lets 'edit' change the copy (moving sinks to 'dropped') and publishes it
+		void Update(const std::function<void(std::vector<ILogOutputSink *> &sinks, std::vector<ILogOutputSink *> &dropped)> &edit);
+		void Reclaim(bool bWait);
+	public:
+		// Hazard slot, one per thread
+		struct Slot
+		{
+			std::atomic<LogSinkSnapshot *> pSnapshot;
+			std::atomic<bool> bInUse;
+			Slot *pNext;	// slots are never freed, a slot is handed to the next new thread when its thread exits
+		};
+	private:
+		LogSinkSet();
+		Slot *AcquireSlot();
+		bool IsPinned(LogSinkSnapshot *pSnapshot);
+		static void Destroy(LogSinkSnapshot *pSnapshot);
+	private:
+		LogMutex lock;
+		std::atomic<LogSinkSnapshot *> current;
+		std::atomic<Slot *> slots;
+		std::deque<LogSinkSnapshot *> retired;
+	};
+
+	// Pins the sink snapshot for the lifetime of the reader, iterate with 'for (auto pSink : reader)'
+	class LogSinkReader
+	{
+	public:
+		LogSinkReader() : pSnapshot(LogSinkSet::Instance().Pin()) {}
+		virtual ~LogSinkReader() { LogSinkSet::Instance().Unpin(); }
+
+		__inline ILogOutputSink *const *begin() const { return pSnapshot->sinks.data(); }
+		__inline ILogOutputSink *const *end() const { return pSnapshot->sinks.data() + pSnapshot->sinks.size(); }
+		__inline size_t size() const { return pSnapshot->sinks.size(); }
+		__inline int StatsSlot(ILogOutputSink *const *it) const { return pSnapshot->statsSlots[it - begin()]; }
+	private:
+		LogSinkSnapshot *pSnapshot;
+	};
+
+#ifdef LOGGER_HAVE_PTHREADS
+	#define ASYNC_WRITER_BATCH_SIZE 64					// records handed to the sinks per call
+
+	// Background writer for the async mode, producers push captured records to the ring and
+	// the writer thread drains them to the sinks in ring order.
+	class LogAsyncWriter
+	{
+	public:
+		typedef enum
+		{
+			kQueued,
+			kDropped,
+			kStopped,
+		} PushResult;
+	public:
+		LogAsyncWriter(int nCapacity, bool bDropWhenFull);
+		virtual ~LogAsyncWriter();
+
+		// Start and Stop must be serialized by the caller, see Logger::EnableAsync
+		bool Start(bool bDropWhenFull);
+		void Stop();
+		PushResult Push(const LogCapture &rec);
+		void WaitDrained();
+
+		__inline bool IsRunning() { return bAccepting.load(std::memory_order_acquire); }
+		__inline bool IsWriterThread() { return (bThreadStarted.load(std::memory_order_acquire) && pthread_equal(pthread_self(), thread)); }
+		__inline size_t Capacity() { return queue.Capacity(); }
+		__inline uint64_t GetDropCount() { return nDropped.load(std::memory_order_relaxed); }
+	private:
+		static void *ThreadFunc(void *arg);
+		void Run();
+		int Drain();
+		void Wakeup();
+	private:
+		LogBoundedQueue<LogCapture> queue;
+		pthread_mutex_t drainLock;
+		LogCapture batch[ASYNC_WRITER_BATCH_SIZE];
+		LogRecord records[ASYNC_WRITER_BATCH_SIZE];
+		std::atomic<bool> bDropWhenFull;
+		std::atomic<bool> bThreadStarted;
+		std::atomic<int> nPushing;	// producers between the 'accepting' check and the push, Stop waits for them
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		std::atomic<bool> bAccepting;
+		std::atomic<bool> bRunning;
+		std::atomic<bool> bSleeping;
+		std::atomic<uint64_t> nDropped;
+		std::atomic<size_t> nDispatched;
+	};
+#endif
 
 	typedef std::pair<std::string, std::string> strStrPair;
 